@@ -0,0 +1,133 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Indexed columnar store of the association results (.fastGWA.gas)
+
+   The results are cut into blocks of one chromosome, each column of a block is a zstd frame.
+   Blocks are indexed by the position range and the smallest p-value, and the SNP names by
+   a sorted hash table, thus a region, a p-value threshold or a SNP list can be extracted by
+   decompressing the matched blocks only.
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_ASSOCSTORE_H
+#define GCTA2_ASSOCSTORE_H
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdint>
+#include "MappedFile.h"
+
+using std::string;
+using std::vector;
+using std::map;
+
+// 64 bytes, followed by the blocks, then at index_offset (aligned to 8 bytes)
+//   the header line of the text results of byte_names, padded to 8 bytes,
+//   AssocBlockIndex[num_block], each followed by uint64_t frame_end[num_frame] from the block offset,
+//   AssocSNPIndex[num_marker] sorted by the hash
+// frames of a block: marker (CHR\tSNP\tPOS\tA1\tA2\n), uint32_t POS, uint32_t N, uint8_t valid,
+//   then a double frame for each of the num_value columns (AF1, the statistics, INFO)
+struct AssocStoreHeader{
+    char magic[4];      // GASC
+    uint32_t version;   // 1
+    uint64_t num_marker;
+    uint64_t num_block;
+    uint32_t num_value;
+    uint32_t p_value;   // value column of the p-value to be indexed
+    uint64_t byte_names;
+    uint64_t index_offset;
+    uint32_t reserved[4];
+};
+
+struct AssocBlockIndex{
+    uint32_t chr;
+    uint32_t num_marker;
+    uint32_t pos_min;
+    uint32_t pos_max;
+    double p_min;       // NaN if no valid marker
+    uint64_t offset;
+    uint64_t first_marker;
+};
+
+struct AssocSNPIndex{
+    uint64_t hash;
+    uint32_t block;
+    uint32_t row;
+};
+
+class AssocStoreWriter {
+public:
+    // header: columns of the text results, the first 6 are CHR SNP POS A1 A2 N
+    AssocStoreWriter(string filename, const vector<string> &header, uint32_t p_value);
+    ~AssocStoreWriter();
+
+    // values: num_value items; the statistics are NA if not valid
+    void add(const string &marker_str, uint32_t chr, uint32_t N, bool valid, const double *values);
+    void close();
+
+private:
+    string filename;
+    FILE *h_out = NULL;
+    AssocStoreHeader head;
+    string names;
+    uint64_t offset = 0;
+
+    string markers;
+    vector<uint32_t> pos, N;
+    vector<uint8_t> valids;
+    vector<vector<double>> values;
+    uint32_t cur_chr = 0;
+
+    vector<AssocBlockIndex> blocks;
+    vector<uint64_t> frame_ends;
+    vector<AssocSNPIndex> snp_index;
+    vector<char> frame;
+
+    void flushBlock();
+    void writeFrame(const void *data, uint64_t size);
+};
+
+class AssocStore {
+public:
+    AssocStore(string filename);
+
+    // chr 0: all chromosomes; p_thresh < 0: no threshold; snps empty: all SNPs
+    void query(uint32_t chr, uint32_t from_bp, uint32_t to_bp, double p_thresh,
+            const vector<string> &snps, string out_name);
+
+    static const uint32_t version = 1;
+    static const uint32_t block_size = 16384;
+    static const string suffix;
+    static uint64_t hashName(const char *name, uint64_t length);
+
+    static int registerOption(map<string, vector<string>>& options_in);
+    static void processMain();
+
+private:
+    MappedFile file;
+    AssocStoreHeader header;
+    string names;
+    vector<AssocBlockIndex> blocks;
+    vector<const uint64_t *> frame_ends;
+    const AssocSNPIndex *snp_index = NULL;
+    uint32_t num_frame;
+
+    bool readFrame(uint32_t block, uint32_t frame, void *data, uint64_t size) const;
+
+    static map<string, string> options;
+    static map<string, double> options_d;
+    static vector<string> processFunctions;
+};
+
+#endif //GCTA2_ASSOCSTORE_H
@@ -24,10 +24,16 @@
 #include "Geno.h"
 #include "Pheno.h"
 #include "Marker.h" 
+#include "AssocStore.h"
 #include "Eigen/Dense"
 #include "Eigen/Sparse"
 #include <vector>
 #include <mutex>
+#include <memory>
+#include <fstream>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 #include <omp.h>
 
 using Eigen::Map;
@@ -62,6 +68,8 @@ public:
     void calculate_mixed_2df_sandwich(uintptr_t *geno, const vector<uint32_t> &markerIndex);
     void output_res(const vector<uint8_t> &isValids, const vector<uint32_t> markerIndex);
     void output_res_2df(const vector<uint8_t> &isValids, const vector<uint32_t> markerIndex);
+    void calculate_multi(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    void output_res_multi(const vector<uint8_t> &isValids, const vector<uint32_t> &markerIndex);
 
     //void readGenoSample(uint64_t *buf, int num_marker);
     void genRandY(uint64_t *buf, int num_marker);
@@ -82,11 +90,19 @@ public:
     void conditionCovarReg(Eigen::Ref<VectorXd> pheno);
     void conditionCovarReg(VectorXd &pheno, VectorXd &condPheno);
     void conditionCovarBinReg(Eigen::Ref<VectorXd> y);
+    // decode markers of the buffer into an n * cols panel and regress out the covariates by GEMM;
+    //   markers [start, start + cols) of subset if it is given
+    int panelWidth(int num_marker) const;
+    void getCondGenoPanel(uintptr_t *genobuf, const vector<uint32_t> &markerIndex, int start, int cols,
+            MatrixXd &xPanel, vector<GenoBufItem> &items, bool bCondition, MatrixXd *xRaw = NULL,
+            const vector<int> *subset = NULL);
 
     
     static int registerOption(map<string, vector<string>>& options_in);
     static void processMain();
     void processFAM(vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks);
+    // fit each phenotype of --mpheno, then test all of them in one genotype sweep
+    void processMultiPheno();
     //void processFAM();
 
 
@@ -155,6 +171,14 @@ private:
     void inverseFAM(SpMat& fam, double VG, double VR);
     void makeIH(MatrixXd &X);
     void grammar(SpMat& fam, double VG, double VR);
+    // Vg of the sparse GRM, then force or constrain it; isSig turns false for linear regression
+    double estimateVG(const SpMat &fam, const VectorXd &pheno, bool &isSig);
+    void constrainVG(double Vpheno, double &VG, double &VR, bool &isSig);
+    // sample the null SNPs of GRAMMAR-gamma and sweep them with the tuning filters
+    vector<uint32_t> getGrammarMarkers(int num_marker_rand);
+    void loopGrammar(const vector<uint32_t> &marker_index, function<void (uintptr_t *, const vector<uint32_t> &)> callBack);
+    // connected components of the sparse GRM, members in ascending order
+    static vector<vector<int64_t>> getFamilies(const SpMat &fam);
 
     static map<string, string> options;
     static map<string, double> options_d;
@@ -183,6 +207,94 @@ private:
     string sFileName;
 
     std::ofstream osOut;
+    void setDefaultFilters();
+
+    // text results of the finished blocks, formatted and written to osOut by the writer thread
+    struct ResBlock{
+        int num_stat;
+        vector<uint32_t> markerIndex;
+        vector<uint8_t> isValids;
+        vector<uint32_t> N;
+        vector<double> af;
+        vector<double> info;
+        vector<double> stats;  // num_stat values of each valid marker
+    };
+    std::deque<std::unique_ptr<ResBlock>> resQueue;
+    std::mutex resMutex;
+    std::condition_variable resCond;
+    std::thread resWriter;
+    bool bResWriter = false;
+    bool bResDone = false;
+    void startResWriter();
+    void stopResWriter();
+    std::unique_ptr<ResBlock> newResBlock(const vector<uint8_t> &isValids, const vector<uint32_t> &markerIndex, int num_stat);
+    void pushResBlock(std::unique_ptr<ResBlock> block);
+    void writeResBlock(const ResBlock &block, string &lines);
+    std::unique_ptr<AssocStoreWriter> assocStore;
+
+    // multiple phenotypes: a column of multiR per phenotype, Vi_y / c_inf of the mixed model or
+    //   the adjusted phenotype of linear regression
+    struct TraitModel{
+        int col;     // column in the phenotype file
+        bool bMLM;
+        double VG, VR;
+        double c_inf;
+        double SSy;
+        double iN;
+    };
+    bool bMultiPheno = false;
+    MatrixXd multiY;  // phenotypes adjusted for the covariates
+    SpMat multiFam;   // the GRM and covariates are read once for all the phenotypes
+    void fitTraitModel(uint32_t trait);
+    // GRAMMAR-gamma of all the mixed-model phenotypes in one sweep of the null SNPs: V = Vg * A + Ve * I
+    //   is solved in the eigen space of each family block of A = U * diag(lambda) * U'
+    vector<vector<int64_t>> multiFamilies;
+    vector<MatrixXd> multiU;  // empty for the unrelated samples
+    vector<int64_t> multiStart;
+    VectorXd multiLambda;
+    MatrixXd multiW;     // 1 / (Vg * lambda + Ve) of each phenotype
+    MatrixXd multiCinf;
+    void multiGrammar();
+    void multiGrammarFunc(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
+    void famEigenProject(const MatrixXd &src, MatrixXd &dst, bool bBack);
+
+    // buffers reused across the marker blocks and threads
+    MatrixXd panelGeno;
+    MatrixXd panelRawGeno;
+    vector<GenoBufItem> panelItems;
+    vector<vector<double>> threadCovarScratch;  // H * y of conditionCovarBinReg
+    vector<vector<uint32_t>> threadIndex0;      // carriers in SPA
+
+    // rare variants as carriers: x = base + (value - base) on the carriers, tested in O(#carriers * #covar)
+    //   with the sums over all the samples below; x_adj = x - C * h, h = H * x
+    struct CarrierModel{
+        bool bReady = false;
+        bool bAdjust = false;
+        VectorXd r, w;  // r: residual of the score, w: weights of the variance
+        double sum_r, sum_y, sum_w;
+        VectorXd H1, C1, Ctr, Cty, CtW1;
+        MatrixXd CtWC;
+        MatrixXd covarT;
+        vector<GenoCarriers> threadCarriers;
+        vector<VectorXd> threadH;  // h and C' * W * x
+        vector<vector<double>> threadG;  // adjusted genotypes of the carriers in SPA
+        vector<VectorXd> threadX;        // x_adj of all the samples in SPA, allocated on the first use
+    };
+    struct CarrierStat{
+        double xtr;
+        double xtWx;
+        double xty;
+        double xt1;
+    };
+    CarrierModel carrierModel;
+    const double maxCarrierRate = 0.05;
+    void initCarrierModel(const VectorXd &r, const VectorXd &w, bool bAdjust);
+    // raw: x; adj: x_adj, the same as raw if the covariates are not adjusted
+    void carrierStats(const GenoCarriers &carriers, CarrierStat &raw, CarrierStat &adj, double *h) const;
+    vector<TraitModel> traitModels;
+    MatrixXd multiR;
+    int multiBufSize = 0;
+    vector<std::unique_ptr<std::ofstream>> osOuts;
     FILE * bOut = NULL;
     vector<char> osBuf;
     uint32_t numMarkerOutput = 0;
@@ -25,11 +25,25 @@
 #include <cmath>
 #include "constants.hpp"
 #include "mem.hpp"
+#include "GRMView.h"
+#include <memory>
 
 using std::string;
 using std::vector;
 using std::pair;
 
+// unnormalised GRM accumulators (.grm.acc), 64 bytes, followed by the lower triangle row by row,
+//   row i: double sum of products[i + 1], uint32_t number of SNPs non-missing in both samples[i + 1]
+struct GRMAccHeader{
+    char magic[4];    // GACC
+    uint32_t version; // 1
+    uint64_t num_indi;
+    uint64_t num_marker; // valid SNPs
+    double sum_sd;       // for --make-grm-alg 1
+    uint32_t isDominance;
+    uint32_t reserved[7];
+};
+
 class GRM {
 public:
     GRM(Pheno *pheno, Marker *marker);
@@ -50,7 +64,7 @@ public:
     void calculate_GRM_blas(uintptr_t* genobuf, const vector<uint32_t> &markerIndex);
     
     void grm_thread(int grm_index_from, int grm_index_to);
-    void N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cmask);
+    void N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cmask, uint32_t group = 0);
     void deduce_GRM();
     vector<uint32_t> divide_parts(uint32_t from, uint32_t to, uint32_t num_parts);
     vector<uint32_t> divide_parts_mem(uint32_t n_sample, uint32_t num_parts);
@@ -59,13 +73,17 @@ public:
     static void processMain();
     void processMakeGRM();
     void processMakeGRMX();
+    void processMakeSparseGRM();
 
     void loop_block(vector<function<void (double *buf, int num_block)>> callbacks
                     = vector<function<void (double *buf, int num_block)>>());
     void cut_rel(float thresh, bool no_grm = false);
+    static vector<int> cut_rel_remove(const vector<int> &id1, const vector<int> &id2);
     void prune_fam(float thresh, bool isSparse = true, float *val = NULL);
     void unify_grm(string mgrm_file, string out_file);
     void subtract_grm(string mgrm_file, string out_file);
+    void merge_grm(string mgrm_file, string out_file);
+    void save_compact(string encoding_name, bool bZstd);
 
 private:
     Pheno *pheno = NULL;
@@ -115,6 +133,7 @@ private:
     double *stdGeno = NULL;
 
     void output_id();
+    void output_id(const string &out_name);
 
     string o_name;
 
@@ -124,21 +143,58 @@ private:
     static vector<string> processFunctions;
 
     string grm_file;
-    int num_byte_buffer;
     uint64_t num_subjects;
     vector<string> grm_ids;
-    const int num_byte_GRM_read = 100 * 1024 * 1024;
-    vector<uint64_t> byte_part_grms;
-
-    void outBinFile(FILE *sFile, FILE *dFile);
+    std::unique_ptr<GRMView> grm_view;
+    std::unique_ptr<GRMView> N_view; // NULL if there is no .grm.N.bin
 
     bool isDominance = false;
     bool isMtd = false;
     int nMarkerBlock = 128;
     vector<double> sd;
+    vector<double> sample_scale; // GRM(i, j) is scaled by sample_scale[i] * sample_scale[j] if not empty, e.g. chr X males
     uint32_t numValidMarkers = 0;
 
     GenoBufItem *gbufitems = NULL;
+    float getMtdWeight();
+    float getMtdWeight(double sum_sd, uint32_t num_valid);
+
+    // marker groups accumulated in one genotype sweep (chromosomes for LOCO);
+    // group g is at grm + g * grm_stride, N + g * N_stride and sub_miss + g * miss_stride
+    uint32_t num_group = 1;
+    vector<int32_t> marker_group; // group of each extracted marker, empty if only one group
+    vector<string> group_names;
+    vector<uint32_t> group_valid_markers;
+    vector<double> group_sum_sd; // sum of sd (or its square for dominance) for --make-grm-alg 1
+    uint64_t grm_stride = 0;
+    uint64_t N_stride = 0;
+    uint64_t miss_stride = 0;
+    bool bLOCO = false;
+    bool bAppend = false; // --grm-append: only the rows of new samples are computed
+    void common_grm_id(const vector<string> &files, vector<vector<string>> &ids, vector<string> &common_id);
+    std::unique_ptr<MappedFile> acc_file; // .grm.acc of --grm-acc-add or --grm-acc-subtract
+    void read_acc_row(uint32_t row, vector<double> &row_grm, vector<uint32_t> &row_N);
+    void init_groups();
+    void sum_groups(uint32_t total);
+    void accumulate_GRM_blas(const vector<int> &validIndex, int start, int num, uint32_t group);
+    void deduce_GRM(const string &out_name, uint32_t group, int32_t sub_group = -1);
+
+    // direct sparse GRM: KING-robust prescreen on thinned SNPs, then exact GRM of candidate pairs only
+    bool bDirectSparse = false;
+    void king_func(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    void sparse_grm_func(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    uint32_t num_king_word = 0;
+    uint32_t num_king_marker = 0;
+    uint64_t *king_hom0 = NULL; // bit planes, sample major
+    uint64_t *king_het = NULL;
+    uint64_t *king_hom2 = NULL;
+    vector<uint32_t> cand_id1; // candidate pairs, id1 > id2, sorted by id1 then id2
+    vector<uint32_t> cand_id2;
+    vector<double> cand_grm;
+    vector<uint32_t> cand_miss; // markers missing in both samples
+    vector<int32_t> cand_row;   // row of the sample in the transposed genotype panel, -1 if not in any pair
+    vector<uint64_t> cand_miss_bits;
+    vector<double> diag_grm;
 
     //Just for testing
 #ifndef NDEBUG
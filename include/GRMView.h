@@ -0,0 +1,121 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Memory-mapped view of a lower-triangular binary GRM (.grm.bin or .grm.N.bin).
+   Samples kept or removed are an index map over the file, nothing is copied
+   until a consumer asks for it.
+   The compact files (half precision, a constant, zstd tiles) are recognized by
+   the header and decoded on access: the items without compression straight from
+   the map, the zstd tiles through a small LRU cache of each thread.
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_GRMVIEW_H
+#define GCTA2_GRMVIEW_H
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include "MappedFile.h"
+
+using std::string;
+using std::vector;
+
+// compact GRM in place of the float .grm.bin or .grm.N.bin, 64 bytes, followed by
+//   ENC_CONSTANT: nothing, all the items are [constant];
+//   no compression: the lower triangle in the encoding;
+//   zstd: uint64_t index[num_tiles + 1][2] of (first row, byte offset from the end of the index),
+//         then one zstd frame of the encoded rows for each tile.
+struct GRMCompactHeader{
+    char magic[4];     // GCGR
+    uint32_t version;  // 1
+    uint64_t num_indi;
+    uint32_t encoding;
+    uint32_t compress; // 0: none, 1: zstd
+    uint64_t num_tiles;
+    float constant;
+    uint32_t reserved[7];
+};
+
+class GRMView {
+public:
+    enum Encoding : uint32_t {ENC_FLOAT = 0, ENC_FP16 = 1, ENC_BF16 = 2, ENC_CONSTANT = 3};
+
+    // map [filename] of num_subjects samples; all samples are kept in the file order
+    GRMView(string filename, uint64_t num_subjects, bool bSequential = false);
+
+    uint64_t rawSize() const {return num_raw;}
+    // NULL for a constant or compressed GRM, use rawRow or rawAt instead
+    const float *rawData() const {return data;}
+    // row raw_index of the lower triangle, raw_index + 1 items; the row of a compact file is decoded
+    //   into a buffer of the calling thread, valid until its next rawRow
+    const float *rawRow(uint64_t raw_index) const {
+        return data ? data + raw_index * (raw_index + 1) / 2 : compactRow(raw_index);
+    }
+    float rawAt(uint64_t i, uint64_t j) const {
+        if(bConstant) return constant;
+        if(i < j) std::swap(i, j);
+        return data ? data[i * (i + 1) / 2 + j] : compactAt(i, j);
+    }
+    bool isConstant() const {return bConstant;}
+
+    // index into the samples of the file, the order is kept in the view
+    void setKeep(const vector<uint32_t> &index);
+    const vector<uint32_t> &getKeep() const {return keep;}
+    uint64_t size() const {return keep.size();}
+    float operator()(uint64_t i, uint64_t j) const {return rawAt(keep[i], keep[j]);}
+
+    // save the kept samples as a lower-triangular binary GRM, float or compact
+    void save(string filename, uint32_t encoding = ENC_FLOAT, bool bZstd = false) const;
+    // true if all the kept items are the same [value]
+    bool keptConstant(float &value) const;
+    // rows [raw_from, raw_to] are not needed any more, their pages and cached tiles are dropped;
+    //   not to be called while other threads read the view
+    void release(uint64_t raw_from, uint64_t raw_to) const;
+
+private:
+    MappedFile file;
+    const float *data = NULL;
+    uint64_t num_raw;
+    vector<uint32_t> keep;
+
+    bool bConstant = false;
+    float constant = 0.0f;
+
+    uint32_t encoding = ENC_FLOAT;
+    uint32_t item_bytes = sizeof(float);
+    const char *body = NULL;       // items of a compact file without compression
+    const char *frames = NULL;     // zstd tiles
+    vector<uint64_t> tile_rows;    // first row of each tile, num_raw at the end
+    vector<uint64_t> tile_offsets; // offset of each frame from frames, the total size at the end
+
+    static const int cache_tiles = 2;
+    struct TileCache{
+        uint64_t tile[cache_tiles];
+        uint64_t last_use[cache_tiles];
+        vector<float> items[cache_tiles];
+        uint64_t clock = 0;
+        vector<char> encoded;
+        vector<float> row;
+    };
+    mutable vector<TileCache> caches; // of each OpenMP thread
+    vector<float> decoded; // all the items, only if the kept samples of zstd tiles are not in the file order
+
+    void openCompact();
+    const float *compactRow(uint64_t raw_index) const;
+    float compactAt(uint64_t i, uint64_t j) const;
+    const float *getTile(uint64_t tile) const;
+    void decodeTile(uint64_t tile, float *out) const;
+    void decodeAll();
+};
+
+#endif //GCTA2_GRMVIEW_H
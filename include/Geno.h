@@ -82,6 +82,13 @@ typedef struct GenoBufItem{
     uint32_t nValidAllele;
 } GenoBufItem;
 
+// genotypes of a marker as the value of most samples and the samples of other values
+typedef struct GenoCarriers{
+    double base;
+    vector<uint32_t> index; // ascending
+    vector<double> value;
+} GenoCarriers;
+
 
 class Geno {
 public:
@@ -116,6 +123,7 @@ public:
     static void processMain();
     bool filterMAF();
     static void setSexMode();
+    static void getBedCodes(bool bDom, bool isEffRev, double mu, double center_value, double rdev, double *codes);
     uint32_t getTotalMarker();
 
 // seq read start;
@@ -131,14 +139,29 @@ public:
     // new loop subset manner
     void preGenoDouble(int numMarkerBuf, bool bMakeGeno, bool bGenoCenter, bool bGenoStd, bool bMakeMiss);
     void getGenoDouble(uintptr_t *buf, int bufIndex, GenoBufItem* gbuf);
+    // x'y and x'x of the marker from the packed hard calls, false if it shall be expanded by getGenoDouble
+    bool getGenoScore(uintptr_t *buf, int bufIndex, GenoBufItem* gbuf, const double *y, double sum_y, double &xty, double &xtx);
+    // genotypes of getGenoDouble as carriers from the packed hard calls, if no more than maxRate of the samples
+    //   differ from the most common genotype; false if it shall be expanded by getGenoDouble
+    bool getGenoCarriers(uintptr_t *buf, int bufIndex, GenoBufItem* gbuf, double maxRate, GenoCarriers &carriers);
     void endGenoDouble();
 
     void loopDouble(const vector<uint32_t> &extractIndex, int numMarkerBuf, bool bMakeGeno, bool bGenoCenter, bool bGenoStd, bool bMakeMiss, vector<function<void (uintptr_t *buf, const vector<uint32_t> &exIndex)>> callbacks = vector<function<void (uintptr_t *buf, const vector<uint32_t> &exIndex)>>(), bool showLog = true);
 
     bool getGenoHasInfo();
+    bool getHasPreAF();
 
     void setGRMMode(bool grm, bool dominace);
+    // the chr X male weight of the GRM is a per-sample scale: if deferred, it is not applied in decode,
+    // and the caller scales GRM(i, j) by the weights of samples i and j
+    void setDeferGRMMaleWeight(bool defer);
+    double getGRMMaleWeight();
+    // all markers are decoded regardless of the MAF, missingness and variance in the kept samples,
+    //   for the callers that standardise by the statistics of other samples, e.g. projection
+    void setNoFilter(bool noFilter);
     void setGenoItemSize(uint32_t &genoSize, uint32_t &missSize);
+    // the item of the calling thread, reused for every marker in loopDouble without allocations
+    GenoBufItem& getThreadGenoItem();
  
 private:
     Pheno* pheno;
@@ -289,6 +312,8 @@ private:
     bool bGRM = false;
     bool bGRMDom = false;
     int iGRMdc = -1; // 0 no male dosage comp; 1 full comp; //default value shall be -1, equal variance
+    bool bDeferGRMMaleWeight = false;
+    bool bNoFilter = false;
     int iDC = 1;
     bool f_std = false;
     void setMaleWeight(double &weight, bool &needWeight); // set the male weight by bGRM, dc specity
@@ -296,6 +321,8 @@ private:
     int8_t alleModel = 1; // 1: add; 2: Dom; 3: Reces; 4: Het; //currently unused affect a0 a1 a2 na;
 
     int curBufferIndex;
+    vector<GenoBufItem> threadGenoItems;
+    vector<vector<uintptr_t>> threadSubsetBufs;  // kept samples of getKeptGenoArray
     vector<int> numMarkersReadBlocks;
     vector<uint8_t> isMarkersSexXYs;
     vector<int> fileIndexBuf;
@@ -304,6 +331,8 @@ private:
     //BED format;
     void preGenoDouble_bed();
     void getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf);
+    bool getGenoValues_bed(uintptr_t *cur_buf, uint8_t isSexXY, GenoBufItem* gbuf, double *codes, double &center_value, double &rdev);
+    const uintptr_t *getKeptGenoArray(const uintptr_t *cur_buf);
     void endGenoDouble_bed();
     void readGeno_bed(const vector<uint32_t> &extractIndex);
     //BGEN format;
@@ -0,0 +1,47 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Read-only memory map of a whole file, falls back to reading the file
+   into memory on the platforms without mmap.
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_MAPPEDFILE_H
+#define GCTA2_MAPPEDFILE_H
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+using std::string;
+
+class MappedFile {
+public:
+    // bSequential: hint the kernel to read ahead aggressively
+    MappedFile(string filename, bool bSequential = false);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char *data() const {return mapped;}
+    uint64_t size() const {return mapped_size;}
+    const string &name() const {return filename;}
+
+    // pages in [offset, offset + length) are not needed any more, they are read again if touched
+    void release(uint64_t offset, uint64_t length) const;
+
+private:
+    string filename;
+    char *mapped = NULL;
+    uint64_t mapped_size = 0;
+};
+
+#endif //GCTA2_MAPPEDFILE_H
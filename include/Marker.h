@@ -56,6 +56,7 @@ public:
     //uint64_t getStartPosSize(uint32_t raw_index);
     void getStartPosSize(uint32_t raw_index, uint64_t &pos, uint64_t &size);
     bool isEffecRev(uint32_t extractedIndex);
+    uint8_t getChrExtract(uint32_t extractedIndex);
     bool isEffecRevRaw(uint32_t rawIndex);
     string get_marker(int rawindex, bool bflip=false);
     string getMarkerStrExtract(int extractindex, bool bflip=false);
@@ -64,6 +65,11 @@ public:
     static MarkerInfo extractBgenMarkerInfo(FILE *h_bgen, uint64_t &pos);
     static MarkerParam getBgenMarkerParam(FILE *h_bgen, string &outputs);
     void extract_marker(vector<string> markers, bool isExtract);
+    // extract index of the markers in the list, and their index in the list
+    void matchExtractName(const vector<string> &markers, vector<uint32_t> &extract_index, vector<uint32_t> &list_index);
+    // as matchExtractName, only the markers with the same two alleles are kept, and A_rev is set to take a1_list as the effect allele
+    void matchExtractAllele(const vector<string> &markers, const vector<string> &a1_list, const vector<string> &a2_list,
+            vector<uint32_t> &extract_index, vector<uint32_t> &list_index);
     void reset_exclude();
     void keep_raw_index(const vector<uint32_t>& keep_index);
     void keep_extracted_index(const vector<uint32_t>& keep_index);
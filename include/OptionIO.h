@@ -20,6 +20,7 @@
 #include <string>
 #include <map>
 #include <cstdio>
+#include <cstdint>
 #include "Logger.h"
 using std::map;
 using std::vector;
@@ -37,6 +38,9 @@ bool checkFileReadable(string filename);
 
 uint64_t getFileSize(FILE * file);
 
+// last modification time, 0 if not exists
+int64_t getFileMTime(string filename);
+
 template <typename T>
 void readBytes(FILE * file, int num_item, T* buffer){
     if(num_item != fread(buffer, sizeof(T), num_item, file)){
@@ -0,0 +1,111 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Approximate principal component analysis streamed from the genotypes
+
+   The top PCs of the GRM A = X X' / m are found by blocked power (subspace) iteration
+   with Rayleigh-Ritz projection, A * Q = X (X' Q) / m is computed in one genotype sweep,
+   thus the GRM is never formed and the memory is O(nk).
+   The PCs of new samples are projected from the SNP loadings in a genotype sweep as well.
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_PCA_H
+#define GCTA2_PCA_H
+#include "cpu.h"
+#include "Geno.h"
+#include "Pheno.h"
+#include "Marker.h"
+#include <Eigen/Dense>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <memory>
+#include "MappedFile.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+// binary SNP loadings (.pcl.bin), 64 bytes, followed by
+//   double record[num_marker][num_pc + 1]: mu (2 * frequency of A1), then the loadings on each PC
+//   SNP names and alleles (SNP\tA1\tA2\n) of byte_names
+struct PCLHeader{
+    char magic[4];    // GPCL
+    uint32_t version; // 1
+    uint64_t num_marker;
+    uint32_t num_pc;
+    uint32_t reserved0;
+    uint64_t byte_names;
+    uint32_t reserved[8];
+};
+
+class PCA {
+public:
+    PCA(Pheno *pheno, Marker *marker);
+    ~PCA();
+
+    void processPCAApprox();
+    void processProject();
+
+    static const string bin_suffix;
+
+    static int registerOption(map<string, vector<string>>& options_in);
+    static void processMain();
+
+private:
+    Pheno *pheno = NULL;
+    Marker *marker = NULL;
+    Geno *geno = NULL;
+
+    uint32_t num_indi = 0;
+    uint32_t num_pc = 0;
+    uint32_t num_block = 0;  // number of columns of the panels, num_pc + oversampling
+    uint32_t num_valid_markers = 0;
+    uint32_t num_loading_markers = 0;
+
+    const static int nMarkerBlock = 128;
+    GenoBufItem *gbufitems = NULL;
+    double *stdGeno = NULL; // standardized genotypes of valid markers in the current block
+
+    Eigen::MatrixXd Q;    // orthonormal panel of the current iteration
+    Eigen::MatrixXd Y;    // X (X' Q)
+    Eigen::VectorXd eval; // Ritz values in descending order
+    Eigen::MatrixXd evec; // Ritz vectors
+
+    std::ofstream o_pcl;
+    FILE *o_pcl_bin = NULL;
+    string pcl_names;
+
+    // loadings to project, from the memory-mapped .pcl.bin or the text .pcl
+    std::unique_ptr<MappedFile> pcl_file;
+    vector<double> pcl_buffer;
+    const double *pcl_records = NULL;
+    uint32_t pcl_num_pc = 0;
+    vector<string> pcl_snps, pcl_a1, pcl_a2;
+    vector<int32_t> marker_record; // record of each extracted marker, -1 if not projected
+    Eigen::MatrixXd PCs;
+    void readLoading(string prefix);
+    void project(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+
+    int decode(uintptr_t *buf, const vector<uint32_t> &markerIndex, vector<int> &validIndex);
+    void multiply(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    void loading(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    void output(string out_name);
+
+    static map<string, string> options;
+    static map<string, double> options_d;
+    static vector<string> processFunctions;
+};
+
+#endif //GCTA2_PCA_H
@@ -48,6 +48,10 @@ public:
     uint8_t extract_genobit(uint8_t * const buf, int index_in_keep);
     vector<uint32_t>& get_index_keep();
     void get_pheno(vector<string>& ids, vector<double>& pheno);
+    // phenotypes of multiple columns by --mpheno, the samples are those non-missing in all of them
+    uint32_t count_pheno();
+    int get_pheno_col(uint32_t trait);
+    void get_pheno(vector<string>& ids, vector<double>& pheno, uint32_t trait);
     void save_pheno(string filename);
     void filter_keep_index(vector<uint32_t>& k_index);
     void getMaskBit(uint64_t *maskp);
@@ -70,6 +74,9 @@ private:
     vector<string> mo_id;
     vector<int8_t> sex;
     vector<double> pheno;
+    vector<vector<double>> mphenos;     // on the samples of mpheno_index
+    vector<uint32_t> mpheno_index;
+    vector<int> mpheno_cols;
     vector<uint32_t> index_keep;
     vector<uint32_t> index_rm;
 
@@ -92,6 +99,7 @@ private:
     void read_checkMPSample(string m_file);
     void update_pheno(vector<string>& indi_marks, vector<double>& phenos);
     void update_sex(vector<string>& indi_marks, vector<double>& sex);
+    static vector<int> parse_mpheno(string mpheno);
     void init_mask_block();
     void init_bmask_block();
     void reinit();
@@ -0,0 +1,78 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Binary sparse GRM: write, convert from .grm.sp and memory-map for reading
+
+   The body is the full symmetric matrix in compressed sparse column (CSC) layout
+   with 64-bit indices, thus it can be viewed directly as
+   Eigen::SparseMatrix<double, ColMajor, long long> without parsing.
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_SPGRM_H
+#define GCTA2_SPGRM_H
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "MappedFile.h"
+
+using std::string;
+using std::vector;
+
+// 64 bytes, followed by
+//   long long outer[num_indi + 1], long long inner[num_nonzero], double value[num_nonzero],
+//   sample IDs (FID\tIID\n) of byte_ids
+struct SpGRMHeader{
+    char magic[4];    // GSPB
+    uint32_t version; // 1
+    uint64_t num_indi;
+    uint64_t num_nonzero; // both triangles and the diagonal
+    uint64_t byte_ids;
+    uint32_t checksum;  // CRC32 of all bytes after the header
+    uint32_t reserved[7];
+};
+
+class SpGRM {
+public:
+    // map [filename] read only; the header, size and column index are always checked,
+    //   the checksum of the whole body only if bCheckSum
+    SpGRM(string filename, bool bCheckSum = false);
+
+    uint64_t rows() const {return header.num_indi;}
+    uint64_t nonZeros() const {return header.num_nonzero;}
+    const long long *outerIndexPtr() const {return outer;}
+    const long long *innerIndexPtr() const {return inner;}
+    const double *valuePtr() const {return values;}
+    const vector<string> &getIDs() const {return ids;}
+    // mapped pages of [ptr, ptr + size) are not needed any more
+    void release(const void *ptr, uint64_t size) const;
+
+    // pairs are the lower triangle (id1 >= id2) indices of ids; diagonal items shall be included
+    static void write(string filename, const vector<string> &ids, const vector<uint32_t> &id1,
+            const vector<uint32_t> &id2, const vector<double> &grm);
+    // convert [sp_prefix].grm.sp + .grm.id to [filename]
+    static void convert(string sp_prefix, string filename);
+
+    static const uint32_t version = 1;
+    static const string suffix;
+
+private:
+    MappedFile file;
+    SpGRMHeader header;
+    vector<string> ids;
+    const long long *outer = NULL;
+    const long long *inner = NULL;
+    const double *values = NULL;
+};
+
+#endif //GCTA2_SPGRM_H
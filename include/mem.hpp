@@ -27,6 +27,23 @@
 #define posix_mem_free free
 #endif
 
+#include <cstdint>
+#include <string>
+
+// Zero [ptr, ptr + size) in parallel with a static schedule. Pages are placed on the NUMA node of
+// the thread touching them first, thus a buffer touched here is spread like the static compute loops;
+// this holds only if the OpenMP threads are bound (OMP_PROC_BIND), see log_numa_layout.
+void first_touch_zero(void *ptr, uint64_t size);
+
+// MemAvailable of /proc/meminfo in KB; 0 if unknown
+uint64_t getMemAvailKB();
+
+// NUMA nodes and their CPUs, e.g. "2 nodes (node0: 0-15; node1: 16-31)"; empty if unknown
+std::string numa_layout();
+
+// log the NUMA layout and the OpenMP binding once on multi-node machines, a hint is given if the threads are not bound
+void log_numa_layout();
+
 // These functions are only for test purpose, don't forget to remove calls
 int getVMemKB();
 int getMemKB();
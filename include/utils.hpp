@@ -40,6 +40,8 @@ std::string joinPath(const std::string & dir, const std::string & path);
 std::string getSSEvar();
 std::string getOSName();
 uint64_t getFileByteSize(FILE * file);
+// append value in the default format of std::ostream, %g of 6 significant digits
+void appendValue(std::string &str, double value);
 
 template <typename T>
 bool hasVectorDuplicate(const std::vector<T> &v){
@@ -11,8 +11,10 @@
  */
 
 #include "gcta.h"
+#include "GRMView.h"
 #include <iterator>
 #include <unordered_set>
+#include <random>
 
 void gcta::enable_grm_bin_flag() {
     _grm_bin_flag = true;
@@ -342,35 +344,23 @@ void gcta::read_grm_bin(string grm_file, vector<string> &grm_id, bool out_id_log
     if (read_id_only) return;
 
     string grm_binfile = grm_file + ".grm.bin";
-    ifstream A_bin(grm_binfile.c_str(), ios::in | ios::binary);
-    if (!A_bin.is_open()) LOGGER.e(0, "cannot open the file [" + grm_binfile + "] to read.");
+    GRMView A_bin(grm_binfile, n);
     _grm.resize(n, n);
     LOGGER << "Reading the GRM from [" + grm_binfile + "]." << endl;
-    int size = sizeof (float);
-    float f_buf = 0.0;
+    #pragma omp parallel for schedule(dynamic, 64) private(j)
     for (i = 0; i < n; i++) {
-        for (j = 0; j <= i; j++) {
-            if (!(A_bin.read((char*) &f_buf, size))) LOGGER.e(0, "Is the size of the [" + grm_binfile + "] file incorrect?");
-            _grm(j, i) = _grm(i, j) = f_buf;
-        }
+        for (j = 0; j <= i; j++) _grm(j, i) = _grm(i, j) = A_bin.rawAt(i, j);
     }
-    A_bin.close();
 
     if(!dont_read_N){
         string grm_Nfile = grm_file + ".grm.N.bin";
-        ifstream N_bin(grm_Nfile.c_str(), ios::in | ios::binary);
-        if (!N_bin.is_open()) LOGGER.e(0, "cannot open the file [" + grm_Nfile + "] to read.");
+        GRMView N_bin(grm_Nfile, n);
         _grm_N.resize(n, n);
         LOGGER << "Reading the number of SNPs for the GRM from [" + grm_Nfile + "]." << endl;
-        size = sizeof (float);
-        f_buf = 0.0;
+        #pragma omp parallel for schedule(dynamic, 64) private(j)
         for (i = 0; i < n; i++) {
-            for (j = 0; j <= i; j++) {
-                if (!(N_bin.read((char*) &f_buf, size))) LOGGER.e(0, "Is the size of the [" + grm_Nfile + "] file incorrect?");
-                _grm_N(j, i) = _grm_N(i, j) = f_buf;
-            }
+            for (j = 0; j <= i; j++) _grm_N(j, i) = _grm_N(i, j) = N_bin.rawAt(i, j);
         }
-        N_bin.close();
     }
 
     LOGGER << "GRM for " << n << " individuals are included from [" + grm_binfile + "]." << endl;
@@ -532,32 +522,54 @@ void gcta::merge_grm(string merge_grm_file) {
     else LOGGER << _n << " individuals in common in the GRM files." << endl;
 
     vector<int> kp;
-    eigenMatrix grm = eigenMatrix::Zero(_n, _n);
     eigenMatrix grm_N = eigenMatrix::Zero(_n, _n);
-    for (f = 0; f < grm_files.size(); f++) {
-        LOGGER << "Reading the GRM from the " << f + 1 << "th file ..." << endl;
-        read_grm(grm_files[f], grm_id);
-        StrFunc::match(uni_id, grm_id, kp);
-        for (i = 0; i < _n; i++) {
-            for (j = 0; j <= i; j++) {
-                if (kp[i] >= kp[j]) {
-                    grm(i, j) += _grm(kp[i], kp[j]) * _grm_N(kp[i], kp[j]);
-                    grm_N(i, j) += _grm_N(kp[i], kp[j]);
-                } else {
-                    grm(i, j) += _grm(kp[j], kp[i]) * _grm_N(kp[j], kp[i]);
-                    grm_N(i, j) += _grm_N(kp[j], kp[i]);
+    if (_grm_bin_flag) {
+        // the binary GRMs are memory-mapped and added in parallel, thus no GRM is read in whole
+        _grm.setZero(_n, _n);
+        for (f = 0; f < grm_files.size(); f++) {
+            LOGGER << "Reading the GRM from the " << f + 1 << "th file ..." << endl;
+            int n_f = read_grm_id(grm_files[f], grm_id, false, true);
+            StrFunc::match(uni_id, grm_id, kp);
+            GRMView A_bin(grm_files[f] + ".grm.bin", n_f, true);
+            GRMView N_bin(grm_files[f] + ".grm.N.bin", n_f, true);
+            #pragma omp parallel for schedule(dynamic, 64) private(j)
+            for (i = 0; i < _n; i++) {
+                for (j = 0; j <= i; j++) {
+                    double n_ij = N_bin.rawAt(kp[i], kp[j]);
+                    _grm(i, j) += A_bin.rawAt(kp[i], kp[j]) * n_ij;
+                    grm_N(i, j) += n_ij;
                 }
             }
         }
+    } else {
+        eigenMatrix grm = eigenMatrix::Zero(_n, _n);
+        for (f = 0; f < grm_files.size(); f++) {
+            LOGGER << "Reading the GRM from the " << f + 1 << "th file ..." << endl;
+            read_grm(grm_files[f], grm_id);
+            StrFunc::match(uni_id, grm_id, kp);
+            for (i = 0; i < _n; i++) {
+                for (j = 0; j <= i; j++) {
+                    if (kp[i] >= kp[j]) {
+                        grm(i, j) += _grm(kp[i], kp[j]) * _grm_N(kp[i], kp[j]);
+                        grm_N(i, j) += _grm_N(kp[i], kp[j]);
+                    } else {
+                        grm(i, j) += _grm(kp[j], kp[i]) * _grm_N(kp[j], kp[i]);
+                        grm_N(i, j) += _grm_N(kp[j], kp[i]);
+                    }
+                }
+            }
+        }
+        _grm = grm;
     }
+    _grm_N.resize(_n, _n);
+    #pragma omp parallel for schedule(dynamic, 64) private(j)
     for (i = 0; i < _n; i++) {
         for (j = 0; j <= i; j++) {
             if (grm_N(i, j) == 0) _grm(i, j) = 0;
-            else _grm(i, j) = grm(i, j) / grm_N(i, j);
+            else _grm(i, j) /= grm_N(i, j);
             _grm_N(i, j) = grm_N(i, j);
         }
     }
-    grm.resize(0, 0);
     grm_N.resize(0, 0);
     LOGGER << "\n" << grm_files.size() << " GRMs have been merged together." << endl;
 }
@@ -666,27 +678,49 @@ void gcta::grm_bK(string grm_file, string keep_indi_file, string remove_indi_fil
     output_grm(grm_out_bin_flag);
 }
 
-void gcta::pca(string grm_file, string keep_indi_file, string remove_indi_file, double grm_cutoff, bool merge_grm_flag, int out_pc_num)
+void gcta::pca(string grm_file, string keep_indi_file, string remove_indi_file, double grm_cutoff, bool merge_grm_flag, int out_pc_num, bool topk_flag)
 {
     manipulate_grm(grm_file, keep_indi_file, remove_indi_file, "", grm_cutoff, -2.0, -2, merge_grm_flag, true);
     _grm_N.resize(0, 0);
     int i = 0, j = 0, n = _keep.size();
     LOGGER << "\nPerforming principal component analysis ..." << endl;
+    if (out_pc_num > n) out_pc_num = n;
+
+    string eval_file = _out + ".eigenval";
+    string evec_file = _out + ".eigenvec";
+    if (topk_flag && out_pc_num < n) {
+        eigenVector eval;
+        eigenMatrix evec;
+        pca_topk(out_pc_num, eval, evec);
+
+        ofstream o_eval(eval_file.c_str());
+        if (!o_eval) LOGGER.e(0, "cannot open the file [" + eval_file + "] to read.");
+        for (i = 0; i < out_pc_num; i++) o_eval << eval(i) << endl;
+        o_eval.close();
+        LOGGER << "The first " << out_pc_num << " eigenvalues of " << n << " individuals have been saved in [" + eval_file + "]." << endl;
+        ofstream o_evec(evec_file.c_str());
+        if (!o_evec) LOGGER.e(0, "cannot open the file [" + evec_file + "] to read.");
+        for (i = 0; i < n; i++) {
+            o_evec << _fid[_keep[i]] << " " << _pid[_keep[i]];
+            for (j = 0; j < out_pc_num; j++) o_evec << " " << evec(i, j);
+            o_evec << endl;
+        }
+        o_evec.close();
+        LOGGER << "The first " << out_pc_num << " eigenvectors of " << n << " individuals have been saved in [" + evec_file + "]." << endl;
+        return;
+    }
 
     SelfAdjointEigenSolver<MatrixXd> eigensolver(_grm.cast<double>());
     MatrixXd evec = (eigensolver.eigenvectors());
     VectorXd eval = eigensolver.eigenvalues();
 
-    string eval_file = _out + ".eigenval";
     ofstream o_eval(eval_file.c_str());
     if (!o_eval) LOGGER.e(0, "cannot open the file [" + eval_file + "] to read.");
     for (i = n - 1; i >= 0; i--) o_eval << eval(i) << endl;
     o_eval.close();
     LOGGER << "Eigenvalues of " << n << " individuals have been saved in [" + eval_file + "]." << endl;
-    string evec_file = _out + ".eigenvec";
     ofstream o_evec(evec_file.c_str());
     if (!o_evec) LOGGER.e(0, "cannot open the file [" + evec_file + "] to read.");
-    if (out_pc_num > n) out_pc_num = n;
     for (i = 0; i < n; i++) {
         o_evec << _fid[_keep[i]] << " " << _pid[_keep[i]];
         for (j = n - 1; j >= (n - out_pc_num); j--) o_evec << " " << evec(i, j);
@@ -696,6 +730,56 @@ void gcta::pca(string grm_file, string keep_indi_file, string remove_indi_file,
     LOGGER << "The first " << out_pc_num << " eigenvectors of " << n << " individuals have been saved in [" + evec_file + "]." << endl;
 }
 
+// Top k eigenpairs of the GRM by randomized subspace iteration with Rayleigh-Ritz projection.
+// Only the lower triangle of _grm is used in place (symmetric multiply by BLAS), the extra
+// memory is a few n x b panels with b = k + oversampling.
+// eval is in descending order, evec holds the corresponding eigenvectors in columns.
+void gcta::pca_topk(int k, eigenVector &eval, eigenMatrix &evec)
+{
+    int i = 0, j = 0, n = _keep.size();
+    int b = min(n, k + max(10, k));
+    const int max_iter = 300;
+    const double tol = 1e-6;
+
+    // fixed seed to be reproducible
+    std::mt19937 rng(20170512);
+    std::normal_distribution<double> rnorm;
+    eigenMatrix Q(n, b), Y(n, b), T(b, b), S;
+    for (j = 0; j < b; j++) {
+        for (i = 0; i < n; i++) Q(i, j) = rnorm(rng);
+    }
+    Q = HouseholderQR<eigenMatrix>(Q).householderQ() * eigenMatrix::Identity(n, b);
+
+    LOGGER << "Computing the top " << k << " eigenvalues by subspace iteration (block size " << b << ") ..." << endl;
+    eigenVector resid(k);
+    double max_resid = 0.0;
+    bool converged = false;
+    int iter = 0;
+    for (iter = 1; iter <= max_iter; iter++) {
+        Y.noalias() = _grm.selfadjointView<Lower>() * Q;
+        T.noalias() = Q.transpose() * Y;
+        SelfAdjointEigenSolver<eigenMatrix> saes(T);
+        S = saes.eigenvectors().rowwise().reverse().leftCols(k);
+        eval = saes.eigenvalues().reverse().head(k);
+
+        // Ritz vectors Q*S with residual ||A*v - theta*v||, A*v = Y*S
+        evec.noalias() = Q * S;
+        resid = (Y * S - evec * eval.asDiagonal()).colwise().norm().transpose();
+        max_resid = resid.maxCoeff() / max(fabs(eval(0)), 1e-10);
+        if (iter % 10 == 0) LOGGER << "Iteration " << iter << ", max relative residual " << max_resid << endl;
+        if (max_resid < tol) {
+            converged = true;
+            break;
+        }
+        Q = HouseholderQR<eigenMatrix>(Y).householderQ() * eigenMatrix::Identity(n, b);
+    }
+
+    if (converged) LOGGER << "Converged after " << min(iter, max_iter) << " iterations." << endl;
+    else LOGGER.w(0, "the eigensolver has not converged after " + to_string(max_iter) + " iterations, max relative residual " + to_string(max_resid) + ".");
+    LOGGER << "PC\tEigenvalue\tResidual" << endl;
+    for (i = 0; i < k; i++) LOGGER << i + 1 << "\t" << eval(i) << "\t" << resid(i) << endl;
+}
+
 void gcta::snp_pc_loading(string pc_file)
 {
     // read eigenvectors and eigenvalues
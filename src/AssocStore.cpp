@@ -0,0 +1,496 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Indexed columnar store of the association results (.fastGWA.gas)
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "AssocStore.h"
+#include "Logger.h"
+#include "utils.hpp"
+#include "zstd.h"
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <boost/algorithm/string/join.hpp>
+
+using std::to_string;
+
+static_assert(sizeof(AssocStoreHeader) == 64, "the header of the association store shall be 64 bytes");
+static_assert(sizeof(AssocBlockIndex) == 40, "the block index of the association store shall be 40 bytes");
+static_assert(sizeof(AssocSNPIndex) == 16, "the SNP index of the association store shall be 16 bytes");
+
+const string AssocStore::suffix = ".gas";
+
+map<string, string> AssocStore::options;
+map<string, double> AssocStore::options_d;
+vector<string> AssocStore::processFunctions;
+
+// frames before the value columns: marker, POS, N, valid
+static const uint32_t num_fixed_frame = 4;
+
+// the index is read in place from the mapped file
+static uint64_t align8(uint64_t size){
+    return (size + 7) / 8 * 8;
+}
+
+// FNV-1a
+uint64_t AssocStore::hashName(const char *name, uint64_t length){
+    uint64_t hash = 14695981039346656037ULL;
+    for(uint64_t i = 0; i < length; i++){
+        hash ^= (uint8_t)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// SNP and POS fields of CHR\tSNP\tPOS\tA1\tA2
+static bool splitMarker(const char *line, const char *line_end, const char *&snp, uint64_t &snp_len, uint32_t &pos){
+    const char *tab1 = (const char *)memchr(line, '\t', line_end - line);
+    if(!tab1) return false;
+    snp = tab1 + 1;
+    const char *tab2 = (const char *)memchr(snp, '\t', line_end - snp);
+    if(!tab2) return false;
+    snp_len = tab2 - snp;
+    pos = strtoul(tab2 + 1, NULL, 10);
+    return true;
+}
+
+AssocStoreWriter::AssocStoreWriter(string filename, const vector<string> &header, uint32_t p_value) : filename(filename){
+    if(header.size() <= 6 || p_value >= header.size() - 6){
+        LOGGER.e(0, "invalid columns to save the association store.");
+    }
+    memset(&head, 0, sizeof(AssocStoreHeader));
+    memcpy(head.magic, "GASC", 4);
+    head.version = AssocStore::version;
+    head.num_value = header.size() - 6;
+    head.p_value = p_value;
+    names = boost::algorithm::join(header, "\t");
+    values.resize(head.num_value);
+
+    h_out = fopen(filename.c_str(), "wb");
+    if(!h_out){
+        LOGGER.e(0, "can't open [" + filename + "] to write.");
+    }
+    // the header is written again when closed
+    if(fwrite(&head, sizeof(AssocStoreHeader), 1, h_out) != 1){
+        LOGGER.e(0, "can't write to [" + filename + "].");
+    }
+    offset = sizeof(AssocStoreHeader);
+}
+
+AssocStoreWriter::~AssocStoreWriter(){
+    if(h_out) close();
+}
+
+void AssocStoreWriter::add(const string &marker_str, uint32_t chr, uint32_t cur_N, bool valid, const double *cur_values){
+    if(!pos.empty() && (chr != cur_chr || pos.size() == AssocStore::block_size)){
+        flushBlock();
+    }
+    cur_chr = chr;
+
+    const char *snp;
+    uint64_t snp_len;
+    uint32_t cur_pos;
+    if(!splitMarker(marker_str.data(), marker_str.data() + marker_str.size(), snp, snp_len, cur_pos)){
+        LOGGER.e(0, "invalid marker [" + marker_str + "] to save in the association store.");
+    }
+    snp_index.push_back({AssocStore::hashName(snp, snp_len), (uint32_t)blocks.size(), (uint32_t)pos.size()});
+
+    markers += marker_str;
+    markers += "\n";
+    pos.push_back(cur_pos);
+    N.push_back(cur_N);
+    valids.push_back(valid);
+    for(uint32_t j = 0; j < head.num_value; j++){
+        values[j].push_back(cur_values[j]);
+    }
+}
+
+void AssocStoreWriter::writeFrame(const void *data, uint64_t size){
+    frame.resize(ZSTD_compressBound(size));
+    size_t cSize = ZSTD_compress(frame.data(), frame.size(), data, size, 3);
+    if(ZSTD_isError(cSize)){
+        LOGGER.e(0, "failed to compress the association results: " + string(ZSTD_getErrorName(cSize)) + ".");
+    }
+    if(fwrite(frame.data(), 1, cSize, h_out) != cSize){
+        LOGGER.e(0, "can't write to [" + filename + "].");
+    }
+    offset += cSize;
+    frame_ends.push_back(offset - blocks.back().offset);
+}
+
+void AssocStoreWriter::flushBlock(){
+    uint32_t num_marker = pos.size();
+    if(num_marker == 0) return;
+
+    AssocBlockIndex block;
+    block.chr = cur_chr;
+    block.num_marker = num_marker;
+    block.pos_min = *std::min_element(pos.begin(), pos.end());
+    block.pos_max = *std::max_element(pos.begin(), pos.end());
+    block.p_min = std::numeric_limits<double>::quiet_NaN();
+    const vector<double> &p = values[head.p_value];
+    for(uint32_t i = 0; i < num_marker; i++){
+        if(valids[i] && !std::isnan(p[i]) && (std::isnan(block.p_min) || p[i] < block.p_min)){
+            block.p_min = p[i];
+        }
+    }
+    block.offset = offset;
+    block.first_marker = head.num_marker;
+    blocks.push_back(block);
+
+    writeFrame(markers.data(), markers.size());
+    writeFrame(pos.data(), sizeof(uint32_t) * num_marker);
+    writeFrame(N.data(), sizeof(uint32_t) * num_marker);
+    writeFrame(valids.data(), num_marker);
+    for(auto &value : values){
+        writeFrame(value.data(), sizeof(double) * num_marker);
+        value.clear();
+    }
+    head.num_marker += num_marker;
+
+    markers.clear();
+    pos.clear();
+    N.clear();
+    valids.clear();
+}
+
+void AssocStoreWriter::close(){
+    flushBlock();
+    head.num_block = blocks.size();
+    head.byte_names = names.size();
+    head.index_offset = align8(offset);
+    const char zeros[8] = {0};
+
+    std::stable_sort(snp_index.begin(), snp_index.end(), [](const AssocSNPIndex &a, const AssocSNPIndex &b){
+            return a.hash < b.hash;});
+
+    uint32_t num_frame = num_fixed_frame + head.num_value;
+    uint64_t pad_index = head.index_offset - offset;
+    uint64_t pad_names = align8(names.size()) - names.size();
+    bool success = fwrite(zeros, 1, pad_index, h_out) == pad_index &&
+        fwrite(names.data(), 1, names.size(), h_out) == names.size() &&
+        fwrite(zeros, 1, pad_names, h_out) == pad_names;
+    for(uint64_t b = 0; success && b < blocks.size(); b++){
+        success = fwrite(&blocks[b], sizeof(AssocBlockIndex), 1, h_out) == 1 &&
+            fwrite(frame_ends.data() + b * num_frame, sizeof(uint64_t), num_frame, h_out) == num_frame;
+    }
+    success = success && fwrite(snp_index.data(), sizeof(AssocSNPIndex), snp_index.size(), h_out) == snp_index.size();
+    success = success && fseek(h_out, 0, SEEK_SET) == 0 && fwrite(&head, sizeof(AssocStoreHeader), 1, h_out) == 1;
+    if(!success){
+        LOGGER.e(0, "can't write to [" + filename + "].");
+    }
+    fclose(h_out);
+    h_out = NULL;
+}
+
+AssocStore::AssocStore(string filename) : file(filename){
+    const char *mapped = file.data();
+    uint64_t mapped_size = file.size();
+    if(mapped_size < sizeof(AssocStoreHeader)){
+        LOGGER.e(0, "[" + filename + "] is not an association store.");
+    }
+    memcpy(&header, mapped, sizeof(AssocStoreHeader));
+    if(memcmp(header.magic, "GASC", 4) != 0){
+        LOGGER.e(0, "[" + filename + "] is not an association store.");
+    }
+    if(header.version != version){
+        LOGGER.e(0, "unsupported version " + to_string(header.version) + " of the association store [" + filename + "].");
+    }
+
+    num_frame = num_fixed_frame + header.num_value;
+    uint64_t block_bytes = sizeof(AssocBlockIndex) + sizeof(uint64_t) * num_frame;
+    if(header.index_offset > mapped_size || header.index_offset % 8 != 0 || header.p_value >= header.num_value ||
+            mapped_size - header.index_offset != align8(header.byte_names) + block_bytes * header.num_block + sizeof(AssocSNPIndex) * header.num_marker){
+        LOGGER.e(0, "the size of [" + filename + "] is not correct, the file may be truncated.");
+    }
+
+    const char *index = mapped + header.index_offset;
+    names.assign(index, header.byte_names);
+    index += align8(header.byte_names);
+    blocks.resize(header.num_block);
+    frame_ends.resize(header.num_block);
+    uint64_t num_marker = 0;
+    for(uint64_t b = 0; b < header.num_block; b++){
+        memcpy(&blocks[b], index, sizeof(AssocBlockIndex));
+        frame_ends[b] = (const uint64_t *)(index + sizeof(AssocBlockIndex));
+        index += block_bytes;
+        if(blocks[b].first_marker != num_marker || blocks[b].offset + frame_ends[b][num_frame - 1] > header.index_offset){
+            LOGGER.e(0, "invalid block index in [" + filename + "].");
+        }
+        num_marker += blocks[b].num_marker;
+    }
+    if(num_marker != header.num_marker){
+        LOGGER.e(0, "invalid block index in [" + filename + "].");
+    }
+    snp_index = (const AssocSNPIndex *)index;
+}
+
+bool AssocStore::readFrame(uint32_t block, uint32_t frame, void *data, uint64_t size) const{
+    uint64_t start = frame ? frame_ends[block][frame - 1] : 0;
+    uint64_t end = frame_ends[block][frame];
+    if(start > end) return false;
+    size_t dSize = ZSTD_decompress(data, size, file.data() + blocks[block].offset + start, end - start);
+    return !ZSTD_isError(dSize) && dSize == size;
+}
+
+void AssocStore::query(uint32_t chr, uint32_t from_bp, uint32_t to_bp, double p_thresh,
+        const vector<string> &snps, string out_name){
+    uint64_t num_block = blocks.size();
+    bool bSNP = !snps.empty();
+    bool bP = p_thresh >= 0;
+
+    // rows of each block matched by the SNP names, to be confirmed after decompression
+    vector<vector<uint32_t>> snp_rows(bSNP ? num_block : 0);
+    const AssocSNPIndex *snp_end = snp_index + header.num_marker;
+    for(auto &snp : snps){
+        uint64_t hash = hashName(snp.data(), snp.size());
+        auto range = std::equal_range(snp_index, snp_end, AssocSNPIndex{hash, 0, 0},
+                [](const AssocSNPIndex &a, const AssocSNPIndex &b){return a.hash < b.hash;});
+        for(auto it = range.first; it != range.second; ++it){
+            snp_rows[it->block].push_back(it->row);
+        }
+    }
+
+    vector<uint32_t> candidates;
+    for(uint32_t b = 0; b < num_block; b++){
+        const AssocBlockIndex &block = blocks[b];
+        if(chr != 0 && (block.chr != chr || block.pos_max < from_bp || block.pos_min > to_bp)) continue;
+        if(bP && !(block.p_min <= p_thresh)) continue;
+        if(bSNP){
+            if(snp_rows[b].empty()) continue;
+            removeDuplicateSort(snp_rows[b]);
+        }
+        candidates.push_back(b);
+    }
+
+    vector<string> outputs(candidates.size());
+    vector<uint64_t> num_outputs(candidates.size(), 0);
+    bool success = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:success)
+    for(uint32_t c = 0; c < candidates.size(); c++){
+        uint32_t b = candidates[c];
+        bool bRead = true;
+        uint32_t num_marker = blocks[b].num_marker;
+
+        // filter by the index columns before decompressing the others
+        vector<uint8_t> keep(num_marker, 1);
+        if(bSNP){
+            std::fill(keep.begin(), keep.end(), 0);
+            for(uint32_t row : snp_rows[b]){
+                if(row < num_marker) keep[row] = 1;
+            }
+        }
+        vector<uint32_t> pos(num_marker);
+        bRead = bRead && readFrame(b, 1, pos.data(), sizeof(uint32_t) * num_marker);
+        vector<uint8_t> valids(num_marker);
+        bRead = bRead && readFrame(b, 3, valids.data(), num_marker);
+        if(chr != 0){
+            for(uint32_t i = 0; i < num_marker; i++){
+                if(pos[i] < from_bp || pos[i] > to_bp) keep[i] = 0;
+            }
+        }
+        vector<vector<double>> values(header.num_value);
+        if(bP){
+            vector<double> &p = values[header.p_value];
+            p.resize(num_marker);
+            bRead = bRead && readFrame(b, num_fixed_frame + header.p_value, p.data(), sizeof(double) * num_marker);
+            for(uint32_t i = 0; i < num_marker; i++){
+                if(!valids[i] || !(p[i] <= p_thresh)) keep[i] = 0;
+            }
+        }
+        if(!bRead){
+            success = false;
+            continue;
+        }
+        if(std::find(keep.begin(), keep.end(), 1) == keep.end()) continue;
+
+        vector<uint32_t> N(num_marker);
+        bRead = bRead && readFrame(b, 2, N.data(), sizeof(uint32_t) * num_marker);
+        for(uint32_t j = 0; j < header.num_value; j++){
+            if(!values[j].empty()) continue;
+            values[j].resize(num_marker);
+            bRead = bRead && readFrame(b, num_fixed_frame + j, values[j].data(), sizeof(double) * num_marker);
+        }
+        uint64_t byte_markers = frame_ends[b][0];
+        unsigned long long content_size = ZSTD_getFrameContentSize(file.data() + blocks[b].offset, byte_markers);
+        if(content_size == ZSTD_CONTENTSIZE_ERROR || content_size == ZSTD_CONTENTSIZE_UNKNOWN){
+            success = false;
+            continue;
+        }
+        string markers(content_size, '\0');
+        bRead = bRead && readFrame(b, 0, &markers[0], content_size);
+        if(!bRead){
+            success = false;
+            continue;
+        }
+
+        // the value columns: AF1, the statistics, then INFO if it is there
+        bool hasInfo = names.size() >= 5 && names.compare(names.size() - 5, 5, "\tINFO") == 0;
+        uint32_t num_stat = header.num_value - 1 - (hasInfo ? 1 : 0);
+        string &lines = outputs[c];
+        const char *line = markers.data();
+        const char *markers_end = line + markers.size();
+        for(uint32_t i = 0; i < num_marker && line < markers_end; i++){
+            const char *line_end = (const char *)memchr(line, '\n', markers_end - line);
+            if(!line_end) line_end = markers_end;
+            const char *cur_line = line;
+            line = line_end + 1;
+            if(!keep[i]) continue;
+            if(bSNP){
+                const char *snp;
+                uint64_t snp_len;
+                uint32_t cur_pos;
+                if(!splitMarker(cur_line, line_end, snp, snp_len, cur_pos) ||
+                        !std::binary_search(snps.begin(), snps.end(), string(snp, snp_len))){
+                    continue;
+                }
+            }
+            lines.append(cur_line, line_end - cur_line);
+            lines += "\t";
+            lines += to_string(N[i]);
+            lines += "\t";
+            appendValue(lines, values[0][i]);
+            for(uint32_t j = 1; j <= num_stat; j++){
+                if(valids[i]){
+                    lines += "\t";
+                    appendValue(lines, values[j][i]);
+                }else{
+                    lines += "\tNA";
+                }
+            }
+            if(hasInfo){
+                lines += "\t";
+                appendValue(lines, values[header.num_value - 1][i]);
+            }
+            lines += "\n";
+            num_outputs[c]++;
+        }
+    }
+
+    if(!success){
+        LOGGER.e(0, "failed to decompress [" + file.name() + "], the file is corrupted.");
+    }
+
+    FILE *h_out = fopen(out_name.c_str(), "w");
+    if(!h_out){
+        LOGGER.e(0, "can't open [" + out_name + "] to write.");
+    }
+    uint64_t num_output = 0;
+    success = fprintf(h_out, "%s\n", names.c_str()) > 0;
+    for(uint32_t c = 0; success && c < candidates.size(); c++){
+        success = fwrite(outputs[c].data(), 1, outputs[c].size(), h_out) == outputs[c].size();
+        num_output += num_outputs[c];
+    }
+    if(!success){
+        LOGGER.e(0, "can't write to [" + out_name + "].");
+    }
+    fclose(h_out);
+    LOGGER.i(0, to_string(candidates.size()) + " of " + to_string(num_block) + " blocks have been searched.");
+    LOGGER.i(0, "Saved " + to_string(num_output) + " SNPs to [" + out_name + "].");
+}
+
+int AssocStore::registerOption(map<string, vector<string>>& options_in){
+    int returnValue = 0;
+    options["out"] = options_in["out"][0];
+
+    string curFlag = "--query-assoc";
+    if(options_in.find(curFlag) != options_in.end()){
+        if(options_in[curFlag].size() != 1){
+            LOGGER.e(0, curFlag + " takes the association store to query.");
+        }
+        options["query_file"] = options_in[curFlag][0];
+        processFunctions.push_back("query_assoc");
+        options_in.erase(curFlag);
+        returnValue++;
+    }
+
+    options_d["query_chr"] = 0;
+    options_d["query_from"] = 0;
+    options_d["query_to"] = std::numeric_limits<uint32_t>::max();
+    curFlag = "--query-region";
+    if(options_in.find(curFlag) != options_in.end()){
+        auto &args = options_in[curFlag];
+        if(args.size() != 1 && args.size() != 3){
+            LOGGER.e(0, curFlag + " takes the chromosome, optionally followed by the start and end positions (bp).");
+        }
+        try{
+            options_d["query_chr"] = std::stoi(args[0]);
+            if(args.size() == 3){
+                options_d["query_from"] = std::stod(args[1]);
+                options_d["query_to"] = std::stod(args[2]);
+            }
+        }catch(std::exception&){
+            LOGGER.e(0, curFlag + " takes the chromosome, optionally followed by the start and end positions (bp).");
+        }
+        if(options_d["query_chr"] < 1 || options_d["query_from"] < 0 || options_d["query_from"] > options_d["query_to"]){
+            LOGGER.e(0, "invalid region in " + curFlag + ".");
+        }
+        options_in.erase(curFlag);
+    }
+
+    options_d["query_p"] = -1;
+    curFlag = "--query-p";
+    if(options_in.find(curFlag) != options_in.end()){
+        if(options_in[curFlag].size() != 1){
+            LOGGER.e(0, curFlag + " takes the p-value threshold.");
+        }
+        try{
+            options_d["query_p"] = std::stod(options_in[curFlag][0]);
+        }catch(std::exception&){
+            LOGGER.e(0, curFlag + " takes the p-value threshold.");
+        }
+        if(options_d["query_p"] < 0 || options_d["query_p"] > 1){
+            LOGGER.e(0, "the value to be specified after " + curFlag + " should be within [0, 1].");
+        }
+        options_in.erase(curFlag);
+    }
+
+    // the SNP list is shared with the genotype filters
+    curFlag = "--extract";
+    if(options_in.find(curFlag) != options_in.end() && options_in[curFlag].size() >= 1){
+        options["query_snp"] = options_in[curFlag][0];
+    }
+
+    return returnValue;
+}
+
+void AssocStore::processMain(){
+    for(auto &process_function : processFunctions){
+        if(process_function == "query_assoc"){
+            vector<string> snps;
+            if(options.find("query_snp") != options.end()){
+                std::ifstream snp_list(options["query_snp"].c_str());
+                if(!snp_list){
+                    LOGGER.e(0, "can't read [" + options["query_snp"] + "].");
+                }
+                string line, snp;
+                while(std::getline(snp_list, line)){
+                    std::istringstream line_buf(line);
+                    if(line_buf >> snp) snps.push_back(snp);
+                }
+                removeDuplicateSort(snps);
+                LOGGER.i(0, to_string(snps.size()) + " SNPs to extract from [" + options["query_snp"] + "].");
+            }
+            LOGGER.i(0, "Querying the association results in [" + options["query_file"] + "]...");
+            AssocStore store(options["query_file"]);
+            store.query((uint32_t)options_d["query_chr"], (uint32_t)options_d["query_from"], (uint32_t)options_d["query_to"],
+                    options_d["query_p"], snps, options["out"] + ".fastGWA");
+            return;
+        }
+    }
+}
@@ -17,9 +17,11 @@
 */
 #include "FastFAM.h"
 #include "OptionIO.h"
+#include "SpGRM.h"
 #include "StatLib.h"
 #include <cmath>
 #include <algorithm>
+#include <numeric>
 #include <Eigen/SparseCholesky>
 
 #if GCTA_CPU_x86
@@ -43,8 +45,11 @@
 #include <iomanip>
 #include "Covar.h"
 #include <cstdio>
+#include <cstring>
 #include <random>
 #include <chrono>
+#include <memory>
+#include <limits>
 
 #include <Eigen/Core>
 #include <Eigen/SparseCore>
@@ -101,70 +106,54 @@ void printVector(const vector<double> &v, string label){
     LOGGER << std::endl;
 }
 
+// The CGF of the score is K(t) = sum(log(1 - mu + mu * exp(g * t))). With z = g * t + logit(mu) and
+//   p = 1 / (1 + exp(-z)), K = sum(log(1 - mu) + log(1 + exp(z))), K' = sum(g * p), K'' = sum(g^2 * p * (1 - p)),
+//   thus logit(mu) and log(1 - mu) are computed once, and K' and K'' cost one exp per sample together.
+//   In the fast mode only the carriers are evaluated exactly, the others are taken by the normal approximation.
 class SPA{
 private:
     double q, qinv;
     double gPos, gNeg;
     static ArrayXd mu;
+    static ArrayXd logitMu;
+    static ArrayXd log1Mu;
+    static ArrayXd mu1mu;
     static int nSample;
-    ArrayXd mu1muG;
-    ArrayXd geno;
     bool bFast;
-    ArrayXd muNZ;
-    ArrayXd mu1muNZG;
-    ArrayXd gNZ;
+    // genotypes and the cached terms of the evaluated samples, all in the full mode or the carriers in the fast mode;
+    //   gNZ maps gBuf, or the buffer of the caller for the carriers
+    ArrayXd gBuf;
+    Map<const ArrayXd> gNZ{NULL, 0};
+    ArrayXd g2NZ;
+    ArrayXd logitNZ;
+    ArrayXd log1NZ;
+    const double *pLogit, *pLog1; // the cached terms of the static mu are used directly in the full mode
+    ArrayXd z, e, pr;
     double NAmu;
     double NAsigma;
 
-    double K1adj(double t1, double q){
-        //ArrayXd temp1 = mu1 * (-geno * t1).exp() + mu;
-        //ArrayXd temp2 = mu * geno;
+    struct KS{ double k0; double k1; double k2;};
+
+    // k1 and k2 always, k0 if required
+    void evalK(double t1, KS *ks, bool bK0 = false){
+        Map<const ArrayXd> logit(pLogit, gNZ.size()), log1(pLog1, gNZ.size());
+        z = gNZ * t1 + logit;
+        e = (-z).exp();
+        pr = (1.0 + e).inverse();
+        ks->k1 = (gNZ * pr).sum();
+        ks->k2 = (g2NZ * pr * (1.0 - pr)).sum();
+        ks->k0 = bK0 ? (log1 + z.max(0.0) + (-z.abs()).exp().log1p()).sum() : 0;
         if(bFast){
-            double temp2dtemp1 = ((muNZ * gNZ)/((1.0 - muNZ) * (-gNZ * t1).exp() + muNZ)).sum();
-            return temp2dtemp1 + NAmu + NAsigma * t1 - q;
-        }else{
-            return ((mu * geno)/((1.0 - mu) * (-geno * t1).exp() + mu)).sum() - q;
-        }
-    }
-
-    double K2(double t1){
-        if(bFast){
-            ArrayXd genot1exp = (-gNZ * t1).exp();
-            ArrayXd div21 = (mu1muNZG * genot1exp) / ((1.0 - muNZ) * genot1exp + muNZ).square();
-            return ((!div21.isNaN()).select(div21, 0)).sum() + NAsigma;
-        }else{
-            ArrayXd genot1exp = (-geno * t1).exp();
-            ArrayXd div21 = (mu1muG * genot1exp) / ((1.0 - mu) * genot1exp + mu).square();
-            return ((!div21.isNaN()).select(div21, 0)).sum();
-        }
-    }
-
-    double Korg(double t1){
-        return (1.0 - mu + mu * (geno * t1).exp()).log().sum();
-    }
-
-    struct KS{ double k1; double k2;};
-
-    inline void KorgK2(double t1, KS *ks){
-        if(bFast){
-            ArrayXd genot1exp = (-gNZ * t1).exp();
-            ArrayXd div21 = (mu1muNZG * genot1exp) / ((1.0 - muNZ) * genot1exp + muNZ).square();
-            ks->k2 = ((!div21.isNaN()).select(div21, 0)).sum() + NAsigma;
-            ks->k1 = (1.0 - muNZ + muNZ / genot1exp).log().sum() + NAmu * t1 + 0.5 * NAsigma * t1 * t1;
-        }else{
-            ArrayXd genot1exp = (-geno * t1).exp();
-            ArrayXd div21 = (mu1muG * genot1exp) / ((1.0 - mu) * genot1exp + mu).square();
-            ks->k2 = ((!div21.isNaN()).select(div21, 0)).sum();
-            ks->k1 = (1.0 - mu + mu / genot1exp).log().sum();
+            ks->k0 += NAmu * t1 + 0.5 * NAsigma * t1 * t1;
+            ks->k1 += NAmu + NAsigma * t1;
+            ks->k2 += NAsigma;
         }
     }
 
     double getSaddleProb(double zeta, double q){
         KS ks;
-        KorgK2(zeta, &ks);
-        //double k1 = Korg(zeta);
-        //double k2 = K2(zeta);
-        double k1 = ks.k1;
+        evalK(zeta, &ks, true);
+        double k1 = ks.k0;
         double k2 = ks.k2;
         double pval = 0;
         if(std::isfinite(k1) && std::isfinite(k2)){
@@ -191,11 +180,13 @@ private:
             return(res);
         }else{
             double t1 = init;
-            double K1eval = K1adj(t1, q);
+            KS ks;
+            evalK(t1, &ks);
+            double K1eval = ks.k1 - q;
+            double K2eval = ks.k2;
             double prevJump = std::numeric_limits<double>::infinity();
             int nIter = 1;
             while(true){
-                double K2eval = K2(t1);
                 double tnew = t1 - K1eval / K2eval;
                 if(!std::isfinite(tnew)){
                     res.bConverge = false;
@@ -209,12 +200,14 @@ private:
                     res.bConverge = false;
                     break;
                 }
-                double newK1 = K1adj(tnew, q);
+                evalK(tnew, &ks);
+                double newK1 = ks.k1 - q;
                 if(sgn(K1eval) != sgn(newK1)){
                     double absTnewT1 = std::abs(tnew - t1);
                     if(absTnewT1 > prevJump - thresh){
                         tnew = t1 + sgn(newK1 - K1eval) * prevJump * 0.5;
-                        newK1 = K1adj(tnew, q);
+                        evalK(tnew, &ks);
+                        newK1 = ks.k1 - q;
                         prevJump = prevJump * 0.5;
                     }else{
                         prevJump = absTnewT1;
@@ -223,41 +216,41 @@ private:
                 nIter++;
                 t1 = tnew;
                 K1eval = newK1;
+                K2eval = ks.k2;
             }
             res.root = t1;
             res.nIter = nIter;
-            /*
-               if(!res.bConverge){
-               printVector(K1evals, "K1eval");
-               printVector(prevJumps, "prevJump");
-               printVector(K2evals, "K2eval");
-               printVector(newK1s, "newK1");
-               printVector(tnews, "tnew");
-            //output the tempory
-            }
-            */
             return(res);
         }
     }
 
+    void gather(const vector<uint32_t> &index){
+        int nNZ = index.size();
+        logitNZ.resize(nNZ);
+        log1NZ.resize(nNZ);
+        for(int i = 0; i < nNZ; i++){
+            uint32_t tempIndex = index[i];
+            logitNZ[i] = logitMu[tempIndex];
+            log1NZ[i] = log1Mu[tempIndex];
+        }
+        g2NZ = gNZ.square();
+        pLogit = logitNZ.data();
+        pLog1 = log1NZ.data();
+    }
+
 public:
     static void setMu(VectorXd mu){
         SPA::mu = mu.array();
-        //SPA::mu1 = 1.0 - SPA::mu;
-        //SPA::mu1mu = SPA::mu1 * SPA::mu;
+        SPA::logitMu = (SPA::mu / (1.0 - SPA::mu)).log();
+        SPA::log1Mu = (1.0 - SPA::mu).log();
+        SPA::mu1mu = SPA::mu * (1.0 - SPA::mu);
         SPA::nSample = mu.size();
     }
 
     SPA(double q, double qinv, Ref<VectorXd> rgen, const vector<uint32_t> &index){
         this->q = q;
         this->qinv = qinv;
-        //new (&geno) Map<VectorXd>(xp, nSample);
-        this->geno = rgen.array();
-        //LOGGER << "geno address: " << static_cast<void *>(geno.data()) << std::endl;
-        //LOGGER << "orig address: " << static_cast<void *>(rgen.data()) << std::endl;
-        //LOGGER.e(0, "debug");
-        //double gPos = (geno.array()>0).select(geno, 0).sum();
-        //double gNeg = (geno.array()<0).select(geno, 0).sum();
+        ArrayXd geno = rgen.array();
         gPos = 0;
         gNeg = 0;
         for(int i = 0; i < nSample; i++){
@@ -269,28 +262,52 @@ public:
             }
         }
 
-        mu1muG = mu * (1.0 - mu) * geno.square();
-
         int nNZ = index.size();
         bFast = false;
+        NAmu = 0;
+        NAsigma = 0;
         if((double)nNZ / nSample < 0.5){
             bFast = true;
-            muNZ.resize(nNZ);
-            mu1muNZG.resize(nNZ);
-            gNZ.resize(nNZ);
-            int curIndex = 0;
+            gBuf.resize(nNZ);
             for(int i=0; i < nNZ; i++){
-                int tempIndex = index[i];
-                muNZ[curIndex] = mu[tempIndex];
-                mu1muNZG[curIndex] = mu1muG[tempIndex];
-                gNZ[curIndex] = geno[tempIndex];
-                curIndex++;
+                gBuf[i] = geno[index[i]];
             }
+            new (&gNZ) Map<const ArrayXd>(gBuf.data(), nNZ);
+            gather(index);
 
+            ArrayXd muNZ(nNZ);
+            for(int i = 0; i < nNZ; i++){
+                muNZ[i] = mu[index[i]];
+            }
             NAmu = (qinv + q) * 0.5 - (gNZ * muNZ).sum();
-            NAsigma = mu1muG.sum() - mu1muNZG.sum();
+            NAsigma = (mu1mu * geno.square()).sum() - (muNZ * (1.0 - muNZ) * g2NZ).sum();
+        }else{
+            gBuf = std::move(geno);
+            new (&gNZ) Map<const ArrayXd>(gBuf.data(), gBuf.size());
+            g2NZ = gNZ.square();
+            pLogit = logitMu.data();
+            pLog1 = log1Mu.data();
+        }
+    }
 
+    // the carriers only, the other samples are taken by the normal approximation as in the fast mode;
+    //   gPos and gNeg bound the sums of the positive and negative genotypes, sigma = sum(mu * (1 - mu) * g^2) of all;
+    //   gCarrier is not copied and has to live as long as the object
+    SPA(double q, double qinv, double gPos, double gNeg, double sigma, const vector<uint32_t> &index, const double *gCarrier){
+        this->q = q;
+        this->qinv = qinv;
+        this->gPos = gPos;
+        this->gNeg = gNeg;
+        bFast = true;
+        int nNZ = index.size();
+        ArrayXd muNZ(nNZ);
+        for(int i = 0; i < nNZ; i++){
+            muNZ[i] = mu[index[i]];
         }
+        new (&gNZ) Map<const ArrayXd>(gCarrier, nNZ);
+        gather(index);
+        NAmu = (qinv + q) * 0.5 - (gNZ * muNZ).sum();
+        NAsigma = sigma - (muNZ * (1.0 - muNZ) * g2NZ).sum();
     }
 
     void saddleProb(SPARes *res){
@@ -314,6 +331,9 @@ public:
 
 };
 ArrayXd SPA::mu;
+ArrayXd SPA::logitMu;
+ArrayXd SPA::log1Mu;
+ArrayXd SPA::mu1mu;
 int SPA::nSample = 0;
 
 void FastFAM::loadBinModel(){
@@ -631,6 +651,22 @@ FastFAM::FastFAM(){
         bGrammar = true;
     }
 
+    bMultiPheno = pheno->count_pheno() > 1;
+    if(bMultiPheno){
+        if(bBinary || options.find("envir") != options.end() || options.find("regiontest") != options.end()){
+            LOGGER.e(0, "multiple phenotypes of --mpheno only work with quantitative traits in --fastGWA-mlm or --fastGWA-lr.");
+        }
+        if(options.find("grmsparse_file") != options.end() && !bGrammar){
+            LOGGER.e(0, "multiple phenotypes of --mpheno can't be tested by --fastGWA-mlm-exact, use --fastGWA-mlm instead.");
+        }
+        if(options.find("save_bin") != options.end() || options.find("save_assoc") != options.end() || options.find("inv_file") != options.end()){
+            LOGGER.e(0, "multiple phenotypes of --mpheno can't work with --save-bin, --save-assoc or --load-inv.");
+        }
+        if(options.find("save_inv") != options.end() || options.find("model_only") != options.end()){
+            LOGGER.e(0, "multiple phenotypes of --mpheno can't work with --save-inv or --model-only, run one phenotype at a time.");
+        }
+    }
+
 
     if(options_d["seed"] == 0){
         seed = pheno->getSeed();
@@ -718,6 +754,20 @@ FastFAM::FastFAM(){
     num_indi = pheno->count_keep();
     LOGGER.i(0, "After matching all the files, " + to_string(remain_phenos.size()) + " individuals to be included in the analysis.");
 
+    if(bMultiPheno){
+        uint32_t num_pheno = pheno->count_pheno();
+        multiY.resize(num_indi, num_pheno);
+        for(uint32_t trait = 0; trait < num_pheno; trait++){
+            vector<string> trait_ids;
+            vector<double> trait_phenos;
+            pheno->get_pheno(trait_ids, trait_phenos, trait);
+            if(trait_phenos.size() != num_indi){
+                LOGGER.e(0, "inconsistent samples among the phenotypes of --mpheno.");
+            }
+            multiY.col(trait) = Map<VectorXd>(trait_phenos.data(), num_indi);
+        }
+    }
+
 
     // standerdize the phenotype, and condition the covar
     phenoVec = Map<VectorXd> (remain_phenos.data(), remain_phenos.size());
@@ -793,6 +843,9 @@ FastFAM::FastFAM(){
         covarFlag = true;
         makeIH(concovar);
         if(!bBinary)conditionCovarReg(phenoVec);
+        if(bMultiPheno){
+            multiY -= this->covar * (H * multiY);
+        }
         if(options.find("save_pheno") != options.end()){
             std::ofstream pheno_w((options["out"] + ".cphen").c_str());
             if(!pheno_w) LOGGER.e(0, "failed to write " + options["out"]+".cphen");
@@ -872,6 +925,12 @@ FastFAM::FastFAM(){
     fclose(p1out);
     */
 
+    if(bMultiPheno){
+        // all the phenotypes are fitted on this GRM and covariates in processMultiPheno
+        multiFam.swap(fam);
+        return;
+    }
+
     std::map<string, string> mtdString;
     mtdString["REML"] = "fastGWA-REML (grid search)";
     mtdString["HE"] = "Haseman-Elston regression";
@@ -1017,61 +1076,9 @@ FastFAM::FastFAM(){
                         o_optimal_rho.close();
                     }
                 }else{
-                    LOGGER.i(0, "Estimating the genetic variance (Vg) by " + mtdString[options["VgEstMethod"]] + "...");
-                    LOGGER.ts("HE");
-                    if(options["rel_only"] == "yes"){
-                        LOGGER.i(0, "Using related pairs only.");
-                        for(int k = 0; k < fam.outerSize(); ++k){
-                            for(SpMat::InnerIterator it(fam, k); it; ++it){
-                                if(it.row() < it.col()){
-                                    Aij.push_back(it.value());
-                                    Zij.push_back(phenoVec[it.row()] * phenoVec[it.col()]);
-                                }
-                            }
-                        }
-
-                        VG = HEreg(Zij, Aij, fam_flag);
-                    }else{
-                        string vgEstMethod = options["VgEstMethod"];
-                        if(vgEstMethod == "HE"){
-                            VG = HEreg(fam, phenoVec, fam_flag);
-                        }else if(vgEstMethod == "MCREML"){
-                            VG = MCREML(fam, phenoVec, fam_flag);
-                        }else if (vgEstMethod == "REML"){
-                            VG = spREML(fam, phenoVec, fam_flag);
-                        }else{
-                            LOGGER.e(0, "Unknown method to estimate the Vg");
-                        }
-                    }
-                }
-                if(options.find("force_gwa") != options.end()){
-                    if(!fam_flag){
-                        LOGGER.w(0, " Forcing the program to run fastGWA MLM");
-                    }
-                    fam_flag = true;
-                }
-
-                if(fam_flag){
-                    VR = Vpheno - VG;
-                    if(VG < 0 && options.find("force_gwa") == options.end()){
-                        LOGGER.w(0, "Constraining Vg to 0.");
-                        fam_flag = false;
-                    }else if(VG > Vpheno && fam_flag){
-                        if(options.find("no_constrain") != options.end()){
-                            LOGGER.w(0, "Vg is larger than Vp");
-                        }else{
-                            VG = 0.99 * Vpheno;
-                            LOGGER.w(0, "Constraining Vg to 0.99 * Vp: " + to_string(VG) + ".");
-                        }
-                    }
+                    VG = estimateVG(fam, phenoVec, fam_flag);
                 }
-                if(options["VgEstMethod"]=="REML"){
-                    LOGGER << "fastGWA-REML runtime: ";
-                }else if(options["VgEstMethod"]=="HE"){
-                    LOGGER << "HE regression runtime: ";
-                }
-                LOGGER << LOGGER.tp("HE") << " sec." << std::endl;
-
+                constrainVG(Vpheno, VG, VR, fam_flag);
             }
             if(!fam_flag){
                 LOGGER.w(0, "the estimate of Vg is not statistically significant (i.e., p > 0.05). "
@@ -1340,7 +1347,7 @@ void FastFAM::conditionCovarReg(VectorXd &y, VectorXd &condPheno){
 }
 
 void FastFAM::conditionCovarBinReg(Eigen::Ref<VectorXd> y){
-    double *Hy = new double[num_indi];
+    double *Hy = threadCovarScratch[omp_get_thread_num()].data();
     const char nT = 'N';
     const double a1 = 1.0;
     const double a2 = -1.0;
@@ -1354,7 +1361,6 @@ void FastFAM::conditionCovarBinReg(Eigen::Ref<VectorXd> y){
     dgemv_(&nT, &num_covar, &numi_indi, &a1, H.data(), &num_covar, y.data(), &incr, &b1, Hy, &incr);
     dgemv_(&nT, &numi_indi, &num_covar, &a2, covar.data(), &numi_indi, Hy, &incr, &b2, y.data(), &incr);
 #endif
-    delete[] Hy;
 }
 
 void FastFAM::conditionCovarReg(Eigen::Ref<VectorXd> y){
@@ -2101,9 +2107,25 @@ double FastFAM::HEreg(vector<double> &Zij, vector<double> &Aij, bool &isSig, dou
     
 
 void FastFAM::readFAM(string filename, SpMat& fam, const vector<string> &ids, vector<uint32_t> &remain_index){
-    LOGGER.i(0, "Reading the sparse GRM file from [" + filename + "]...");
     uint32_t num_indi = ids.size();
-    vector<string> sublist = Pheno::read_sublist(filename + ".grm.id");
+    // the binary sparse GRM is preferred if exists, unless the text one has been modified after it
+    std::unique_ptr<SpGRM> spgrm;
+    vector<string> sublist;
+    bool bBinary = checkFileReadable(filename + SpGRM::suffix);
+    if(bBinary && checkFileReadable(filename + ".grm.sp") &&
+            getFileMTime(filename + ".grm.sp") > getFileMTime(filename + SpGRM::suffix)){
+        LOGGER.w(0, "[" + filename + ".grm.sp] is newer than [" + filename + SpGRM::suffix + "], the binary file is ignored. "
+                "Run --make-grm-spb again to update it.");
+        bBinary = false;
+    }
+    if(bBinary){
+        LOGGER.i(0, "Reading the binary sparse GRM file from [" + filename + SpGRM::suffix + "]...");
+        spgrm.reset(new SpGRM(filename + SpGRM::suffix, options.find("spb_checksum") != options.end()));
+        sublist = spgrm->getIDs();
+    }else{
+        LOGGER.i(0, "Reading the sparse GRM file from [" + filename + "]...");
+        sublist = Pheno::read_sublist(filename + ".grm.id");
+    }
     vector<uint32_t> fam_index;
     vector_commonIndex(sublist, ids, fam_index, remain_index);
     //LOGGER.i(0, "DEBUG: " + to_string(fam_index.size()) + " subjects remained");
@@ -2118,6 +2140,55 @@ void FastFAM::readFAM(string filename, SpMat& fam, const vector<string> &ids, ve
             return remain_index[pos];});
     remain_index = ordered_remain_index;
 
+    if(spgrm){
+        uint64_t num_sp = spgrm->rows();
+        uint32_t num_fam = ordered_fam_index.size();
+        const long long *outer = spgrm->outerIndexPtr();
+        const long long *inner = spgrm->innerIndexPtr();
+        const double *values = spgrm->valuePtr();
+
+        bool isSameOrder = (num_fam == num_sp);
+        for(uint32_t index = 0; isSameOrder && index < num_fam; index++){
+            if(ordered_fam_index[index] != index) isSameOrder = false;
+        }
+
+        if(isSameOrder){
+            // fam is scaled in place later on, thus it is a copy rather than a Map of the read-only mapping;
+            //  the mapped pages are dropped chunk by chunk to keep the peak memory at one matrix
+            uint64_t nnz = spgrm->nonZeros();
+            fam.resize(num_sp, num_sp);
+            fam.resizeNonZeros(nnz);
+            memcpy(fam.outerIndexPtr(), outer, sizeof(long long) * (num_sp + 1));
+            const uint64_t chunk = 1ULL << 24;
+            for(uint64_t start = 0; start < nnz; start += chunk){
+                uint64_t cur_size = std::min(chunk, nnz - start);
+                memcpy(fam.innerIndexPtr() + start, inner + start, sizeof(long long) * cur_size);
+                memcpy(fam.valuePtr() + start, values + start, sizeof(double) * cur_size);
+                spgrm->release(inner + start, sizeof(long long) * cur_size);
+                spgrm->release(values + start, sizeof(double) * cur_size);
+            }
+        }else{
+            vector<int64_t> map_index(num_sp, -1);
+            for(uint32_t index = 0; index != num_fam; index++){
+                map_index[ordered_fam_index[index]] = index;
+            }
+            vector<Eigen::Triplet<double, long long>> triplets;
+            for(uint32_t col = 0; col != num_fam; col++){
+                uint64_t ori_col = ordered_fam_index[col];
+                for(long long k = outer[ori_col]; k != outer[ori_col + 1]; k++){
+                    int64_t row = map_index[inner[k]];
+                    if(row >= 0){
+                        triplets.emplace_back(row, col, values[k]);
+                    }
+                }
+            }
+            fam.resize(num_fam, num_fam);
+            fam.setFromTriplets(triplets.begin(), triplets.end());
+        }
+        fam.makeCompressed();
+        return;
+    }
+
     std::ifstream pair_list((filename + ".grm.sp").c_str());
     if(!pair_list){
         LOGGER.e(0, "can't read [" + filename + ".grm.sp]");
@@ -2187,27 +2258,154 @@ void FastFAM::readFAM(string filename, SpMat& fam, const vector<string> &ids, ve
 
 }
 
+// solve V X = B for all the columns of B with the LDLT factor of V;
+//   SimplicialLDLT::solve sweeps the factor once per column, here L is swept once per chunk of columns
+//   and each row update works on the whole chunk.
+static void solvePanelLDLT(const Eigen::SimplicialLDLT<SpMat> &ldlt, Ref<MatrixXd> B){
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXd;
+    const SpMat &L = ldlt.matrixL().nestedExpression();
+    const VectorXd d = ldlt.vectorD();
+    const auto &perm = ldlt.permutationP().indices();
+    bool bPerm = perm.size() != 0;
+    int64_t n = B.rows();
+    int64_t k = B.cols();
+    if(k == 0) return;
+
+    int nThread = omp_get_max_threads();
+    int64_t chunk = std::max((int64_t)8, (k + nThread - 1) / nThread);
+    int64_t num_chunk = (k + chunk - 1) / chunk;
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int64_t c = 0; c < num_chunk; c++){
+        int64_t col_start = c * chunk;
+        int64_t cur_cols = std::min(chunk, k - col_start);
+        RowMatrixXd X(n, cur_cols);
+        for(int64_t i = 0; i < n; i++){
+            X.row(bPerm ? perm[i] : i) = B.block(i, col_start, 1, cur_cols);
+        }
+
+        // L is unit lower, the diagonal is not stored in the LDLT factor
+        for(int64_t j = 0; j < n; j++){
+            for(SpMat::InnerIterator it(L, j); it; ++it){
+                if(it.row() > j) X.row(it.row()) -= it.value() * X.row(j);
+            }
+        }
+        for(int64_t j = 0; j < n; j++){
+            X.row(j) /= d[j];
+        }
+        for(int64_t j = n - 1; j >= 0; j--){
+            for(SpMat::InnerIterator it(L, j); it; ++it){
+                if(it.row() > j) X.row(j) -= it.value() * X.row(it.row());
+            }
+        }
+
+        for(int64_t i = 0; i < n; i++){
+            B.block(i, col_start, 1, cur_cols) = X.row(bPerm ? perm[i] : i);
+        }
+    }
+}
+
+// markers of the block are decoded into an n * k panel, then V^-1 is applied to the panel at once
+double FastFAM::estimateVG(const SpMat &fam, const VectorXd &pheno, bool &isSig){
+    std::map<string, string> mtdString;
+    mtdString["REML"] = "fastGWA-REML (grid search)";
+    mtdString["HE"] = "Haseman-Elston regression";
+
+    double VG;
+    LOGGER.i(0, "Estimating the genetic variance (Vg) by " + mtdString[options["VgEstMethod"]] + "...");
+    LOGGER.ts("HE");
+    if(options["rel_only"] == "yes"){
+        LOGGER.i(0, "Using related pairs only.");
+        vector<double> Aij;
+        vector<double> Zij;
+        for(int k = 0; k < fam.outerSize(); ++k){
+            for(SpMat::InnerIterator it(fam, k); it; ++it){
+                if(it.row() < it.col()){
+                    Aij.push_back(it.value());
+                    Zij.push_back(pheno[it.row()] * pheno[it.col()]);
+                }
+            }
+        }
+
+        VG = HEreg(Zij, Aij, isSig);
+    }else{
+        string vgEstMethod = options["VgEstMethod"];
+        if(vgEstMethod == "HE"){
+            VG = HEreg(fam, pheno, isSig);
+        }else if(vgEstMethod == "MCREML"){
+            VG = MCREML(fam, pheno, isSig);
+        }else if (vgEstMethod == "REML"){
+            VG = spREML(fam, pheno, isSig);
+        }else{
+            LOGGER.e(0, "Unknown method to estimate the Vg");
+        }
+    }
+    return VG;
+}
+
+void FastFAM::constrainVG(double Vpheno, double &VG, double &VR, bool &isSig){
+    if(options.find("force_gwa") != options.end()){
+        if(!isSig){
+            LOGGER.w(0, " Forcing the program to run fastGWA MLM");
+        }
+        isSig = true;
+    }
+
+    if(isSig){
+        VR = Vpheno - VG;
+        if(VG < 0 && options.find("force_gwa") == options.end()){
+            LOGGER.w(0, "Constraining Vg to 0.");
+            isSig = false;
+        }else if(VG > Vpheno && isSig){
+            if(options.find("no_constrain") != options.end()){
+                LOGGER.w(0, "Vg is larger than Vp");
+            }else{
+                VG = 0.99 * Vpheno;
+                LOGGER.w(0, "Constraining Vg to 0.99 * Vp: " + to_string(VG) + ".");
+            }
+        }
+    }
+    if(options["VgEstMethod"]=="REML"){
+        LOGGER << "fastGWA-REML runtime: ";
+    }else if(options["VgEstMethod"]=="HE"){
+        LOGGER << "HE regression runtime: ";
+    }
+    LOGGER << LOGGER.tp("HE") << " sec." << std::endl;
+}
+
 void FastFAM::grammar_func(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     int nMarker = markerIndex.size();
+    MatrixXd G(num_indi, nMarker);
     #pragma omp parallel for schedule(dynamic)
     for(int i = 0; i < nMarker; i++){
         int index_cur_marker = num_grammar_markers + i;
-        GenoBufItem item;
+        GenoBufItem &item = geno->getThreadGenoItem();
         item.extractedMarkerIndex = markerIndex[i];
         geno->getGenoDouble(genobuf, i, &item);
         bValids[index_cur_marker] = item.valid;
         if(item.valid){
-            Map< VectorXd > curGeno(item.geno.data(), num_indi);
-            conditionCovarReg(curGeno);
-            VectorXd Vg = solver.solve(curGeno);
-            double gt_Vg = curGeno.dot(Vg);
-            double g_Vi_y = curGeno.dot(Vi_y);
+            G.col(i) = Map< VectorXd >(item.geno.data(), num_indi);
+            conditionCovarReg(G.col(i));
+        }else{
+            G.col(i).setZero();
+        }
+    }
+
+    MatrixXd VG = G;
+    solvePanelLDLT(solverV, VG);
+
+    #pragma omp parallel for
+    for(int i = 0; i < nMarker; i++){
+        int index_cur_marker = num_grammar_markers + i;
+        if(bValids[index_cur_marker]){
+            double gt_Vg = G.col(i).dot(VG.col(i));
+            double g_Vi_y = G.col(i).dot(Vi_y);
             double temp_chisq = g_Vi_y * g_Vi_y / gt_Vg;
 
             v_chisq[index_cur_marker] = temp_chisq;
 
             if(temp_chisq < 5){
-                double gt_g = curGeno.dot(curGeno);
+                double gt_g = G.col(i).squaredNorm();
                 double tmp_cinf = gt_Vg / gt_g;
                 v_c_infs[index_cur_marker] = tmp_cinf;
             }else{
@@ -2219,33 +2417,7 @@ void FastFAM::grammar_func(uintptr_t *genobuf, const vector<uint32_t> &markerInd
 }
 
 
-void FastFAM::grammar(SpMat& fam, double VG, double VR){
-    int num_marker_rand = 2000; //1000 -> 2000, longda
-    int soft_cap = 1000; // a soft cap to stop the grammar-gamma approx, longda
-
-
-    LOGGER.i(0, "\nTuning parameters using " + to_string(num_marker_rand) + " null SNPs...");
-
-    SpMat eye(fam.rows(), fam.cols());
-    eye.setIdentity();
-
-    fam *= VG;
-    fam += eye * VR;
-
-    //LOGGER.i(0, "Estimating conjugate gradient...");
-    LOGGER.ts("tuning");
-    solver.compute(fam);
-    if(solver.info() != Eigen::Success){
-        LOGGER.e(0, "the V matrix is not invertible.");
-    }
-    //LOGGER << "TCG compute time: " << LOGGER.tp("TCG") << std::endl;
-
-    //LOGGER.i(0, "Solving Vi * y via conjugate gradient...");
-    //LOGGER.ts("vi_y");
-    Vi_y = solver.solve(phenoVec);
-    //LOGGER << "  time: " << LOGGER.tp("vi_y") << std::endl;
-
-
+vector<uint32_t> FastFAM::getGrammarMarkers(int num_marker_rand){
     // get 1000 random SNPs
     auto total_markers_index = marker->get_extract_index_autosome();
     if(total_markers_index.size() < num_marker_rand){
@@ -2272,10 +2444,12 @@ void FastFAM::grammar(SpMat& fam, double VG, double VR){
     auto last = std::unique(seq_marker_index.begin(), seq_marker_index.end());
     seq_marker_index.erase(last, seq_marker_index.end());
 
-    num_marker_rand = seq_marker_index.size();
-    vector<uint32_t> marker_index(num_marker_rand);
+    vector<uint32_t> marker_index(seq_marker_index.size());
     std::transform(seq_marker_index.begin(), seq_marker_index.end(), marker_index.begin(), [&total_markers_index](size_t pos){return total_markers_index[pos];});
+    return marker_index;
+}
 
+void FastFAM::loopGrammar(const vector<uint32_t> &marker_index, function<void (uintptr_t *, const vector<uint32_t> &)> callBack){
     int nMarker = 100;
 
     //get previous threshold
@@ -2294,17 +2468,14 @@ void FastFAM::grammar(SpMat& fam, double VG, double VR){
         }
     }
 
-    v_chisq.resize(num_marker_rand);
-    v_c_infs.resize(num_marker_rand);
-    bValids.resize(num_marker_rand);
     num_grammar_markers = 0;
 
     LOGGER << "  reading genotypes..." << std::endl; 
     vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
-    callBacks.push_back(bind(&FastFAM::grammar_func, this, _1, _2));
+    callBacks.push_back(callBack);
     geno->loopDouble(marker_index, nMarker, true, true, false, false, callBacks);
 
-    if(num_marker_rand != num_grammar_markers){
+    if(marker_index.size() != num_grammar_markers){
         LOGGER.e(0, "some SNPs cannot be read successfully!");
     }
 
@@ -2312,8 +2483,42 @@ void FastFAM::grammar(SpMat& fam, double VG, double VR){
     geno->setMAF(preAF);
     geno->setFilterInfo(preInfo);
     geno->setFilterMiss(preMiss);
+}
+
+void FastFAM::grammar(SpMat& fam, double VG, double VR){
+    int num_marker_rand = 2000; //1000 -> 2000, longda
+    int soft_cap = 1000; // a soft cap to stop the grammar-gamma approx, longda
+
+
+    LOGGER.i(0, "\nTuning parameters using " + to_string(num_marker_rand) + " null SNPs...");
+
+    SpMat eye(fam.rows(), fam.cols());
+    eye.setIdentity();
+
+    fam *= VG;
+    fam += eye * VR;
+
+    // V is factorized once, the sampled SNPs are solved in panels of a block in grammar_func
+    LOGGER.ts("tuning");
+    solverV.compute(fam);
+    if(solverV.info() != Eigen::Success){
+        LOGGER.e(0, "the V matrix is not invertible.");
+    }
+
+    //LOGGER.ts("vi_y");
+    Vi_y = solverV.solve(phenoVec);
+    //LOGGER << "  time: " << LOGGER.tp("vi_y") << std::endl;
+
+
+    vector<uint32_t> marker_index = getGrammarMarkers(num_marker_rand);
+    num_marker_rand = marker_index.size();
+    int nMarker = 100;
+
+    v_chisq.resize(num_marker_rand);
+    v_c_infs.resize(num_marker_rand);
+    bValids.resize(num_marker_rand);
+    loopGrammar(marker_index, bind(&FastFAM::grammar_func, this, _1, _2));
 
-    
     double tmp_cinf = 0;
     int n_valid_null = 0;
 
@@ -2376,6 +2581,40 @@ void FastFAM::grammar(SpMat& fam, double VG, double VR){
 }
  
 
+vector<vector<int64_t>> FastFAM::getFamilies(const SpMat &fam){
+    int64_t n = fam.rows();
+    vector<int64_t> parent(n);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find_root = [&parent](int64_t x){
+        while(parent[x] != x){
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    };
+    for(int64_t k = 0; k < fam.outerSize(); k++){
+        for(SpMat::InnerIterator it(fam, k); it; ++it){
+            if(it.row() == it.col() || it.value() == 0.0) continue;
+            int64_t root1 = find_root(it.row()), root2 = find_root(it.col());
+            if(root1 != root2){
+                parent[std::max(root1, root2)] = std::min(root1, root2);
+            }
+        }
+    }
+
+    vector<int64_t> family_index(n, -1);
+    vector<vector<int64_t>> families;
+    for(int64_t i = 0; i < n; i++){
+        int64_t root = find_root(i);
+        if(family_index[root] < 0){
+            family_index[root] = families.size();
+            families.emplace_back();
+        }
+        families[family_index[root]].push_back(i);
+    }
+    return families;
+}
+
 void FastFAM::inverseFAM(SpMat& fam, double VG, double VR){
     LOGGER.i(0, "\nInverting the variance-covariance matrix by " + options["inv_method"] + " (This may take a long time)...");
     //LOGGER.i(0, "DEUBG: Inverse Threads " + to_string(Eigen::nbThreads()));
@@ -2390,15 +2629,85 @@ void FastFAM::inverseFAM(SpMat& fam, double VG, double VR){
     fam += eye * VR;
 
     // inverse
+    // V is block diagonal over the connected components (families) of the sparse GRM, each family block is
+    // factored and inverted on its own in parallel, a singleton i is 1 / V(i, i)
     if(options["inv_method"] == "ldlt"){
-        Eigen::SimplicialLDLT<SpMat> solver;
-        solver.compute(fam);
+        int64_t n = fam.rows();
+        vector<vector<int64_t>> families = getFamilies(fam);
+        int64_t num_family = families.size();
+        // the largest families first to balance the threads
+        vector<int64_t> order(num_family);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&families](int64_t a, int64_t b){
+                return families[a].size() > families[b].size();});
+        uint64_t num_singleton = 0;
+        for(auto &family : families){
+            if(family.size() == 1) num_singleton++;
+        }
+        LOGGER.i(0, to_string(num_family - num_singleton) + " families (the largest of " + to_string(families[order[0]].size()) 
+                + " samples) and " + to_string(num_singleton) + " unrelated samples in the sparse GRM.");
+
+        typedef Eigen::Triplet<double, long long> SpTriplet;
+        vector<vector<SpTriplet>> triplets(num_family);
+        bool success = true;
+        #pragma omp parallel for schedule(dynamic) reduction(&&:success)
+        for(int64_t index = 0; index < num_family; index++){
+            const vector<int64_t> &members = families[order[index]];
+            vector<SpTriplet> &cur_triplets = triplets[order[index]];
+            int64_t size = members.size();
+            if(size == 1){
+                double value = fam.coeff(members[0], members[0]);
+                if(!(value > 0.0)){
+                    success = false;
+                }else{
+                    cur_triplets.emplace_back(members[0], members[0], 1.0 / value);
+                }
+                continue;
+            }
 
-        if(solver.info() != Eigen::Success){
+            MatrixXd block = MatrixXd::Zero(size, size);
+            for(int64_t j = 0; j < size; j++){
+                for(SpMat::InnerIterator it(fam, members[j]); it; ++it){
+                    int64_t local = std::lower_bound(members.begin(), members.end(), (int64_t)it.row()) - members.begin();
+                    block(local, j) = it.value();
+                }
+            }
+            // LDLT of a singular or indefinite block still succeeds, V has to be positive definite
+            Eigen::LDLT<MatrixXd> ldlt(block);
+            if(ldlt.info() != Eigen::Success || !ldlt.isPositive()){
+                success = false;
+                continue;
+            }
+            const auto &diag = ldlt.vectorD();
+            if(!(diag.minCoeff() > diag.cwiseAbs().maxCoeff() * size * std::numeric_limits<double>::epsilon())){
+                success = false;
+                continue;
+            }
+            MatrixXd block_inverse = ldlt.solve(MatrixXd::Identity(size, size));
+            cur_triplets.reserve(size * size);
+            for(int64_t j = 0; j < size; j++){
+                for(int64_t i = 0; i < size; i++){
+                    cur_triplets.emplace_back(members[i], members[j], block_inverse(i, j));
+                }
+            }
+        }
+        if(!success){
             LOGGER.e(0, "the sparse GRM is not invertible.");
         }
 
-        V_inverse = solver.solve(eye); 
+        vector<SpTriplet> all_triplets;
+        uint64_t num_items = 0;
+        for(auto &cur_triplets : triplets){
+            num_items += cur_triplets.size();
+        }
+        all_triplets.reserve(num_items);
+        for(auto &cur_triplets : triplets){
+            all_triplets.insert(all_triplets.end(), cur_triplets.begin(), cur_triplets.end());
+            vector<SpTriplet>().swap(cur_triplets);
+        }
+        V_inverse.resize(n, n);
+        V_inverse.setFromTriplets(all_triplets.begin(), all_triplets.end());
+        V_inverse.makeCompressed();
     }else{
         LOGGER.e(0, "unknown matrix inverse method.");
     }
@@ -2407,40 +2716,144 @@ void FastFAM::inverseFAM(SpMat& fam, double VG, double VR){
     LOGGER.i(0, "The V matrix inverted in " + to_string(LOGGER.tp("INVERSE_FAM")) + " sec.");
 }
 
-void FastFAM::calculate_gwa(uintptr_t * genobuf, const vector<uint32_t> &markerIndex){
-
-    static double iN = 1.0 /(num_indi - (covarFlag ? covar.cols() : 1.0) - 1.0);
-    static double SSy = phenoVec.dot(phenoVec);
-
-    int num_marker = markerIndex.size();
-    vector<uint8_t> isValids(num_marker);
+// markers are decoded into panels of at most 256MB, the projection of covariates and the scores
+//   are then computed by GEMM on the whole panel instead of per marker
+int FastFAM::panelWidth(int num_marker) const{
+    int64_t width = ((int64_t)1 << 25) / std::max(num_indi, (uint32_t)1);
+    width = std::max(width, (int64_t)8);
+    return (int)std::min(width, (int64_t)std::max(num_marker, 1));
+}
 
+// decode the markers [start, start + cols) of the buffer into the columns of xPanel, and regress out
+//   the covariates of all the columns at once: X - C (H X); invalid markers are zero columns.
+//   items keep the marker information only, the genotypes before the regression go to xRaw if required.
+//   The panels are kept by the caller across blocks, thus no allocation per marker
+void FastFAM::getCondGenoPanel(uintptr_t *genobuf, const vector<uint32_t> &markerIndex, int start, int cols,
+        MatrixXd &xPanel, vector<GenoBufItem> &items, bool bCondition, MatrixXd *xRaw, const vector<int> *subset){
+    xPanel.resize(num_indi, cols);
+    items.resize(cols);
     #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
+    for(int k = 0; k < cols; k++){
+        int index = subset ? (*subset)[start + k] : start + k;
+        GenoBufItem &item = geno->getThreadGenoItem();
+        item.extractedMarkerIndex = markerIndex[index];
+        geno->getGenoDouble(genobuf, index, &item);
+        if(item.valid){
+            xPanel.col(k) = Map< VectorXd >(item.geno.data(), num_indi);
+        }else{
+            xPanel.col(k).setZero();
+        }
+        GenoBufItem &info_item = items[k];
+        info_item.extractedMarkerIndex = item.extractedMarkerIndex;
+        info_item.valid = item.valid;
+        info_item.af = item.af;
+        info_item.mean = item.mean;
+        info_item.sd = item.sd;
+        info_item.info = item.info;
+        info_item.nValidN = item.nValidN;
+        info_item.nValidAllele = item.nValidAllele;
+    }
 
-        geno->getGenoDouble(genobuf, i, &item);
+    if(xRaw){
+        *xRaw = xPanel;
+    }
+    if(bCondition){
+        MatrixXd HX = H * xPanel; // c * cols
+        xPanel.noalias() -= covar * HX;
+    }
+}
 
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
+void FastFAM::initCarrierModel(const VectorXd &r, const VectorXd &w, bool bAdjust){
+    CarrierModel &cm = carrierModel;
+    cm.r = r;
+    cm.w = w;
+    cm.sum_r = r.sum();
+    cm.sum_y = phenoVec.sum();
+    cm.sum_w = w.sum();
+    cm.bAdjust = bAdjust;
+    int num_c = 0;
+    if(bAdjust){
+        num_c = covar.cols();
+        cm.H1 = H.rowwise().sum();
+        cm.C1 = covar.colwise().sum().transpose();
+        cm.Ctr = covar.transpose() * r;
+        cm.Cty = covar.transpose() * phenoVec;
+        cm.CtW1 = covar.transpose() * w;
+        cm.CtWC = covar.transpose() * w.asDiagonal() * covar;
+        cm.covarT = covar.transpose();
+    }
+
+    int num_thread = omp_get_max_threads();
+    uint32_t max_carrier = maxCarrierRate * num_indi + 1;
+    cm.threadCarriers.resize(num_thread);
+    cm.threadH.resize(num_thread);
+    cm.threadG.resize(num_thread);
+    cm.threadX.resize(num_thread);
+    for(int thread = 0; thread < num_thread; thread++){
+        cm.threadCarriers[thread].index.reserve(max_carrier);
+        cm.threadCarriers[thread].value.reserve(max_carrier);
+        cm.threadH[thread].resize(2 * num_c);
+    }
+    cm.bReady = true;
+}
+
+void FastFAM::carrierStats(const GenoCarriers &carriers, CarrierStat &raw, CarrierStat &adj, double *h) const{
+    const CarrierModel &cm = carrierModel;
+    double base = carriers.base;
+    uint32_t num_carrier = carriers.index.size();
+    double xtr = 0, xty = 0, xtWx = 0, xt1 = 0;
+    for(uint32_t k = 0; k < num_carrier; k++){
+        uint32_t i = carriers.index[k];
+        double value = carriers.value[k];
+        double delta = value - base;
+        xtr += delta * cm.r[i];
+        xty += delta * phenoVec[i];
+        xtWx += cm.w[i] * (value * value - base * base);
+        xt1 += delta;
+    }
+    raw.xtr = base * cm.sum_r + xtr;
+    raw.xty = base * cm.sum_y + xty;
+    raw.xtWx = base * base * cm.sum_w + xtWx;
+    raw.xt1 = base * num_indi + xt1;
+    adj = raw;
+    if(!cm.bAdjust) return;
+
+    int num_c = cm.covarT.rows();
+    Map<VectorXd> vh(h, num_c), CtWx(h + num_c, num_c);
+    vh = base * cm.H1;
+    CtWx = base * cm.CtW1;
+    for(uint32_t k = 0; k < num_carrier; k++){
+        uint32_t i = carriers.index[k];
+        double delta = carriers.value[k] - base;
+        vh += delta * H.col(i);
+        CtWx += (delta * cm.w[i]) * cm.covarT.col(i);
+    }
+    double hWh = 0;
+    for(int c = 0; c < num_c; c++){
+        hWh += vh[c] * cm.CtWC.col(c).dot(vh);
+    }
+    adj.xtr = raw.xtr - vh.dot(cm.Ctr);
+    adj.xty = raw.xty - vh.dot(cm.Cty);
+    adj.xtWx = raw.xtWx - 2.0 * vh.dot(CtWx) + hWh;
+    adj.xt1 = raw.xt1 - vh.dot(cm.C1);
+}
 
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
+void FastFAM::calculate_gwa(uintptr_t * genobuf, const vector<uint32_t> &markerIndex){
 
-        conditionCovarReg(xMat);
+    static double iN = 1.0 /(num_indi - (covarFlag ? covar.cols() : 1.0) - 1.0);
+    static double SSy = phenoVec.dot(phenoVec);
+    static double sum_y = phenoVec.sum();
 
+    int num_marker = markerIndex.size();
+    vector<uint8_t> isValids(num_marker);
 
-        double xMat_V_x = 1.0 / xMat.dot(xMat);
-        double xMat_V_p = xMat.dot(phenoVec);
+    auto gwa_res = [this](int i, const GenoBufItem &item, double xMat_V_p, double xtx){
+        double xMat_V_x = 1.0 / xtx;
 
         double temp_beta =  xMat_V_x * xMat_V_p;
         double sse = (SSy - temp_beta * xMat_V_p) * iN;
         double temp_se = sqrt(sse * xMat_V_x);
 
-
         double temp_z = temp_beta / temp_se;
 
         beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
@@ -2450,19 +2863,80 @@ void FastFAM::calculate_gwa(uintptr_t * genobuf, const vector<uint32_t> &markerI
         af[i] = (float)item.af;
         countMarkers[i] = item.nValidN;
         info[i] = item.info; 
-        //}else{
-            //beta[index] = nan;
-            //se[index] = nan;
-            //p[index] = nan;
-        //}
+    };
+
+    if(!covarFlag){
+        // genotypes are not projected, thus x'y and x'x come straight from the packed hard calls;
+        //   dosages and chr X are expanded
+        #pragma omp parallel for schedule(dynamic)
+        for(int i = 0; i < num_marker; i++){
+            GenoBufItem &item = geno->getThreadGenoItem();
+            item.extractedMarkerIndex = markerIndex[i];
+            double xty, xtx;
+            if(!geno->getGenoScore(genobuf, i, &item, phenoVec.data(), sum_y, xty, xtx)){
+                geno->getGenoDouble(genobuf, i, &item);
+                if(item.valid){
+                    Map< VectorXd > xMat(item.geno.data(), num_indi);
+                    xty = xMat.dot(phenoVec);
+                    xtx = xMat.squaredNorm();
+                }
+            }
+            isValids[i] = item.valid;
+            if(item.valid){
+                gwa_res(i, item, xty, xtx);
+            }
+        }
+        output_res(isValids, markerIndex);
+        return;
+    }
+
+    // rare variants from the carriers, the others are decoded into panels
+    if(!carrierModel.bReady) initCarrierModel(phenoVec, VectorXd::Ones(num_indi), true);
+    vector<uint8_t> bCarrier(num_marker, 0);
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < num_marker; i++){
+        int thread = omp_get_thread_num();
+        GenoBufItem &item = geno->getThreadGenoItem();
+        item.extractedMarkerIndex = markerIndex[i];
+        GenoCarriers &carriers = carrierModel.threadCarriers[thread];
+        if(!geno->getGenoCarriers(genobuf, i, &item, maxCarrierRate, carriers)){
+            continue;
+        }
+        bCarrier[i] = 1;
+        isValids[i] = item.valid;
+        if(item.valid){
+            CarrierStat raw, adj;
+            carrierStats(carriers, raw, adj, carrierModel.threadH[thread].data());
+            gwa_res(i, item, adj.xty, adj.xtWx);
+        }
+    }
+    vector<int> denseIndex;
+    for(int i = 0; i < num_marker; i++){
+        if(!bCarrier[i]) denseIndex.push_back(i);
+    }
+    int num_dense = denseIndex.size();
+
+    int width = panelWidth(num_dense);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_dense; start += width){
+        int cols = std::min(width, num_dense - start);
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, covarFlag, NULL, &denseIndex);
+
+        VectorXd xty = xPanel.transpose() * phenoVec;
+        VectorXd xtx = xPanel.colwise().squaredNorm().transpose();
+
+        #pragma omp parallel for
+        for(int k = 0; k < cols; k++){
+            int i = denseIndex[start + k];
+            isValids[i] = items[k].valid;
+            if(items[k].valid){
+                gwa_res(i, items[k], xty[k], xtx[k]);
+            }
+        }
     }
 
     output_res(isValids, markerIndex);
-   /*
-        std::ofstream o_geno(options["out"] + "_geno.txt");
-        o_geno << dealGeno << std::endl;
-        o_geno.close();
-    */
 }
 
 void FastFAM::calculate_gwa_2df(uintptr_t * genobuf, const vector<uint32_t> &markerIndex){
@@ -2472,94 +2946,96 @@ void FastFAM::calculate_gwa_2df(uintptr_t * genobuf, const vector<uint32_t> &mar
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-
-        geno->getGenoDouble(genobuf, i, &item);
-
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
-
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
+    int width = panelWidth(num_marker);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_marker; start += width){
+        int cols = std::min(width, num_marker - start);
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, covarFlag);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < cols; k++){
+            int i = start + k;
+            const GenoBufItem &item = items[k];
+            isValids[i] = item.valid;
+            if(!item.valid) {
+                continue;
+            }
 
-        conditionCovarReg(xMat);
-        VectorXd g_times_envir(num_indi); 
-        g_times_envir = xMat.cwiseProduct(envirVec_scaled);
-        //center g_times_envir
-        g_times_envir -=VectorXd::Ones(g_times_envir.size()) * (g_times_envir.mean()) ; 
+            Ref<VectorXd> xMat = xPanel.col(k);
+            VectorXd g_times_envir(num_indi); 
+            g_times_envir = xMat.cwiseProduct(envirVec_scaled);
+            //center g_times_envir
+            g_times_envir -=VectorXd::Ones(g_times_envir.size()) * (g_times_envir.mean()) ; 
         
         
-        double x_x = xMat.dot(xMat);
-        double xenvir_x = g_times_envir.dot(xMat);
-        double xenvir_xenvir = g_times_envir.dot(g_times_envir);
+            double x_x = xMat.dot(xMat);
+            double xenvir_x = g_times_envir.dot(xMat);
+            double xenvir_xenvir = g_times_envir.dot(g_times_envir);
         
-        double x_p = phenoVec.dot(xMat);
-        double xenvir_p = phenoVec.dot(g_times_envir);
+            double x_p = phenoVec.dot(xMat);
+            double xenvir_p = phenoVec.dot(g_times_envir);
         
-        VectorXd first_deri(2);
-        // here the first_deri is not the first derivative of likelihood function. first_deri times variance of residual will be the first derivative 
-        first_deri(0)=x_p;    
-        first_deri(1)=xenvir_p; 
+            VectorXd first_deri(2);
+            // here the first_deri is not the first derivative of likelihood function. first_deri times variance of residual will be the first derivative 
+            first_deri(0)=x_p;    
+            first_deri(1)=xenvir_p; 
         
-        // here the ngtv_2nd_deri is not the negative second derivative of likelihood function. ngtv_2nd_deri times variance of residual will be the negative second derivative 
-        MatrixXd ngtv_2nd_deri(2,2);
-        ngtv_2nd_deri(0,0)=x_x;
-        ngtv_2nd_deri(0,1)=ngtv_2nd_deri(1,0)=xenvir_x;
-        ngtv_2nd_deri(1,1)=xenvir_xenvir;
+            // here the ngtv_2nd_deri is not the negative second derivative of likelihood function. ngtv_2nd_deri times variance of residual will be the negative second derivative 
+            MatrixXd ngtv_2nd_deri(2,2);
+            ngtv_2nd_deri(0,0)=x_x;
+            ngtv_2nd_deri(0,1)=ngtv_2nd_deri(1,0)=xenvir_x;
+            ngtv_2nd_deri(1,1)=xenvir_xenvir;
         
-        MatrixXd ngtv_2nd_deri_inv=ngtv_2nd_deri.inverse();
+            MatrixXd ngtv_2nd_deri_inv=ngtv_2nd_deri.inverse();
         
-        VectorXd temp_beta = ngtv_2nd_deri_inv * first_deri;
+            VectorXd temp_beta = ngtv_2nd_deri_inv * first_deri;
         
-        double sse = (SSy - temp_beta[0] * x_p - temp_beta[1] * xenvir_p ) * iN;
+            double sse = (SSy - temp_beta[0] * x_p - temp_beta[1] * xenvir_p ) * iN;
         
-        VectorXd temp_se(2); 
-        temp_se(0) = sqrt( sse * ngtv_2nd_deri_inv(0,0) );
-        temp_se(1) = sqrt( sse * ngtv_2nd_deri_inv(1,1) );
+            VectorXd temp_se(2); 
+            temp_se(0) = sqrt( sse * ngtv_2nd_deri_inv(0,0) );
+            temp_se(1) = sqrt( sse * ngtv_2nd_deri_inv(1,1) );
         
         
-        double temp_chisq = first_deri.dot( ngtv_2nd_deri_inv * first_deri ) / sse;
-        double temp_chisq_x = pow(temp_beta[0]/temp_se[0] , 2);
-        double temp_chisq_xenvir = pow(temp_beta[1]/temp_se[1] , 2);
+            double temp_chisq = first_deri.dot( ngtv_2nd_deri_inv * first_deri ) / sse;
+            double temp_chisq_x = pow(temp_beta[0]/temp_se[0] , 2);
+            double temp_chisq_xenvir = pow(temp_beta[1]/temp_se[1] , 2);
         
-        beta_geno[i]=(float)temp_beta(0);
-        se_geno[i]=(float)temp_se(0);
-        score_geno[i]=(float)temp_chisq_x;
+            beta_geno[i]=(float)temp_beta(0);
+            se_geno[i]=(float)temp_se(0);
+            score_geno[i]=(float)temp_chisq_x;
         
-        if (temp_chisq_x > 0){
-          p_geno[i] = StatLib::pchisqd1(temp_chisq_x);
-        }else{
-          p_geno[i] = 1;
-        }
+            if (temp_chisq_x > 0){
+              p_geno[i] = StatLib::pchisqd1(temp_chisq_x);
+            }else{
+              p_geno[i] = 1;
+            }
         
-        beta_interaction[i]=(float)temp_beta[1];
-        se_interaction[i]=(float)temp_se[1];
-        score_interaction[i]=(float)temp_chisq_xenvir;
+            beta_interaction[i]=(float)temp_beta[1];
+            se_interaction[i]=(float)temp_se[1];
+            score_interaction[i]=(float)temp_chisq_xenvir;
         
-        if (temp_chisq_xenvir > 0){
-          p_interaction[i] = StatLib::pchisqd1(temp_chisq_xenvir);
-        }else{
-          p_interaction[i] = 1;
-        }
+            if (temp_chisq_xenvir > 0){
+              p_interaction[i] = StatLib::pchisqd1(temp_chisq_xenvir);
+            }else{
+              p_interaction[i] = 1;
+            }
         
-        cov_geno_interaction[i] = (float)(sse * ngtv_2nd_deri_inv(0,1)) ;
+            cov_geno_interaction[i] = (float)(sse * ngtv_2nd_deri_inv(0,1)) ;
         
-        score[i] = (float)temp_chisq;
-        if (temp_chisq > 0){
-            p[i] = StatLib::pchisqd2(temp_chisq);
-        }else{
-            p[i] = 1;
-        }
+            score[i] = (float)temp_chisq;
+            if (temp_chisq > 0){
+                p[i] = StatLib::pchisqd2(temp_chisq);
+            }else{
+                p[i] = 1;
+            }
         
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info; 
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info; 
 
+        }
     }
   
     output_res_2df(isValids, markerIndex);
@@ -2570,121 +3046,228 @@ void FastFAM::calculate_gwa_2df_sandwich(uintptr_t * genobuf, const vector<uint3
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-
-        geno->getGenoDouble(genobuf, i, &item);
-
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
+    int width = panelWidth(num_marker);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_marker; start += width){
+        int cols = std::min(width, num_marker - start);
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, covarFlag);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < cols; k++){
+            int i = start + k;
+            const GenoBufItem &item = items[k];
+            isValids[i] = item.valid;
+            if(!item.valid) {
+                continue;
+            }
 
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
-        conditionCovarReg(xMat);
-        VectorXd g_times_envir(num_indi);
-        g_times_envir = xMat.cwiseProduct(envirVec_scaled);
-        //center g_times_envir
-        g_times_envir -=VectorXd::Ones(g_times_envir.size()) * (g_times_envir.mean());
+            Ref<VectorXd> xMat = xPanel.col(k);
+            VectorXd g_times_envir(num_indi);
+            g_times_envir = xMat.cwiseProduct(envirVec_scaled);
+            //center g_times_envir
+            g_times_envir -=VectorXd::Ones(g_times_envir.size()) * (g_times_envir.mean());
         
-        double x_x = xMat.dot(xMat);
-        double xenvir_x = g_times_envir.dot(xMat);
-        double xenvir_xenvir = g_times_envir.dot(g_times_envir);
+            double x_x = xMat.dot(xMat);
+            double xenvir_x = g_times_envir.dot(xMat);
+            double xenvir_xenvir = g_times_envir.dot(g_times_envir);
         
-        double x_p = phenoVec.dot(xMat);
-        double xenvir_p = phenoVec.dot(g_times_envir);
+            double x_p = phenoVec.dot(xMat);
+            double xenvir_p = phenoVec.dot(g_times_envir);
         
-        VectorXd first_deri(2);
-        // here the first_deri is not the first derivative of likelihood function. first_deri times variance of residual will be the first derivative
-        first_deri(0)=x_p;
-        first_deri(1)=xenvir_p;
+            VectorXd first_deri(2);
+            // here the first_deri is not the first derivative of likelihood function. first_deri times variance of residual will be the first derivative
+            first_deri(0)=x_p;
+            first_deri(1)=xenvir_p;
         
-        // here the ngtv_2nd_deri is not the negative second derivative of likelihood function. ngtv_2nd_deri times variance of residual will be the negative second derivative
-        // -A matrix is ngtv_2nd_deri
-        MatrixXd ngtv_2nd_deri(2,2);
-        ngtv_2nd_deri(0,0)=x_x;
-        ngtv_2nd_deri(0,1)=ngtv_2nd_deri(1,0)=xenvir_x;
-        ngtv_2nd_deri(1,1)=xenvir_xenvir;
+            // here the ngtv_2nd_deri is not the negative second derivative of likelihood function. ngtv_2nd_deri times variance of residual will be the negative second derivative
+            // -A matrix is ngtv_2nd_deri
+            MatrixXd ngtv_2nd_deri(2,2);
+            ngtv_2nd_deri(0,0)=x_x;
+            ngtv_2nd_deri(0,1)=ngtv_2nd_deri(1,0)=xenvir_x;
+            ngtv_2nd_deri(1,1)=xenvir_xenvir;
         
-        // (-A)^(-1) is ngtv_2nd_deri_inv
-        MatrixXd ngtv_2nd_deri_inv=ngtv_2nd_deri.inverse();
+            // (-A)^(-1) is ngtv_2nd_deri_inv
+            MatrixXd ngtv_2nd_deri_inv=ngtv_2nd_deri.inverse();
         
-        MatrixXd z_mat(xMat.size(),2);
-        z_mat.col(0)=xMat;
-        z_mat.col(1)=g_times_envir;
+            MatrixXd z_mat(xMat.size(),2);
+            z_mat.col(0)=xMat;
+            z_mat.col(1)=g_times_envir;
         
-        MatrixXd z_ngtv_2nd_deri_inv = z_mat * ngtv_2nd_deri_inv;
-        MatrixXd hatDiagonal = (z_ngtv_2nd_deri_inv.cwiseProduct(z_mat)).rowwise().sum();
+            MatrixXd z_ngtv_2nd_deri_inv = z_mat * ngtv_2nd_deri_inv;
+            MatrixXd hatDiagonal = (z_ngtv_2nd_deri_inv.cwiseProduct(z_mat)).rowwise().sum();
         
-        VectorXd temp_beta = ngtv_2nd_deri_inv * first_deri;
+            VectorXd temp_beta = ngtv_2nd_deri_inv * first_deri;
         
-        VectorXd residual = phenoVec - xMat * temp_beta[0] - g_times_envir * temp_beta[1];
-        VectorXd residualSquare = residual.cwiseProduct(residual);
-        VectorXd correctedResidualSquare = residualSquare.cwiseProduct( (VectorXd::Ones(hatDiagonal.size()) * (1.0) - hatDiagonal).cwiseInverse() );
+            VectorXd residual = phenoVec - xMat * temp_beta[0] - g_times_envir * temp_beta[1];
+            VectorXd residualSquare = residual.cwiseProduct(residual);
+            VectorXd correctedResidualSquare = residualSquare.cwiseProduct( (VectorXd::Ones(hatDiagonal.size()) * (1.0) - hatDiagonal).cwiseInverse() );
         
-        // B matrix is B_mat
-        MatrixXd B_mat(2,2);
-        VectorXd x_correctedResidualSquare = xMat.cwiseProduct(correctedResidualSquare);
-        VectorXd xenvir_correctedResidualSquare = g_times_envir.cwiseProduct(correctedResidualSquare);
-        B_mat(0,0) = x_correctedResidualSquare.dot(xMat);
-        B_mat(0,1) = B_mat(1,0) = x_correctedResidualSquare.dot(g_times_envir);
-        B_mat(1,1) = xenvir_correctedResidualSquare.dot(g_times_envir);
+            // B matrix is B_mat
+            MatrixXd B_mat(2,2);
+            VectorXd x_correctedResidualSquare = xMat.cwiseProduct(correctedResidualSquare);
+            VectorXd xenvir_correctedResidualSquare = g_times_envir.cwiseProduct(correctedResidualSquare);
+            B_mat(0,0) = x_correctedResidualSquare.dot(xMat);
+            B_mat(0,1) = B_mat(1,0) = x_correctedResidualSquare.dot(g_times_envir);
+            B_mat(1,1) = xenvir_correctedResidualSquare.dot(g_times_envir);
         
-        //sandwich variance estimator is (-A)^(-1) * B * (-A)^(-1)
-        MatrixXd sandwich_variance = ngtv_2nd_deri_inv * B_mat * ngtv_2nd_deri_inv;
+            //sandwich variance estimator is (-A)^(-1) * B * (-A)^(-1)
+            MatrixXd sandwich_variance = ngtv_2nd_deri_inv * B_mat * ngtv_2nd_deri_inv;
         
-        if (std::isnan(sandwich_variance.sum()) == 0){
-            double temp_chisq = temp_beta.dot(sandwich_variance.inverse() * temp_beta);
+            if (std::isnan(sandwich_variance.sum()) == 0){
+                double temp_chisq = temp_beta.dot(sandwich_variance.inverse() * temp_beta);
             
-            VectorXd temp_se(2);
-            temp_se(0) = sqrt(sandwich_variance(0,0));
-            temp_se(1) = sqrt(sandwich_variance(1,1));
+                VectorXd temp_se(2);
+                temp_se(0) = sqrt(sandwich_variance(0,0));
+                temp_se(1) = sqrt(sandwich_variance(1,1));
             
-            double temp_chisq_x = pow(temp_beta[0]/temp_se[0] , 2);
-            double temp_chisq_xenvir = pow(temp_beta[1]/temp_se[1] , 2);
+                double temp_chisq_x = pow(temp_beta[0]/temp_se[0] , 2);
+                double temp_chisq_xenvir = pow(temp_beta[1]/temp_se[1] , 2);
             
-            beta_geno[i]=(float)temp_beta(0);
-            se_geno[i]=(float)temp_se(0);
-            score_geno[i]=(float)temp_chisq_x;
+                beta_geno[i]=(float)temp_beta(0);
+                se_geno[i]=(float)temp_se(0);
+                score_geno[i]=(float)temp_chisq_x;
             
-            if (temp_chisq_x > 0){
-                p_geno[i] = StatLib::pchisqd1(temp_chisq_x);
-            }else{
-                p_geno[i] = 1;
-            }
+                if (temp_chisq_x > 0){
+                    p_geno[i] = StatLib::pchisqd1(temp_chisq_x);
+                }else{
+                    p_geno[i] = 1;
+                }
             
-            beta_interaction[i]=(float)temp_beta[1];
-            se_interaction[i]=(float)temp_se[1];
-            score_interaction[i]=(float)temp_chisq_xenvir;
+                beta_interaction[i]=(float)temp_beta[1];
+                se_interaction[i]=(float)temp_se[1];
+                score_interaction[i]=(float)temp_chisq_xenvir;
             
-            if (temp_chisq_xenvir > 0){
-                p_interaction[i] = StatLib::pchisqd1(temp_chisq_xenvir);
-            }else{
-                p_interaction[i] = 1;
-            }
+                if (temp_chisq_xenvir > 0){
+                    p_interaction[i] = StatLib::pchisqd1(temp_chisq_xenvir);
+                }else{
+                    p_interaction[i] = 1;
+                }
             
-            cov_geno_interaction[i] = (float)sandwich_variance(0,1) ;
+                cov_geno_interaction[i] = (float)sandwich_variance(0,1) ;
             
-            score[i] = (float)temp_chisq;
-            if (temp_chisq > 0){
-                p[i] = StatLib::pchisqd2(temp_chisq);
-            }else{
-                p[i] = 1;
-            }
+                score[i] = (float)temp_chisq;
+                if (temp_chisq > 0){
+                    p[i] = StatLib::pchisqd2(temp_chisq);
+                }else{
+                    p[i] = 1;
+                }
             
-        }
+            }
 
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info; 
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info; 
+        }
     }
     
     output_res_2df(isValids, markerIndex);
 }
 
+std::unique_ptr<FastFAM::ResBlock> FastFAM::newResBlock(const vector<uint8_t> &isValids, const vector<uint32_t> &markerIndex, int num_stat){
+    std::unique_ptr<ResBlock> block(new ResBlock);
+    block->num_stat = num_stat;
+    int num_marker = markerIndex.size();
+    for(int i = 0; i != num_marker; i++){
+        if(isValids[i] || bOutResAll){
+            block->markerIndex.push_back(markerIndex[i]);
+            block->isValids.push_back(isValids[i]);
+            block->N.push_back(countMarkers[i]);
+            block->af.push_back(af[i]);
+            block->info.push_back(info[i]);
+        }
+    }
+    return block;
+}
+
+void FastFAM::writeResBlock(const ResBlock &block, string &lines){
+    if(assocStore){
+        const double *stat = block.stats.data();
+        vector<double> values(block.num_stat + 2);
+        for(size_t i = 0; i != block.markerIndex.size(); i++){
+            values[0] = block.af[i];
+            for(int j = 0; j != block.num_stat; j++){
+                values[j + 1] = block.isValids[i] ? *stat++ : std::numeric_limits<double>::quiet_NaN();
+            }
+            values[block.num_stat + 1] = block.info[i];
+            assocStore->add(marker->getMarkerStrExtract(block.markerIndex[i]), marker->getChrExtract(block.markerIndex[i]),
+                    block.N[i], block.isValids[i], values.data());
+        }
+        return;
+    }
+
+    lines.clear();
+    const double *stat = block.stats.data();
+    for(size_t i = 0; i != block.markerIndex.size(); i++){
+        lines += marker->getMarkerStrExtract(block.markerIndex[i]);
+        lines += "\t";
+        lines += std::to_string(block.N[i]);
+        lines += "\t";
+        appendValue(lines, block.af[i]);
+        for(int j = 0; j != block.num_stat; j++){
+            if(block.isValids[i]){
+                lines += "\t";
+                appendValue(lines, *stat++);
+            }else{
+                lines += "\tNA";
+            }
+        }
+        if(hasInfo){
+            lines += "\t";
+            appendValue(lines, block.info[i]);
+        }
+        lines += "\n";
+    }
+    osOut.write(lines.data(), lines.size());
+}
+
+void FastFAM::startResWriter(){
+    bResDone = false;
+    bResWriter = true;
+    resWriter = std::thread([this](){
+        string lines;
+        while(true){
+            std::unique_ptr<ResBlock> block;
+            {
+                std::unique_lock<std::mutex> lock(resMutex);
+                resCond.wait(lock, [this]{return !resQueue.empty() || bResDone;});
+                if(resQueue.empty()) break;
+                block = std::move(resQueue.front());
+                resQueue.pop_front();
+            }
+            resCond.notify_all();
+            writeResBlock(*block, lines);
+        }
+    });
+}
+
+void FastFAM::stopResWriter(){
+    if(!bResWriter) return;
+    {
+        std::lock_guard<std::mutex> lock(resMutex);
+        bResDone = true;
+    }
+    resCond.notify_all();
+    resWriter.join();
+    bResWriter = false;
+}
+
+void FastFAM::pushResBlock(std::unique_ptr<ResBlock> block){
+    if(!bResWriter){
+        string lines;
+        writeResBlock(*block, lines);
+        return;
+    }
+    // bounded queue, the tests wait if the writer falls behind
+    const int max_pending = 8;
+    {
+        std::unique_lock<std::mutex> lock(resMutex);
+        resCond.wait(lock, [this]{return resQueue.size() < max_pending;});
+        resQueue.push_back(std::move(block));
+    }
+    resCond.notify_all();
+}
+
 void FastFAM::output_res_spa(const vector<uint8_t> &isValids, const vector<uint32_t> markerIndex){
     int numKept = 0;
     int num_marker = markerIndex.size();
@@ -2724,29 +3307,14 @@ void FastFAM::output_res_spa(const vector<uint8_t> &isValids, const vector<uint3
             }
         }
     }else{
+        std::unique_ptr<ResBlock> block = newResBlock(isValids, markerIndex, 7);
         for(int i = 0; i != num_marker; i++){
             if(isValids[i]){
-                numKept++;
-                osOut << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i]
-                    << "\t" << af[i] << "\t" << Tscore[i] << "\t" << Tse[i] << "\t" << p[i] 
-                    << "\t" << beta[i] << "\t" << se[i] << "\t" << padj[i] << "\t" << ((int)rConverge[i]);
-                if(hasInfo){
-                    osOut << "\t" << info[i];
-                }
-                osOut << "\n";
-            }else{
-                if(bOutResAll){
-                    numKept++;
-                osOut << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i]
-                    << "\t" << af[i] << "\tNA\tNA\tNA\tNA\tNA\tNA\tNA";
-                if(hasInfo){
-                    osOut << "\t" << info[i];
-                }
-                osOut << "\n";
- 
-                }
+                block->stats.insert(block->stats.end(), {(double)Tscore[i], (double)Tse[i], p[i], (double)beta[i], (double)se[i], padj[i], (double)rConverge[i]});
             }
         }
+        numKept = block->markerIndex.size();
+        pushResBlock(std::move(block));
     }
 
     numMarkerOutput += numKept;
@@ -2790,28 +3358,14 @@ void FastFAM::output_res(const vector<uint8_t> &isValids, const vector<uint32_t>
             }
         }
     }else{
+        std::unique_ptr<ResBlock> block = newResBlock(isValids, markerIndex, 3);
         for(int i = 0; i != num_marker; i++){
             if(isValids[i]){
-                numKept++;
-                osOut << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i]
-                    << "\t" << af[i] << "\t" << beta[i] << "\t" << se[i] << "\t" << p[i];
-                if(hasInfo){
-                    osOut << "\t" << info[i];
-                }
-                osOut << "\n";
-            }else{
-                if(bOutResAll){
-                    numKept++;
-                osOut << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i]
-                    << "\t" << af[i] << "\tNA\tNA\tNA";
-                if(hasInfo){
-                    osOut << "\t" << info[i];
-                }
-                osOut << "\n";
- 
-                }
+                block->stats.insert(block->stats.end(), {(double)beta[i], (double)se[i], p[i]});
             }
         }
+        numKept = block->markerIndex.size();
+        pushResBlock(std::move(block));
     }
 
     numMarkerOutput += numKept;
@@ -2878,28 +3432,17 @@ void FastFAM::output_res_2df(const vector<uint8_t> &isValids, const vector<uint3
             }
         }
     }else{
+        std::unique_ptr<ResBlock> block = newResBlock(isValids, markerIndex, 11);
         for(int i = 0; i != num_marker; i++){
             if(isValids[i]){
-                numKept++;
-                osOut << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i]
-                    << "\t" << af[i] << "\t" << beta_geno[i] << "\t" << beta_interaction[i]  << "\t" << se_geno[i] << "\t" << se_interaction[i] << "\t" << cov_geno_interaction[i] << "\t" << score_geno[i] << "\t" << score_interaction[i] << "\t" << score[i] << "\t" << p_geno[i] << "\t" << p_interaction[i] << "\t" << p[i];
-                if(hasInfo){
-                    osOut << "\t" << info[i];
-                }
-                osOut << "\n";
-            }else{
-                if(bOutResAll){
-                    numKept++;
-                osOut << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i]
-                    << "\t" << af[i] << "\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA";
-                if(hasInfo){
-                    osOut << "\t" << info[i];
-                }
-                osOut << "\n";
- 
-                }
+                block->stats.insert(block->stats.end(), {(double)beta_geno[i], (double)beta_interaction[i],
+                        (double)se_geno[i], (double)se_interaction[i], (double)cov_geno_interaction[i],
+                        (double)score_geno[i], (double)score_interaction[i], (double)score[i],
+                        p_geno[i], p_interaction[i], p[i]});
             }
         }
+        numKept = block->markerIndex.size();
+        pushResBlock(std::move(block));
     }
 
     numMarkerOutput += numKept;
@@ -2912,39 +3455,41 @@ void FastFAM::calculate_fam(uintptr_t *genobuf, const vector<uint32_t> &markerIn
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-
-        geno->getGenoDouble(genobuf, i, &item);
-
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
- 
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
+    int width = panelWidth(num_marker);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_marker; start += width){
+        int cols = std::min(width, num_marker - start);
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, covarFlag);
 
-        conditionCovarReg(xMat);
+        // one sweep of V^-1 for the whole panel
+        MatrixXd xPanel_V = V_inverse * xPanel;
+        VectorXd xVp = xPanel_V.transpose() * phenoVec;
 
-        VectorXd xMat_V = V_inverse * xMat;
-        double xMat_V_x = 1.0 / xMat_V.dot(xMat);
-        double xMat_V_p = xMat_V.dot(phenoVec);
+        #pragma omp parallel for
+        for(int k = 0; k < cols; k++){
+            int i = start + k;
+            const GenoBufItem &item = items[k];
+            isValids[i] = item.valid;
+            if(!item.valid) {
+                continue;
+            }
 
-        double temp_beta =  xMat_V_x * xMat_V_p;
-        double temp_se = sqrt(xMat_V_x);
-        double temp_z = temp_beta / temp_se;
+            double xMat_V_x = 1.0 / xPanel_V.col(k).dot(xPanel.col(k));
+            double xMat_V_p = xVp[k];
 
+            double temp_beta =  xMat_V_x * xMat_V_p;
+            double temp_se = sqrt(xMat_V_x);
+            double temp_z = temp_beta / temp_se;
 
-        beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
-        se[i] = (float)temp_se;
-        p[i] = StatLib::pchisqd1(temp_z * temp_z); 
+            beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
+            se[i] = (float)temp_se;
+            p[i] = StatLib::pchisqd1(temp_z * temp_z); 
 
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info;
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info;
+        }
     }
     output_res(isValids, markerIndex);
 }
@@ -2952,38 +3497,40 @@ void FastFAM::calculate_fam(uintptr_t *genobuf, const vector<uint32_t> &markerIn
 void FastFAM::calculate_grammar(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-        geno->getGenoDouble(genobuf, i, &item);
-        
-        isValids[i] = item.valid;
-        if(!item.valid){
-            continue;
-        }
-        
-        Map< VectorXd > xvec(item.geno.data(), num_indi);
 
-        conditionCovarReg(xvec);
+    int width = panelWidth(num_marker);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_marker; start += width){
+        int cols = std::min(width, num_marker - start);
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, covarFlag);
 
-        double gtg = xvec.dot(xvec);
-        //double gt_Vi_y = xvec.dot(Vi_y);
-        double gt_Vi_y = xvec.dot(Vi_y_cinf);
+        VectorXd gt_Vi_ys = xPanel.transpose() * Vi_y_cinf;
+        VectorXd gtgs = xPanel.colwise().squaredNorm().transpose();
 
-        //double temp_beta = gt_Vi_y / gtg / c_inf;
-        double temp_beta = gt_Vi_y / gtg;
-        //double temp_chisq = temp_beta * gt_Vi_y;
-        double temp_chisq = temp_beta * gt_Vi_y * c_inf;
-        double temp_se = sqrt(temp_beta * temp_beta / temp_chisq);
+        #pragma omp parallel for
+        for(int k = 0; k < cols; k++){
+            int i = start + k;
+            const GenoBufItem &item = items[k];
+            isValids[i] = item.valid;
+            if(!item.valid){
+                continue;
+            }
 
-        beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
-        se[i] = (float)temp_se;
-        p[i] = StatLib::pchisqd1(temp_chisq); 
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info;
+            double gtg = gtgs[k];
+            double gt_Vi_y = gt_Vi_ys[k];
+
+            double temp_beta = gt_Vi_y / gtg;
+            double temp_chisq = temp_beta * gt_Vi_y * c_inf;
+            double temp_se = sqrt(temp_beta * temp_beta / temp_chisq);
+
+            beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
+            se[i] = (float)temp_se;
+            p[i] = StatLib::pchisqd1(temp_chisq); 
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info;
+        }
     }
 
     output_res(isValids, markerIndex);
@@ -3008,25 +3555,55 @@ void FastFAM::calculate_mixed_2df_sandwich(uintptr_t *genobuf, const vector<uint
     calculate_gwa_2df_sandwich(genobuf, markerIndex);
 }
 
+void FastFAM::setDefaultFilters(){
+    if(options.find("no_filter") == options.end()){
+        bOutResAll = false;
+        double preAF = geno->getMAF();
+        double preInfo = geno->getFilterInfo();
+        double preMiss = geno->getFilterMiss();
+        if(preAF < 1e-10){
+            geno->setMAF(0.0001);
+            LOGGER << "  Filtering out variants with MAF < 0.0001, or customise it with --maf flag." << std::endl; 
+        }
+        /*
+        if(preInfo < 1e-10 && hasInfo){
+            geno->setFilterInfo(0.3);
+            LOGGER << "  Filtering out variants with imputation INFO score < 0.30, or customise it with --info flag." << std::endl;
+        }
+        */
+        if(preMiss < 1e-10){
+            geno->setFilterMiss(0.9);
+            LOGGER << "  Filtering out variants with missingness rate > 0.10, or customise it with --geno flag." << std::endl;
+        }
+    }else{
+        bOutResAll = true;
+    }
+}
+
 void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks){
     sFileName = options["out"]; 
     int buf_size = 23068672;
     osBuf.resize(buf_size);
     osOut.rdbuf()->pubsetbuf(&osBuf[0], buf_size);
-    if(options.find("save_bin") == options.end()){
+    vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
+    if(bBinary){
+        header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "T", "SE_T", "P_noSPA", "BETA", "SE",  "P",  "CONVERGE"};
+    }
+    if(has_envir){
+        header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA_G", "BETA_G_by_E", "SE_G", "SE_G_by_E", "Cov_BETA_G_and_G_by_E", "chisq_G", "chisq_G_by_E", "chisq_2df", "P_G", "P_G_by_E", "P_2df"};
+    }
+    // value column of the p-value indexed in the association store, after AF1
+    uint32_t p_value = std::find(header.begin(), header.end(), has_envir ? "P_2df" : "P") - header.begin() - 6;
+    if(hasInfo)header.push_back("INFO");
+
+    if(options.find("save_assoc") != options.end()){
+        bSaveBin = false;
+        LOGGER << "fastGWA results will be saved in the indexed association store [" << sFileName + AssocStore::suffix << "]." << std::endl;
+        assocStore.reset(new AssocStoreWriter(sFileName + AssocStore::suffix, header, p_value));
+    }else if(options.find("save_bin") == options.end()){
         bSaveBin = false;
         LOGGER << "fastGWA results will be saved in text format to [" << sFileName << "]." << std::endl;
         osOut.open(sFileName.c_str());
-        vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
-        if(hasInfo)header.push_back("INFO");
-        if(bBinary){
-            header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "T", "SE_T", "P_noSPA", "BETA", "SE",  "P",  "CONVERGE"};
-            if(hasInfo)header.push_back("INFO");
-        }
-        if(has_envir){
-            header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA_G", "BETA_G_by_E", "SE_G", "SE_G_by_E", "Cov_BETA_G_and_G_by_E", "chisq_G", "chisq_G_by_E", "chisq_2df", "P_G", "P_G_by_E", "P_2df"};
-            if(hasInfo)header.push_back("INFO");
-        }
         string header_string = boost::algorithm::join(header, "\t");
         if(osOut.bad()){
             LOGGER.e(0, "can't open [" + sFileName + "] to write.");
@@ -3047,28 +3624,7 @@ void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_
     }
 
 
-    if(options.find("no_filter") == options.end()){
-        bOutResAll = false;
-        double preAF = geno->getMAF();
-        double preInfo = geno->getFilterInfo();
-        double preMiss = geno->getFilterMiss();
-        if(preAF < 1e-10){
-            geno->setMAF(0.0001);
-            LOGGER << "  Filtering out variants with MAF < 0.0001, or customise it with --maf flag." << std::endl; 
-        }
-        /*
-        if(preInfo < 1e-10 && hasInfo){
-            geno->setFilterInfo(0.3);
-            LOGGER << "  Filtering out variants with imputation INFO score < 0.30, or customise it with --info flag." << std::endl;
-        }
-        */
-        if(preMiss < 1e-10){
-            geno->setFilterMiss(0.9);
-            LOGGER << "  Filtering out variants with missingness rate > 0.10, or customise it with --geno flag." << std::endl;
-        }
-    }else{
-        bOutResAll = true;
-    }
+    setDefaultFilters();
 
     vector<uint32_t> extractIndex(marker->count_extract());
     std::iota(extractIndex.begin(), extractIndex.end(), 0);
@@ -3104,8 +3660,14 @@ void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_
         p_geno = new double[nMarker];
         p_interaction = new double[nMarker];
     }
+    if(!bSaveBin) startResWriter();
     geno->loopDouble(extractIndex, nMarker, true, bCenter, false, false, callBacks);
+    stopResWriter();
 
+    if(assocStore){
+        assocStore->close();
+        assocStore.reset();
+    }
     osOut.flush();
     osOut.close();
     if(bOut){
@@ -3140,6 +3702,378 @@ void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_
     }
 }
 
+void FastFAM::fitTraitModel(uint32_t trait){
+    TraitModel &model = traitModels[trait];
+    model.col = pheno->get_pheno_col(trait);
+
+    VectorXd y = multiY.col(trait);
+    y.array() -= y.mean();
+    double Vpheno = y.squaredNorm() / (y.size() - 1);
+    if(Vpheno < 1e-5){
+        LOGGER.e(0, "the Vp of phenotype " + to_string(model.col) + " is below 1e-5. Please check: 1. Is there a scaling issue with the phenotype? 2. Can the covariates explain all the Vp (e.g., phenotype is included as a covariate by accident)?");
+    }
+
+    bool isSig = options.find("grmsparse_file") != options.end();
+    double VG = 0, VR = Vpheno;
+    if(isSig){
+        if(options.find("G") != options.end()){
+            VG = std::stod(options["G"]);
+            VR = std::stod(options["E"]);
+        }else{
+            VG = estimateVG(multiFam, y, isSig);
+            constrainVG(Vpheno, VG, VR, isSig);
+        }
+        if(!isSig){
+            LOGGER.w(0, "the estimate of Vg is not statistically significant (i.e., p > 0.05), linear regression is used for this phenotype.");
+        }
+    }
+
+    model.bMLM = isSig;
+    model.VG = VG;
+    model.VR = VR;
+    multiR.col(trait) = y;
+    if(!model.bMLM){
+        model.SSy = y.squaredNorm();
+        model.iN = 1.0 / (num_indi - (covarFlag ? covar.cols() : 1.0) - 1.0);
+    }
+}
+
+// A_f = U_f * diag(lambda_f) * U_f' of each family: dst = U' * src, or dst = U * src if src is in the eigen space
+void FastFAM::famEigenProject(const MatrixXd &src, MatrixXd &dst, bool bBack){
+    int64_t num_family = multiFamilies.size();
+    dst.resize(src.rows(), src.cols());
+    #pragma omp parallel for schedule(dynamic)
+    for(int64_t f = 0; f < num_family; f++){
+        const vector<int64_t> &members = multiFamilies[f];
+        int64_t start = multiStart[f];
+        int64_t size = members.size();
+        if(size == 1){
+            if(bBack){
+                dst.row(members[0]) = src.row(start);
+            }else{
+                dst.row(start) = src.row(members[0]);
+            }
+            continue;
+        }
+        const MatrixXd &U = multiU[f];
+        if(bBack){
+            MatrixXd block = U * src.middleRows(start, size);
+            for(int64_t j = 0; j < size; j++){
+                dst.row(members[j]) = block.row(j);
+            }
+        }else{
+            MatrixXd block(size, src.cols());
+            for(int64_t j = 0; j < size; j++){
+                block.row(j) = src.row(members[j]);
+            }
+            dst.middleRows(start, size).noalias() = U.transpose() * block;
+        }
+    }
+}
+
+void FastFAM::multiGrammar(){
+    int num_pheno = traitModels.size();
+    int num_marker_rand = 2000;
+    int soft_cap = 1000;
+    int nMarker = 100;
+
+    LOGGER.i(0, "\nTuning parameters of the mixed model phenotypes using " + to_string(num_marker_rand) + " null SNPs...");
+    LOGGER.ts("tuning");
+
+    // eigen decomposition of the family blocks, shared by the V of all the phenotypes
+    multiFamilies = getFamilies(multiFam);
+    int64_t num_family = multiFamilies.size();
+    multiU.resize(num_family);
+    multiStart.resize(num_family);
+    multiLambda.resize(num_indi);
+    int64_t start = 0;
+    for(int64_t f = 0; f < num_family; f++){
+        multiStart[f] = start;
+        start += multiFamilies[f].size();
+    }
+    bool success = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:success)
+    for(int64_t f = 0; f < num_family; f++){
+        const vector<int64_t> &members = multiFamilies[f];
+        int64_t size = members.size();
+        if(size == 1){
+            multiLambda[multiStart[f]] = multiFam.coeff(members[0], members[0]);
+            continue;
+        }
+        MatrixXd block = MatrixXd::Zero(size, size);
+        for(int64_t j = 0; j < size; j++){
+            for(SpMat::InnerIterator it(multiFam, members[j]); it; ++it){
+                int64_t local = std::lower_bound(members.begin(), members.end(), (int64_t)it.row()) - members.begin();
+                block(local, j) = it.value();
+            }
+        }
+        Eigen::SelfAdjointEigenSolver<MatrixXd> eigen(block);
+        if(eigen.info() != Eigen::Success){
+            success = false;
+            continue;
+        }
+        multiLambda.segment(multiStart[f], size) = eigen.eigenvalues();
+        multiU[f] = eigen.eigenvectors();
+    }
+    if(!success){
+        LOGGER.e(0, "failed to decompose the sparse GRM.");
+    }
+
+    // Vi_y = U * diag(1 / (Vg * lambda + Ve)) * U' * y, W: the diagonals of all the phenotypes
+    multiW.resize(num_indi, num_pheno);
+    for(int trait = 0; trait < num_pheno; trait++){
+        const TraitModel &model = traitModels[trait];
+        if(model.bMLM){
+            multiW.col(trait) = (model.VG * multiLambda.array() + model.VR).inverse().matrix();
+        }else{
+            multiW.col(trait).setZero();
+        }
+    }
+    MatrixXd Zy, Vi_Y;
+    famEigenProject(multiR, Zy, false);
+    Zy.array() *= multiW.array();
+    famEigenProject(Zy, Vi_Y, true);
+    for(int trait = 0; trait < num_pheno; trait++){
+        if(traitModels[trait].bMLM){
+            multiR.col(trait) = Vi_Y.col(trait);
+        }
+    }
+
+    vector<uint32_t> marker_index = getGrammarMarkers(num_marker_rand);
+    num_marker_rand = marker_index.size();
+    bValids.resize(num_marker_rand);
+    multiCinf.resize(num_marker_rand, num_pheno);
+    loopGrammar(marker_index, bind(&FastFAM::multiGrammarFunc, this, _1, _2));
+
+    for(int trait = 0; trait < num_pheno; trait++){
+        TraitModel &model = traitModels[trait];
+        if(!model.bMLM){
+            continue;
+        }
+        double tmp_cinf = 0;
+        int n_valid_null = 0;
+        for(int i = 0; i < num_marker_rand; i++){
+            if(std::isfinite(multiCinf(i, trait))){
+                tmp_cinf += multiCinf(i, trait);
+                n_valid_null++;
+                if(i >= soft_cap && n_valid_null >= nMarker){
+                    break;
+                }
+            }
+        }
+        if(n_valid_null < 100){
+            LOGGER.e(0, "not enough valid null SNPs (<100) for phenotype " + to_string(model.col) + ". \nYou may check if too variants are removed by a filter, e.g., MAF.");
+        }
+        model.c_inf = tmp_cinf / n_valid_null;
+        LOGGER.i(0, "Mean GRAMMAR-Gamma value of phenotype " + to_string(model.col) + " = " + to_string(model.c_inf));
+        multiR.col(trait) /= model.c_inf;
+    }
+    multiCinf.resize(0, 0);
+    multiW.resize(0, 0);
+    bValids.resize(0);
+    LOGGER << "Tuning of Gamma finished " << LOGGER.tp("tuning") << " seconds." << std::endl;
+}
+
+// g' * Vi * g = sum_k (U' * g)_k^2 / (Vg * lambda_k + Ve) for all the phenotypes by a GEMM
+void FastFAM::multiGrammarFunc(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+    int nMarker = markerIndex.size();
+    int num_pheno = traitModels.size();
+    MatrixXd G(num_indi, nMarker);
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < nMarker; i++){
+        int index_cur_marker = num_grammar_markers + i;
+        GenoBufItem &item = geno->getThreadGenoItem();
+        item.extractedMarkerIndex = markerIndex[i];
+        geno->getGenoDouble(genobuf, i, &item);
+        bValids[index_cur_marker] = item.valid;
+        if(item.valid){
+            G.col(i) = Map< VectorXd >(item.geno.data(), num_indi);
+            conditionCovarReg(G.col(i));
+        }else{
+            G.col(i).setZero();
+        }
+    }
+
+    MatrixXd Z;
+    famEigenProject(G, Z, false);
+    MatrixXd gVg = Z.cwiseAbs2().transpose() * multiW;
+    MatrixXd gViy = G.transpose() * multiR;
+    VectorXd gtg = G.colwise().squaredNorm().transpose();
+
+    #pragma omp parallel for
+    for(int i = 0; i < nMarker; i++){
+        int index_cur_marker = num_grammar_markers + i;
+        for(int trait = 0; trait < num_pheno; trait++){
+            double temp_cinf = std::numeric_limits<double>::quiet_NaN();
+            if(bValids[index_cur_marker] && traitModels[trait].bMLM){
+                double temp_chisq = gViy(i, trait) * gViy(i, trait) / gVg(i, trait);
+                if(temp_chisq < 5){
+                    temp_cinf = gVg(i, trait) / gtg[i];
+                }
+            }
+            multiCinf(index_cur_marker, trait) = temp_cinf;
+        }
+    }
+    num_grammar_markers += nMarker;
+}
+
+void FastFAM::processMultiPheno(){
+    uint32_t num_pheno = pheno->count_pheno();
+    traitModels.resize(num_pheno);
+    multiR.resize(num_indi, num_pheno);
+    for(uint32_t trait = 0; trait < num_pheno; trait++){
+        LOGGER.i(0, "\nFitting the model of phenotype " + to_string(trait + 1) + " (column " + to_string(pheno->get_pheno_col(trait)) + ")...");
+        fitTraitModel(trait);
+    }
+    multiY.resize(0, 0);
+    if(std::any_of(traitModels.begin(), traitModels.end(), [](const TraitModel &model){return model.bMLM;})){
+        multiGrammar();
+    }
+    multiFam.resize(0, 0);
+    int num_mlm = std::count_if(traitModels.begin(), traitModels.end(), [](const TraitModel &model){return model.bMLM;});
+    LOGGER.i(0, "\nPerforming fastGWA association analysis of " + to_string(num_pheno) + " phenotypes in one pass, "
+            + to_string(num_mlm) + " by mixed model and " + to_string(num_pheno - num_mlm) + " by linear regression...");
+
+    // [out].pheno[col].fastGWA
+    string prefix = options["out"];
+    string suffix = ".fastGWA";
+    if(prefix.size() > suffix.size() && prefix.compare(prefix.size() - suffix.size(), suffix.size(), suffix) == 0){
+        prefix = prefix.substr(0, prefix.size() - suffix.size());
+    }
+    vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
+    if(hasInfo)header.push_back("INFO");
+    string header_string = boost::algorithm::join(header, "\t");
+    for(uint32_t trait = 0; trait < num_pheno; trait++){
+        string filename = prefix + ".pheno" + to_string(traitModels[trait].col) + suffix;
+        osOuts.emplace_back(new std::ofstream(filename.c_str()));
+        if(!(*osOuts.back())){
+            LOGGER.e(0, "can't open [" + filename + "] to write.");
+        }
+        *osOuts.back() << header_string << "\n";
+    }
+    LOGGER << "fastGWA results will be saved in text format to [" << prefix << ".pheno*" << suffix << "]." << std::endl;
+
+    setDefaultFilters();
+
+    vector<uint32_t> extractIndex(marker->count_extract());
+    std::iota(extractIndex.begin(), extractIndex.end(), 0);
+
+    multiBufSize = 1024;
+    beta = new float[(uint64_t)multiBufSize * num_pheno];
+    se = new float[(uint64_t)multiBufSize * num_pheno];
+    p = new double[(uint64_t)multiBufSize * num_pheno];
+    countMarkers = new uint32_t[multiBufSize];
+    af = new float[multiBufSize];
+    info = new float[multiBufSize];
+    numMarkerOutput = 0;
+
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(bind(&FastFAM::calculate_multi, this, _1, _2));
+    geno->loopDouble(extractIndex, multiBufSize, true, true, false, false, callBacks);
+
+    for(auto &os : osOuts){
+        os->close();
+    }
+    osOuts.clear();
+    LOGGER << "Saved " << numMarkerOutput << " SNPs for each phenotype." << std::endl;
+
+    delete[] beta;
+    delete[] se;
+    delete[] p;
+    delete[] countMarkers;
+    delete[] af;
+    delete[] info;
+}
+
+// the scores of all the phenotypes are the GEMM of the genotype panel and the n * P residuals
+void FastFAM::calculate_multi(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
+    int num_pheno = traitModels.size();
+    vector<uint8_t> isValids(num_marker);
+
+    int width = panelWidth(num_marker);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_marker; start += width){
+        int cols = std::min(width, num_marker - start);
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, covarFlag);
+
+        MatrixXd xtR = xPanel.transpose() * multiR;
+        VectorXd xtx = xPanel.colwise().squaredNorm().transpose();
+
+        #pragma omp parallel for
+        for(int k = 0; k < cols; k++){
+            int i = start + k;
+            const GenoBufItem &item = items[k];
+            isValids[i] = item.valid;
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info;
+            if(!item.valid){
+                continue;
+            }
+
+            for(int trait = 0; trait < num_pheno; trait++){
+                const TraitModel &model = traitModels[trait];
+                double x_r = xtR(k, trait);
+                double temp_beta = x_r / xtx[k];
+                double temp_se, temp_chisq;
+                if(model.bMLM){
+                    temp_chisq = temp_beta * x_r * model.c_inf;
+                    temp_se = sqrt(temp_beta * temp_beta / temp_chisq);
+                }else{
+                    double sse = (model.SSy - temp_beta * x_r) * model.iN;
+                    temp_se = sqrt(sse / xtx[k]);
+                    double temp_z = temp_beta / temp_se;
+                    temp_chisq = temp_z * temp_z;
+                }
+                uint64_t index = (uint64_t)trait * multiBufSize + i;
+                beta[index] = (float)temp_beta;
+                se[index] = (float)temp_se;
+                p[index] = StatLib::pchisqd1(temp_chisq);
+            }
+        }
+    }
+
+    output_res_multi(isValids, markerIndex);
+}
+
+void FastFAM::output_res_multi(const vector<uint8_t> &isValids, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
+    int num_pheno = traitModels.size();
+    vector<string> marker_strs(num_marker);
+    int numKept = 0;
+    for(int i = 0; i != num_marker; i++){
+        if(isValids[i] || bOutResAll){
+            marker_strs[i] = marker->getMarkerStrExtract(markerIndex[i]);
+            numKept++;
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int trait = 0; trait < num_pheno; trait++){
+        std::ostream &os = *osOuts[trait];
+        uint64_t base = (uint64_t)trait * multiBufSize;
+        for(int i = 0; i != num_marker; i++){
+            if(isValids[i]){
+                os << marker_strs[i] << "\t" << countMarkers[i]
+                    << "\t" << af[i] << "\t" << beta[base + i] << "\t" << se[base + i] << "\t" << p[base + i];
+            }else if(bOutResAll){
+                os << marker_strs[i] << "\t" << countMarkers[i]
+                    << "\t" << af[i] << "\tNA\tNA\tNA";
+            }else{
+                continue;
+            }
+            if(hasInfo){
+                os << "\t" << info[i];
+            }
+            os << "\n";
+        }
+    }
+
+    numMarkerOutput += numKept;
+}
+
 int FastFAM::registerOption(map<string, vector<string>>& options_in){
     int returnValue = 0;
     //DEBUG: change to .fastFAM
@@ -3276,6 +4210,12 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
         //options_in.erase(curFlag);
     }
 
+    curFlag = "--save-assoc";
+    if(options_in.find(curFlag) != options_in.end()){
+        options["save_assoc"] = "yes";
+        options_in.erase(curFlag);
+    }
+
     curFlag = "--no-marker";
     if(options_in.find(curFlag) != options_in.end()){
         options["no_marker"] = "yes";
@@ -3311,6 +4251,12 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
         options_in.erase(curFlag);
     }
 
+    curFlag = "--spb-checksum";
+    if(options_in.find(curFlag) != options_in.end()){
+        options["spb_checksum"] = "yes";
+        options_in.erase(curFlag);
+    }
+
     curFlag = "--model-only";
     bool model_only = false;
     if(options_in.find(curFlag) != options_in.end()){
@@ -3494,6 +4440,10 @@ void FastFAM::processMain(){
     for(auto &process_function : processFunctions){
         if(process_function == "fast_fam"){
             FastFAM ffam;
+            if(ffam.bMultiPheno){
+                ffam.processMultiPheno();
+                continue;
+            }
             if(options.find("save_inv") != options.end()){
                 LOGGER.i(0, "Use --load-inv to load the V inverse file for fastGWA");
                 return;
@@ -3714,7 +4664,7 @@ void FastFAM::getX(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     for(int i = 0; i < num_marker; i++){
         int index_cur_marker = num_gene_index + i;
         uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
+        GenoBufItem &item = geno->getThreadGenoItem();
         item.extractedMarkerIndex = cur_marker;
         geno->getGenoDouble(genobuf, i, &item);
         
@@ -4134,6 +5084,15 @@ void FastFAM::initVar(){
     if(spaCutOff < 0.1){
         spaCutOff = 0.1;
     }
+
+    // scratch of each thread for the per-marker tests
+    int num_thread = omp_get_max_threads();
+    threadCovarScratch.resize(num_thread);
+    threadIndex0.resize(num_thread);
+    for(int thread = 0; thread < num_thread; thread++){
+        threadCovarScratch[thread].resize(num_covar);
+        threadIndex0[thread].reserve(num_indi);
+    }
 }
 
 void FastFAM::initBinary(const SpMat &fam){
@@ -4199,24 +5158,32 @@ void FastFAM::initBinary(const SpMat &fam){
 
 void FastFAM::binGrammar_func(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     int nMarker = markerIndex.size();
+    MatrixXd G(num_indi, nMarker);
     #pragma omp parallel for schedule(dynamic)
     for(int i = 0; i < nMarker; i++){
         int index_cur_marker = num_grammar_markers + i;
-        GenoBufItem item;
+        GenoBufItem &item = geno->getThreadGenoItem();
         item.extractedMarkerIndex = markerIndex[i];
         geno->getGenoDouble(genobuf, i, &item);
         bValids[index_cur_marker] = item.valid;
         if(item.valid){
-            Map< VectorXd > curGeno(item.geno.data(), num_indi);
-            if(bPreciseCovar) conditionCovarBinReg(curGeno);
-            //VectorXd PY = solverV.solve(Y) - ViX * inv_XtVX_ViX * Y;
-            VectorXd PG = solverV.solve(curGeno) - ViX * (inv_XtVX_ViX * curGeno);
-            //VectorXd centerGeno = curGeno.array() - curGeno.mean();
-            //VectorXd WG = dWp.cwiseProduct(centerGeno);
-            //double temp_gamma = curGeno.dot(PG) / centerGeno.dot(WG);
-            VectorXd WG = dWp.cwiseProduct(curGeno);
-            double temp_gamma = curGeno.dot(PG) / curGeno.dot(WG);
+            G.col(i) = Map< VectorXd >(item.geno.data(), num_indi);
+            if(bPreciseCovar) conditionCovarBinReg(G.col(i));
+        }else{
+            G.col(i).setZero();
+        }
+    }
+
+    //PG = Vi * G - ViX * inv_XtVX_ViX * G, for all the SNPs of the block
+    MatrixXd PG = G;
+    solvePanelLDLT(solverV, PG);
+    PG.noalias() -= ViX * (inv_XtVX_ViX * G);
 
+    #pragma omp parallel for
+    for(int i = 0; i < nMarker; i++){
+        int index_cur_marker = num_grammar_markers + i;
+        if(bValids[index_cur_marker]){
+            double temp_gamma = G.col(i).dot(PG.col(i)) / G.col(i).dot(dWp.cwiseProduct(G.col(i)));
             v_c_infs[index_cur_marker] = temp_gamma;
         }
     }
@@ -4349,64 +5316,165 @@ void FastFAM::estBinGamma(){
 void FastFAM::calculate_spa(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
+
+    auto spa_res = [this](int i, const GenoBufItem &item, const SPARes &res, double varSNP){
+        Tscore[i] = (float)res.score; //* geno->RDev[cur_raw_marker]; 
+        Tse[i] = (float)varSNP;
+        p[i] = res.p; 
+        padj[i] = res.p_adj;
+        rConverge[i] = res.bConverge;
+        af[i] = (float)item.af;
+        countMarkers[i] = item.nValidN;
+        info[i] = item.info;
+        double temp_beta = res.score / (varSNP *varSNP);
+        beta[i] = (float) temp_beta;
+        se[i] = std::abs(temp_beta) / sqrt(StatLib::qchisqd1(res.p_adj));
+    };
+
+    // rare variants from the carriers, the others are decoded into panels
+    if(!carrierModel.bReady) initCarrierModel(phenoVecMu, dWp, true);
+    vector<uint8_t> bCarrier(num_marker, 0);
     #pragma omp parallel for schedule(dynamic)
     for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-        geno->getGenoDouble(genobuf, i, &item);
-        
+        int thread = omp_get_thread_num();
+        GenoBufItem &item = geno->getThreadGenoItem();
+        item.extractedMarkerIndex = markerIndex[i];
+        GenoCarriers &carriers = carrierModel.threadCarriers[thread];
+        if(!geno->getGenoCarriers(genobuf, i, &item, maxCarrierRate, carriers)){
+            continue;
+        }
         isValids[i] = item.valid;
         if(!item.valid){
+            bCarrier[i] = 1;
             continue;
         }
 
-        Map< VectorXd > xvec(item.geno.data(), num_indi);
-        VectorXd xvec2 = xvec;
-
-        if(bPreciseCovar) conditionCovarBinReg(xvec);
+        double *h = carrierModel.threadH[thread].data();
+        CarrierStat raw, adj;
+        carrierStats(carriers, raw, adj, h);
+        const CarrierStat &test = bPreciseCovar ? adj : raw;
+        double varSNP = std::sqrt(test.xtWx * c_inf);
 
-        double varSNP = std::sqrt(xvec.dot(dWp.cwiseProduct(xvec)) * c_inf);
- 
         SPARes res;
-        res.score = xvec.dot(phenoVecMu);
+        res.score = test.xtr;
         double chisq = std::abs(res.score) / varSNP;
-
         res.p = StatLib::pchisqd1(chisq * chisq);
-
         res.bConverge = true;
-        if( chisq < spaCutOff){
+        if(chisq < spaCutOff){
             res.p_adj = res.p;
         }else{
-            vector<uint32_t> index0;
-            index0.reserve(num_indi);
             double thresh = -item.mean + 1e-6;
-            //double thresh = 1e-6;
-            for(uint32_t i = 0; i < num_indi; i++){
-                if(xvec2[i] > thresh){
-                    index0.push_back(i);
+            // most samples are carriers in the definition of SPA, e.g. A1 is the major allele
+            if(carriers.base > thresh) continue;
+
+            vector<uint32_t> &index0 = threadIndex0[thread];
+            index0.clear();
+            uint32_t num_carrier = carriers.index.size();
+            for(uint32_t k = 0; k < num_carrier; k++){
+                if(carriers.value[k] > thresh) index0.push_back(carriers.index[k]);
+            }
+            Map<VectorXd> vh(h, carrierModel.covarT.rows());
+            vector<double> &gNZ = carrierModel.threadG[thread];
+            gNZ.resize(index0.size());
+            double gPos = 0, gNeg = 0;
+            for(uint32_t k = 0, j = 0; k < num_carrier; k++){
+                if(carriers.value[k] <= thresh) continue;
+                double g = carriers.value[k] - carrierModel.covarT.col(carriers.index[k]).dot(vh);
+                gNZ[j++] = g;
+                if(g > 0){
+                    gPos += g;
+                }else{
+                    gNeg += g;
                 }
             }
 
-            if(!bPreciseCovar) conditionCovarBinReg(xvec);
-
-            double q = xvec.dot(phenoVec);
+            double q = adj.xty;
             double qinv = q - res.score - res.score;
-            SPA spa(q, qinv, xvec, index0);
+            // the sum of the other samples bounds their positive and negative parts, the exact sums are
+            //   needed only if q is not within the bounds
+            double rest = adj.xt1 - std::accumulate(gNZ.begin(), gNZ.end(), 0.0);
+            double gPosLow = gPos + std::max(rest, 0.0);
+            double gNegUp = gNeg + std::min(rest, 0.0);
+            if(q < gPosLow && q > gNegUp && qinv < gPosLow && qinv > gNegUp){
+                gPos = gPosLow;
+                gNeg = gNegUp;
+            }else{
+                VectorXd &xvec = carrierModel.threadX[thread];
+                if(xvec.size() != num_indi) xvec.resize(num_indi);
+                xvec.setConstant(carriers.base);
+                for(uint32_t k = 0; k < num_carrier; k++){
+                    xvec[carriers.index[k]] = carriers.value[k];
+                }
+                xvec.noalias() -= covar * vh;
+                gPos = (xvec.array() > 0).select(xvec.array(), 0).sum();
+                gNeg = (xvec.array() < 0).select(xvec.array(), 0).sum();
+            }
+
+            SPA spa(q, qinv, gPos, gNeg, adj.xtWx, index0, gNZ.data());
             spa.saddleProb(&res);
         }
+        bCarrier[i] = 1;
+        spa_res(i, item, res, varSNP);
+    }
+    vector<int> denseIndex;
+    for(int i = 0; i < num_marker; i++){
+        if(!bCarrier[i]) denseIndex.push_back(i);
+    }
+    int num_dense = denseIndex.size();
+
+    int width = panelWidth(num_dense);
+    MatrixXd &xPanel = panelGeno;
+    vector<GenoBufItem> &items = panelItems;
+    for(int start = 0; start < num_dense; start += width){
+        int cols = std::min(width, num_dense - start);
+        // the raw genotypes are kept to find the carriers for the saddle point approximation
+        getCondGenoPanel(genobuf, markerIndex, start, cols, xPanel, items, bPreciseCovar, bPreciseCovar ? &panelRawGeno : NULL, &denseIndex);
+        const MatrixXd &xRaw = bPreciseCovar ? panelRawGeno : xPanel;
+
+        VectorXd scores = xPanel.transpose() * phenoVecMu;
+        VectorXd xWxs = (xPanel.array().colwise() * dWp.array()).matrix().cwiseProduct(xPanel).colwise().sum().transpose();
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < cols; k++){
+            int i = denseIndex[start + k];
+            const GenoBufItem &item = items[k];
+            isValids[i] = item.valid;
+            if(!item.valid){
+                continue;
+            }
 
-        Tscore[i] = (float)res.score; //* geno->RDev[cur_raw_marker]; 
-        Tse[i] = (float)varSNP;
-        p[i] = res.p; 
-        padj[i] = res.p_adj;
-        rConverge[i] = res.bConverge;
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info;
-        double temp_beta = res.score / (varSNP *varSNP);
-        beta[i] = (float) temp_beta;
-        se[i] = std::abs(temp_beta) / sqrt(StatLib::qchisqd1(res.p_adj));
+            Ref<VectorXd> xvec = xPanel.col(k);
+            double varSNP = std::sqrt(xWxs[k] * c_inf);
+
+            SPARes res;
+            res.score = scores[k];
+            double chisq = std::abs(res.score) / varSNP;
+
+            res.p = StatLib::pchisqd1(chisq * chisq);
+
+            res.bConverge = true;
+            if( chisq < spaCutOff){
+                res.p_adj = res.p;
+            }else{
+                vector<uint32_t> &index0 = threadIndex0[omp_get_thread_num()];
+                index0.clear();
+                double thresh = -item.mean + 1e-6;
+                //double thresh = 1e-6;
+                for(uint32_t j = 0; j < num_indi; j++){
+                    if(xRaw(j, k) > thresh){
+                        index0.push_back(j);
+                    }
+                }
+
+                if(!bPreciseCovar) conditionCovarBinReg(xvec);
+
+                double q = xvec.dot(phenoVec);
+                double qinv = q - res.score - res.score;
+                SPA spa(q, qinv, xvec, index0);
+                spa.saddleProb(&res);
+            }
+            spa_res(i, item, res, varSNP);
+        }
     }
 
     output_res_spa(isValids, markerIndex);
@@ -18,6 +18,8 @@
 
 #include "cpu_f77blas.h"
 #include "GRM.h"
+#include "SpGRM.h"
+#include "GRMView.h"
 #include "Logger.h"
 #include <iterator>
 #include <algorithm>
@@ -26,6 +28,8 @@
 #include <cstring>
 #include <numeric>
 #include <unordered_set>
+#include <unordered_map>
+#include <thread>
 #include "utils.hpp"
 #include "AsyncBuffer.hpp"
 #include "utils.hpp"
@@ -38,6 +42,8 @@
 
 using std::to_string;
 
+static_assert(sizeof(GRMAccHeader) == 64, "the header of the GRM accumulators shall be 64 bytes");
+
 map<string, string> GRM::options;
 map<string, double> GRM::options_d;
 map<string, bool> GRM::options_b;
@@ -54,31 +60,14 @@ GRM::GRM(){
         grm_ids = Pheno::read_sublist(grm_file + ".grm.id");
         num_subjects = grm_ids.size();
 
-        uint64_t num_grm = num_subjects * (num_subjects + 1) / 2;
-        FILE *file = fopen((grm_file + ".grm.bin").c_str(), "rb");
-        if(!file){
-            LOGGER.e(0, "can't open " + grm_file + ".grm.bin");
-        }
-        if(num_grm * 4 != getFileByteSize(file)){
-            LOGGER.e(0, "The IDs in GRM and the IDs in the GRM binary file do not match [" + grm_file + "]");
+        grm_view.reset(new GRMView(grm_file + ".grm.bin", num_subjects, true));
+        if(grm_view->isConstant()){
+            LOGGER.e(0, "[" + grm_file + ".grm.bin] is a constant, which is only supported for the .grm.N.bin.");
         }
-        fclose(file);
-
-        uint64_t num_grm_byte = num_grm * 4;
-        uint64_t num_parts = (num_grm_byte + num_byte_GRM_read - 1) / num_byte_GRM_read;
-        vector<uint32_t> parts = divide_parts(0, num_subjects - 1, num_parts);
-        index_grm_pairs.reserve(parts.size());
-        byte_part_grms.reserve(parts.size());
-
-        index_grm_pairs.push_back(std::make_pair(0, parts[0]));
-        byte_part_grms.push_back((0 + parts[0] + 2) * (parts[0] + 1) / 2);
-        for(int index = 1; index != parts.size(); index++){
-            index_grm_pairs.push_back(std::make_pair(parts[index - 1] + 1, parts[index]));
-            byte_part_grms.push_back(((uint64_t)parts[index - 1] + parts[index] + 3) * (parts[index] - parts[index - 1]) / 2);
+        if(checkFileReadable(grm_file + ".grm.N.bin")){
+            N_view.reset(new GRMView(grm_file + ".grm.N.bin", num_subjects, true));
         }
 
-        num_byte_buffer = *std::max_element(byte_part_grms.begin(), byte_part_grms.end());
-
         index_keep.resize(num_subjects);
         std::iota(index_keep.begin(), index_keep.end(), 0);
 
@@ -93,6 +82,8 @@ GRM::GRM(){
             LOGGER << "Get " << rm_lists.size() << " samples from list [" << options["remove_file"] << "]." << std::endl;
             Pheno::set_keep(rm_lists, grm_ids, index_keep, false);
         }
+        grm_view->setKeep(index_keep);
+        if(N_view) N_view->setKeep(index_keep);
     }
     if(options.find("mgrm") != options.end()){
     }
@@ -100,8 +91,9 @@ GRM::GRM(){
 
 }
 
-void GRM::subtract_grm(string mgrm_file, string out_file){
-   std::ifstream mgrm(mgrm_file.c_str());
+// the prefixes of GRMs listed in [mgrm_file], the .grm.N.bin is checked if bNeedN
+static vector<string> read_mgrm_files(const string &mgrm_file, bool bNeedN){
+    std::ifstream mgrm(mgrm_file.c_str());
     if(!mgrm){
         LOGGER.e(0, "can't open " + mgrm_file + " to read.");
     }
@@ -111,7 +103,8 @@ void GRM::subtract_grm(string mgrm_file, string out_file){
     while(getline(mgrm, line)){
         boost::trim(line);
         if(!line.empty()){
-            if(checkFileReadable(line+".grm.id") && checkFileReadable(line+".grm.bin") && checkFileReadable(line + ".grm.N.bin")){
+            if(checkFileReadable(line+".grm.id") && checkFileReadable(line+".grm.bin") && 
+                    (!bNeedN || checkFileReadable(line + ".grm.N.bin"))){
                 files.push_back(line);
             }else{
                 err_files.push_back(line);
@@ -120,11 +113,118 @@ void GRM::subtract_grm(string mgrm_file, string out_file){
     }
 
     if(err_files.size() != 0){
-        string out_err = "can't read GRM (*.grm.id, *.grm.bin) in ";
+        string out_err = bNeedN ? "can't read GRM (*.grm.id, *.grm.bin, *.grm.N.bin) in " : "can't read GRM (*.grm.id, *.grm.bin) in ";
         out_err += boost::algorithm::join(err_files, ", ");
         out_err += ".";
         LOGGER.e(0, out_err);
     }
+    return files;
+}
+
+// Streaming engine of the GRM arithmetic: 
+//   with N:    N = sum_k w_k * N_k, GRM = sum_k w_k * GRM_k * N_k / N (0 if N is 0);
+//   without N: GRM = sum_k w_k * GRM_k.
+// All views shall keep the same samples in the same order. The output rows are cut into blocks of
+// ~64MB, the rows in a block are computed in parallel from the memory-mapped inputs while the previous
+// block is written by another thread, thus the memory is bounded and the inputs are read only once.
+static void stream_grm_arith(const vector<GRMView *> &grms, const vector<GRMView *> &Ns, const vector<double> &weights,
+        const string &out_file){
+    uint32_t num_grm = grms.size();
+    bool bN = !Ns.empty();
+    uint64_t num_keep = grms[0]->size();
+    for(uint32_t k = 0; k < num_grm; k++){
+        if(grms[k]->size() != num_keep || (bN && Ns[k]->size() != num_keep)){
+            LOGGER.e(0, "inconsistent number of samples among the GRMs.");
+        }
+    }
+
+    FILE *ho_grm = fopen((out_file + ".grm.bin").c_str(), "wb");
+    FILE *ho_grmN = bN ? fopen((out_file + ".grm.N.bin").c_str(), "wb") : NULL;
+    if(!ho_grm || (bN && !ho_grmN)){
+        LOGGER.e(0, "can't write to [" + out_file + ".grm.bin" + (bN ? ", .grm.N.bin]." : "]."));
+    }
+
+    // the pages of the rows that have been read are released if the samples are in the file order
+    vector<bool> releasable(num_grm);
+    for(uint32_t k = 0; k < num_grm; k++){
+        const vector<uint32_t> &keep = grms[k]->getKeep();
+        releasable[k] = std::is_sorted(keep.begin(), keep.end());
+    }
+
+    const uint64_t num_buf_item = 16 * 1024 * 1024;
+    vector<float> buf[2], bufN[2];
+    std::thread writer;
+    bool write_ok = true;
+    int cur_buf = 0;
+    uint64_t row_from = 0;
+    while(row_from < num_keep){
+        uint64_t row_to = row_from;
+        uint64_t base = row_from * (row_from + 1) / 2;
+        while(row_to < num_keep && (row_to + 1) * (row_to + 2) / 2 - base <= std::max(num_buf_item, row_to + 1)){
+            row_to++;
+        }
+        uint64_t num_item = row_to * (row_to + 1) / 2 - base;
+        vector<float> &out = buf[cur_buf];
+        vector<float> &outN = bufN[cur_buf];
+        out.resize(num_item);
+        if(bN) outN.resize(num_item);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(uint64_t i = row_from; i < row_to; i++){
+            float *p_out = out.data() + i * (i + 1) / 2 - base;
+            float *p_outN = bN ? outN.data() + i * (i + 1) / 2 - base : NULL;
+            for(uint64_t j = 0; j <= i; j++){
+                double sum = 0.0, sumN = 0.0;
+                for(uint32_t k = 0; k < num_grm; k++){
+                    double value = (*grms[k])(i, j);
+                    if(bN){
+                        double n = (*Ns[k])(i, j);
+                        sum += weights[k] * value * n;
+                        sumN += weights[k] * n;
+                    }else{
+                        sum += weights[k] * value;
+                    }
+                }
+                if(bN){
+                    p_outN[j] = (float)sumN;
+                    p_out[j] = sumN != 0.0 ? (float)(sum / sumN) : 0.0f;
+                }else{
+                    p_out[j] = (float)sum;
+                }
+            }
+        }
+
+        if(writer.joinable()) writer.join();
+        if(!write_ok){
+            LOGGER.e(0, "can't write to [" + out_file + ".grm.bin], please check the disk condition or permission.");
+        }
+        writer = std::thread([&out, &outN, num_item, bN, ho_grm, ho_grmN, &write_ok](){
+            if(fwrite(out.data(), sizeof(float), num_item, ho_grm) != num_item ||
+                    (bN && fwrite(outN.data(), sizeof(float), num_item, ho_grmN) != num_item)){
+                write_ok = false;
+            }
+        });
+
+        for(uint32_t k = 0; k < num_grm; k++){
+            if(releasable[k]){
+                const vector<uint32_t> &keep = grms[k]->getKeep();
+                grms[k]->release(keep[row_from], keep[row_to - 1]);
+                if(bN) Ns[k]->release(keep[row_from], keep[row_to - 1]);
+            }
+        }
+        cur_buf = 1 - cur_buf;
+        row_from = row_to;
+    }
+    if(writer.joinable()) writer.join();
+    if(!write_ok){
+        LOGGER.e(0, "can't write to [" + out_file + ".grm.bin], please check the disk condition or permission.");
+    }
+    fclose(ho_grm);
+    if(ho_grmN) fclose(ho_grmN);
+}
+
+void GRM::subtract_grm(string mgrm_file, string out_file){
+    vector<string> files = read_mgrm_files(mgrm_file, true);
     if(files.size() != 2){
         LOGGER.e(0, "only 2 GRMs are supported currently.");
     }
@@ -143,101 +243,22 @@ void GRM::subtract_grm(string mgrm_file, string out_file){
     std::copy(common_id.begin(), common_id.end(), std::ostream_iterator<string>(o_id, "\n"));
     o_id.close();
 
-    uint64_t grm_size = (1 + common_id.size()) * common_id.size() / 2;
-    uint64_t grm_file_size = grm_size * 4; 
-
-    FILE * h_grm1 = fopen((files[0] + ".grm.bin").c_str(), "rb");
-    FILE * h_grmN1 = fopen((files[0] + ".grm.N.bin").c_str(), "rb");
-    FILE * h_grm2 = fopen((files[1] + ".grm.bin").c_str(), "rb");
-    FILE * h_grmN2 = fopen((files[1] + ".grm.N.bin").c_str(), "rb");
-    if(grm_file_size != getFileSize(h_grm1)){
-        LOGGER.e(0, "The size of [" + files[0] + ".grm.bin] is not correct.");
-    }
-    if(grm_file_size != getFileSize(h_grmN1)){
-        LOGGER.e(0, "The size of [" + files[0] + ".grm.N.bin] is not correct.");
-    }
-    if(grm_file_size != getFileSize(h_grm2)){
-        LOGGER.e(0, "The size of [" + files[1] + ".grm.bin] is not correct.");
-    }
-    if(grm_file_size != getFileSize(h_grmN2)){
-        LOGGER.e(0, "The size of [" + files[1] + ".grm.N.bin] is not correct.");
-    }
+    uint64_t num_sample = common_id.size();
+    GRMView grm1(files[0] + ".grm.bin", num_sample, true);
+    GRMView grmN1(files[0] + ".grm.N.bin", num_sample, true);
+    GRMView grm2(files[1] + ".grm.bin", num_sample, true);
+    GRMView grmN2(files[1] + ".grm.N.bin", num_sample, true);
 
-    uint64_t itemRead = 26214400;
-    float *buf1 = new float[itemRead];
-    float *buf2 = new float[itemRead];
-    float *buf = new float[itemRead];
-    float *bufN1 = new float[itemRead];
-    float *bufN2 = new float[itemRead];
-    float *bufN = new float[itemRead];
-    
-    int loop_num = (grm_size + itemRead - 1) / itemRead;
-    uint64_t remain_item = grm_size % itemRead;
     LOGGER.i(0, "Subtracting GRMs...");
-    FILE *ho_grm = fopen((out_file + ".grm.bin").c_str(), "wb");
-    FILE *ho_grmN = fopen((out_file + ".grm.N.bin").c_str(), "wb");
-
-    for(int i = 0; i < loop_num; i++){
-        if(i == loop_num - 1 && remain_item != 0) itemRead = remain_item;
-        readBytes(h_grm1, itemRead, buf1);
-        readBytes(h_grm2, itemRead, buf2);
-        readBytes(h_grmN1, itemRead, bufN1);
-        readBytes(h_grmN2, itemRead, bufN2);
-        for(int j = 0; j < itemRead; j++){
-            bufN[j] = bufN1[j] - bufN2[j];
-            buf[j] = (float)(((double)buf1[j] * bufN1[j] - (double)buf2[j] * bufN2[j]) / bufN[j]);
-        }
-        if(fwrite(buf, sizeof(float), itemRead, ho_grm) != itemRead){
-            LOGGER.e(0, "can't write to [" + out_file + ".grm.bin].");
-        }
-        if(fwrite(bufN, sizeof(float), itemRead, ho_grmN) != itemRead){
-            LOGGER.e(0, "can't write to [" + out_file + ".grm.N.bin].");
-        }
-    }
+    stream_grm_arith({&grm1, &grm2}, {&grmN1, &grmN2}, {1.0, -1.0}, out_file);
     LOGGER.i(0, "The subtracted GRM has been written to [" + out_file + ".grm.bin, .grm.N.bin].");
-
-    delete[] buf1;
-    delete[] buf2;
-    delete[] bufN1;
-    delete[] bufN2;
-    delete[] buf;
-    delete[] bufN;
 }
 
-
-void GRM::unify_grm(string mgrm_file, string out_file){
-    std::ifstream mgrm(mgrm_file.c_str());
-    if(!mgrm){
-        LOGGER.e(0, "can't open " + mgrm_file + " to read.");
-    }
-    string line;
-    vector<string> files;
-    vector<string> err_files;
-    while(getline(mgrm, line)){
-        boost::trim(line);
-        if(!line.empty()){
-            if(checkFileReadable(line+".grm.id") && checkFileReadable(line+".grm.bin")){
-                files.push_back(line);
-            }else{
-                err_files.push_back(line);
-            }
-        }
-    }
-
-    if(err_files.size() != 0){
-        string out_err = "can't read GRM (*.grm.id, *.grm.bin) in ";
-        out_err += boost::algorithm::join(err_files, ", ");
-        out_err += ".";
-        LOGGER.e(0, out_err);
-    }
-    if(files.size() < 2){
-        LOGGER.e(0, "not enough valid GRMs to be unified.");
-    }
-
+// common samples of all the GRMs in the order of the first one, then --keep and --remove are applied
+void GRM::common_grm_id(const vector<string> &files, vector<vector<string>> &ids, vector<string> &common_id){
     LOGGER.i(0, "Reading [" + files[0] + ".grm.id]...");
-    vector<string> common_id = Pheno::read_sublist(files[0] + ".grm.id");
+    common_id = Pheno::read_sublist(files[0] + ".grm.id");
     LOGGER << common_id.size() << " samples have been read." << std::endl;
-    vector<vector<string>> ids;
     ids.resize(files.size());
     
     ids[0] = common_id;
@@ -282,6 +303,18 @@ void GRM::unify_grm(string mgrm_file, string out_file){
         common_id = remain_ids;
         LOGGER << common_id.size() << " common samples after merging." << std::endl;
     }
+}
+
+void GRM::unify_grm(string mgrm_file, string out_file){
+    vector<string> files = read_mgrm_files(mgrm_file, false);
+    if(files.size() < 2){
+        LOGGER.e(0, "not enough valid GRMs to be unified.");
+    }
+
+    vector<vector<string>> ids;
+    vector<string> common_id;
+    common_grm_id(files, ids, common_id);
+
     vector<vector<uint32_t>> grm_indices(files.size());
     //produce output file names
     vector<string> output_fileNames;
@@ -307,76 +340,100 @@ void GRM::unify_grm(string mgrm_file, string out_file){
     }
 
     LOGGER.i(0, "Writing unified GRM in binary format...");
-    #pragma omp parallel for
     for(int i = 0; i < grm_indices.size(); i++){
         vector<uint32_t> &p_index = grm_indices[i];
-        uint32_t size_grm = p_index.size();
         uint32_t largest_grm_size = ids[i].size();
-        string file_name = files[i] + ".grm.bin";
-        string wfile_name = output_fileNames[i] + ".grm.bin";
-        FILE *h_grm = fopen(file_name.c_str(), "rb");
-        if(!h_grm){
-            LOGGER.e(0, "can't read " + file_name + ".");
+        GRMView view(files[i] + ".grm.bin", largest_grm_size);
+        view.setKeep(p_index);
+        // the numbers of SNPs are unified as well if there are
+        std::unique_ptr<GRMView> view_N;
+        vector<GRMView *> Ns;
+        if(checkFileReadable(files[i] + ".grm.N.bin")){
+            view_N.reset(new GRMView(files[i] + ".grm.N.bin", largest_grm_size));
+            view_N->setKeep(p_index);
+            Ns.push_back(view_N.get());
         }
+        stream_grm_arith({&view}, Ns, {1.0}, output_fileNames[i]);
+        LOGGER.i(0, "GRM has been written to [" + output_fileNames[i] + (Ns.empty() ? ".grm.bin]." : ".grm.bin, .grm.N.bin]."));
+    }
 
-        FILE *h_wgrm = fopen(wfile_name.c_str(), "wb");
-        if(!h_wgrm){
-            LOGGER.e(0, "can't write to " + wfile_name + ".");
-        }
+}
 
-        float *buf = new float[largest_grm_size];
-        float *wbuf = new float[size_grm];
+void GRM::merge_grm(string mgrm_file, string out_file){
+    vector<string> files = read_mgrm_files(mgrm_file, true);
+    if(files.size() < 2){
+        LOGGER.e(0, "not enough valid GRMs to be merged.");
+    }
 
-        vector<uint64_t> start_pos(largest_grm_size);
-        for(int j = 0; j < largest_grm_size; j++){
-            uint64_t byte_start_grm = (1 + j) * j / 2 * sizeof(float);
-            start_pos[j] = byte_start_grm;
-        }
+    vector<vector<string>> ids;
+    vector<string> common_id;
+    common_grm_id(files, ids, common_id);
+    if(common_id.size() == 0){
+        LOGGER.e(0, "no individual is in common among the GRM files.");
+    }
 
-        for(int j = 0; j < size_grm; j++){
-            uint64_t grm_index = p_index[j];
-            uint64_t num_grm = grm_index + 1;
-            uint64_t byte_start_grm = start_pos[grm_index];
-            fseek(h_grm, byte_start_grm, SEEK_SET);
-            if(fread(buf, sizeof(float), num_grm, h_grm) != num_grm){
-                LOGGER.e(0, "error in reading [" + file_name + "], in position " + to_string(ftell(h_grm)), ".");
-            }
-            uint64_t size_write = j + 1;
-            for(int k = 0; k < size_write; k++){
-                uint32_t cur_index = p_index[k];
-                float grm_value;
-                if(cur_index < num_grm){
-                    grm_value = *(buf + cur_index);
-                }else{
-                    //fill the other parts
-                    auto bytes_offset = start_pos[cur_index] + grm_index * sizeof(float);
-                    fseek(h_grm, bytes_offset, SEEK_SET); 
-                    if(fread(&grm_value, sizeof(float), 1, h_grm) != 1){
-                        LOGGER.e(0, "error in reading [" + file_name + "], in position " + to_string(bytes_offset), ".");
-                    }
-                }
-                *(wbuf + k) = grm_value;
-            }
-            //last element
-            //*(wbuf + j) = *(buf + grm_index);
+    string id_file_name = out_file + ".grm.id";
+    std::ofstream o_id(id_file_name.c_str());
+    if(!o_id) LOGGER.e(0, "can't write to [" + id_file_name + "].");
+    std::copy(common_id.begin(), common_id.end(), std::ostream_iterator<string>(o_id, "\n"));
+    o_id.close();
+    LOGGER.i(0, "IDs of the " + to_string(common_id.size()) + " common samples have been saved to [" + id_file_name + "].");
 
-            if(size_write != fwrite(wbuf, sizeof(float), size_write, h_wgrm)){
-                LOGGER.e(0, "error in writing to [" + wfile_name + "], pos: " + std::to_string(ftell(h_wgrm)) + "."); 
-            }
-        }
-        delete[] buf;
-        delete[] wbuf;
-        fclose(h_grm);
-        fclose(h_wgrm);
-        LOGGER.i(0, "GRM has been written to [" + wfile_name + "].");
+    vector<std::unique_ptr<GRMView>> views, views_N;
+    vector<GRMView *> grms, Ns;
+    for(int i = 0; i < files.size(); i++){
+        vector<uint32_t> index1, index2;
+        vector_commonIndex_sorted1(common_id, ids[i], index1, index2);
+        views.emplace_back(new GRMView(files[i] + ".grm.bin", ids[i].size(), true));
+        views_N.emplace_back(new GRMView(files[i] + ".grm.N.bin", ids[i].size(), true));
+        views.back()->setKeep(index2);
+        views_N.back()->setKeep(index2);
+        grms.push_back(views.back().get());
+        Ns.push_back(views_N.back().get());
+    }
+
+    LOGGER.i(0, "Merging " + to_string(files.size()) + " GRMs weighted by the number of SNPs...");
+    stream_grm_arith(grms, Ns, vector<double>(files.size(), 1.0), out_file);
+    LOGGER.i(0, "The merged GRM has been written to [" + out_file + ".grm.bin, .grm.N.bin].");
+}
+
+void GRM::save_compact(string encoding_name, bool bZstd){
+    uint32_t encoding;
+    if(encoding_name == "fp16"){
+        encoding = GRMView::ENC_FP16;
+    }else if(encoding_name == "bf16"){
+        encoding = GRMView::ENC_BF16;
+    }else{
+        encoding = GRMView::ENC_FLOAT;
     }
+    string out_name = options["out"];
+    std::ofstream o_id((out_name + ".grm.id").c_str());
+    if(!o_id) LOGGER.e(0, "can't write to [" + out_name + ".grm.id]");
+    for(auto & index : index_keep){
+        o_id << grm_ids[index] << "\n";
+    }
+    o_id.close();
+    LOGGER.i(2, "Saved " + to_string(index_keep.size()) + " individual IDs to [" + out_name + ".grm.id].");
 
+    LOGGER.i(0, "Saving the GRM in " + encoding_name + (bZstd ? " compressed by zstd" : "") + "...");
+    grm_view->save(out_name + ".grm.bin", encoding, bZstd);
+    LOGGER.i(0, "GRM has been saved to [" + out_name + ".grm.bin].");
+    if(!N_view){
+        LOGGER.w(0, "There is no [" + grm_file + ".grm.N.bin].");
+        return;
+    }
+    float N_value;
+    if(N_view->keptConstant(N_value)){
+        LOGGER.i(0, "The number of SNPs is " + to_string(N_value) + " for all pairs, saved as a constant.");
+        N_view->save(out_name + ".grm.N.bin", GRMView::ENC_CONSTANT);
+    }else{
+        N_view->save(out_name + ".grm.N.bin", encoding, bZstd);
+    }
+    LOGGER.i(0, "Number of SNPs has been saved to [" + out_name + ".grm.N.bin].");
 }
 
 void GRM::prune_fam(float thresh, bool isSparse, float *value){
     LOGGER.i(0, "Pruning the GRM to a sparse matrix with a cutoff of " + to_string(thresh) + "...");
-    LOGGER.i(0, "Total number of parts to be processed: " + to_string(index_grm_pairs.size()));
-    FILE *grmFile = fopen((grm_file + ".grm.bin").c_str(), "rb");
 
     std::ofstream o_id((options["out"] + ".grm.id").c_str());
     if(!o_id) LOGGER.e(0, "can't write to [" + options["out"] + ".grm.id]");
@@ -387,6 +444,7 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
         if(!o_fam) LOGGER.e(0, "can't write to [" + options["out"] + ".grm.sp]");
     }else{
         o_bk = fopen((options["out"] + ".grm.bin").c_str(), "wb");
+        if(!o_bk) LOGGER.e(0, "can't write to [" + options["out"] + ".grm.bin]");
     }
 
     //Save the kept IDs, which may change by --keep and --remove
@@ -401,79 +459,33 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
     keep_ID.clear();
     keep_ID.shrink_to_fit();
 
-
     // Save pair1 par2 GRM
-    std::unordered_set<int> keeps_ori(index_keep.begin(), index_keep.end());
-    float *grm_buf = new float[num_byte_buffer];
-    float cur_grm, *cur_grm_pos0;
+    uint32_t num_keep = index_keep.size();
     vector<float> rm_grm;
     vector<int> rm_grm_ID1, rm_grm_ID2;
-    float *out_grm_buf = new float[num_byte_buffer];
-    float *cur_grm_buf;
-    int new_id1 = 0;
-    for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(grm_buf, sizeof(float), byte_part_grms[part_index], grmFile) != byte_part_grms[part_index]){
-            LOGGER.e(0, "Failed to read GRM between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
-                        + to_string(index_grm_pairs[part_index].second + 1));
-        };
-        if(part_index % 50 == 0){
-            LOGGER.i(2, "Processing part " + to_string(part_index + 1));
-        }
-        cur_grm_pos0 = grm_buf;
-        cur_grm_buf = out_grm_buf;
-
-        for(int id1 = index_grm_pairs[part_index].first; id1 != index_grm_pairs[part_index].second + 1; id1++){
-            if (keeps_ori.find(id1) == keeps_ori.end()) {
-                cur_grm_pos0 += id1 + 1;
-                continue;
-            }
-            int new_id2 = 0;
-            if(value){
-                for(int id2 : index_keep){
-                    if(id2 > id1) break;
-                    cur_grm = *(cur_grm_pos0 + id2);
-                    if(cur_grm > thresh){
-                        rm_grm_ID1.push_back(new_id1);
-                        rm_grm_ID2.push_back(new_id2);
-                        rm_grm.push_back(*value);
-                        *(cur_grm_buf++) = (*value);
-                    }else{
-                        *(cur_grm_buf++) = 0.0;
-                    }
-                    new_id2++;
-                }
- 
+    vector<float> out_grm_buf;
+    for(uint32_t new_id1 = 0; new_id1 != num_keep; new_id1++){
+        uint32_t id1 = index_keep[new_id1];
+        const float *cur_grm_pos0 = grm_view->rawRow(id1);
+        if(!isSparse) out_grm_buf.resize(new_id1 + 1);
+        for(uint32_t new_id2 = 0; new_id2 <= new_id1; new_id2++){
+            float cur_grm = cur_grm_pos0[index_keep[new_id2]];
+            if(cur_grm > thresh){
+                if(value) cur_grm = *value;
+                rm_grm_ID1.push_back(new_id1);
+                rm_grm_ID2.push_back(new_id2);
+                rm_grm.push_back(cur_grm);
             }else{
-                for(int id2 : index_keep){
-                    if(id2 > id1) break;
-                    cur_grm = *(cur_grm_pos0 + id2);
-                    if(cur_grm > thresh){
-                        rm_grm_ID1.push_back(new_id1);
-                        rm_grm_ID2.push_back(new_id2);
-                        rm_grm.push_back(cur_grm);
-                        *(cur_grm_buf++) = cur_grm;
-                    }else{
-                        *(cur_grm_buf++) = 0.0;
-                    }
-                    new_id2++;
-                }
+                cur_grm = 0.0;
             }
-            new_id1++;
-            cur_grm_pos0 += id1 + 1;
+            if(!isSparse) out_grm_buf[new_id2] = cur_grm;
         }
         if(!isSparse){
-            int write_items = cur_grm_buf - out_grm_buf;
-            if(fwrite(out_grm_buf, sizeof(float), write_items, o_bk) != write_items){
+            if(fwrite(out_grm_buf.data(), sizeof(float), new_id1 + 1, o_bk) != new_id1 + 1){
                 LOGGER.e(0, "Failed to write the output"); 
             }
         }
-
-    }
-    delete [] grm_buf;
-    delete [] out_grm_buf;
-    fclose(grmFile);
-    if(!isSparse){
-        fclose(o_bk);
+        grm_view->release(id1, id1);
     }
 
     if(isSparse){
@@ -488,59 +500,40 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
         LOGGER.i(0, "Success:", "finished generating a sparse GRM");
         return;
     }else{
+        fclose(o_bk);
         LOGGER.i(0, "GRM has been saved to [" + options["out"] + ".grm.bin]");
     }
 
-    FILE *NFile = fopen((grm_file + ".grm.N.bin").c_str(), "rb");
-    FILE *ONFile = fopen((options["out"] + ".grm.N.bin").c_str(), "wb");
-    float *N_buf = new float[num_byte_buffer];
-    float *cur_N_pos0;
-    float *out_N_buf = new float[num_byte_buffer];
-    float *cur_N_buf;
-    for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(N_buf, sizeof(float), byte_part_grms[part_index], NFile) != byte_part_grms[part_index]){
-            LOGGER.w(0, "Reading GRM N failed between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
-                        + to_string(index_grm_pairs[part_index].second + 1));
-            LOGGER.i(0, "Stop pruning the GRM N");
-            break;
-        };
-        if(part_index % 50 == 0){
-            LOGGER.i(2, "Processing part " + to_string(part_index + 1));
-        }
-        cur_N_pos0 = N_buf;
-        cur_N_buf = out_N_buf;
-
-        for(int id1 = index_grm_pairs[part_index].first; id1 != index_grm_pairs[part_index].second + 1; id1++){
-            if (keeps_ori.find(id1) == keeps_ori.end()) {
-                cur_N_pos0 += id1 + 1;
-                continue;
-            }
-            for(int id2 : index_keep){
-                if(id2 > id1) break;
-                *(cur_N_buf++) = *(cur_N_pos0 + id2);
-            }
-            cur_N_pos0 += id1 + 1;
-        }
-
-        int write_items = cur_N_buf - out_N_buf;
-        if(fwrite(out_N_buf, sizeof(float), write_items, ONFile) != write_items){
-            LOGGER.e(0, "Failed to write the GRM N"); 
-        }
-
+    if(!N_view){
+        LOGGER.w(0, "There is no [" + grm_file + ".grm.N.bin], stop pruning the GRM N");
+        return;
     }
-    delete [] out_N_buf;
-    delete [] N_buf;
-    fclose(ONFile);
-    fclose(NFile);
+    N_view->save(options["out"] + ".grm.N.bin");
     LOGGER.i(0, "GRM N has been saved to [" + options["out"] + ".grm.N.bin]");
 }
 
 
 
+// copy from GCTA 1.26: the sample of each related pair with more related pairs is removed, the first one (id1) on
+//   ties; the pairs of each sample are counted in one pass. Return the removed samples in ascending order.
+vector<int> GRM::cut_rel_remove(const vector<int> &id1, const vector<int> &id2){
+    std::unordered_map<int, int> rm_count;
+    for(uint64_t k = 0; k < id1.size(); k++){
+        rm_count[id1[k]]++;
+        rm_count[id2[k]]++;
+    }
+    vector<int> removed;
+    removed.reserve(id1.size());
+    for(uint64_t k = 0; k < id1.size(); k++){
+        removed.push_back(rm_count[id1[k]] < rm_count[id2[k]] ? id2[k] : id1[k]);
+    }
+    std::sort(removed.begin(), removed.end());
+    removed.erase(std::unique(removed.begin(), removed.end()), removed.end());
+    return removed;
+}
+
 void GRM::cut_rel(float thresh, bool no_grm){
     LOGGER.i(0, "Pruning the GRM with a cutoff of " + to_string(thresh) + "...");
-    LOGGER.i(0, "Total number of parts to be processed: " + to_string(index_grm_pairs.size()));
-    FILE *grmFile = fopen((grm_file + ".grm.bin").c_str(), "rb");
     // put this first to avoid unwritable disk
     std::ofstream o_keep;
     if(!no_grm){
@@ -562,39 +555,46 @@ void GRM::cut_rel(float thresh, bool no_grm){
     }
  
 
-    std::unordered_set<int> keeps_ori(index_keep.begin(), index_keep.end());
-
-    float *grm_buf = new float[num_byte_buffer];
-    float cur_grm, *cur_grm_pos0;
-    vector<float> rm_grm;
-    vector<int> rm_grm_ID1, rm_grm_ID2;
-    for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(grm_buf, sizeof(float), byte_part_grms[part_index], grmFile) != byte_part_grms[part_index]){
-            LOGGER.e(0, "Failed to read GRM between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
-                        + to_string(index_grm_pairs[part_index].second + 1));
-        };
-        if(part_index % 50 == 0){
-            LOGGER.i(2, "Processing part " + to_string(part_index + 1));
-        }
-        cur_grm_pos0 = grm_buf;
-        for(int id1 = index_grm_pairs[part_index].first; id1 != index_grm_pairs[part_index].second + 1; id1++){
-            if (keeps_ori.find(id1) == keeps_ori.end()) {
-                cur_grm_pos0 += id1 + 1;
-                continue;
-            }
-            for(int id2 : index_keep){
-                if(id2 >= id1) break;
-                cur_grm = *(cur_grm_pos0 + id2);
+    // row ranges of equal numbers of pairs in the lower triangle as index_grm_pairs, more ranges than
+    //   threads to balance the pushed pairs; the pairs are merged in the order of rows
+    uint32_t num_keep = index_keep.size();
+    int num_thread = omp_get_max_threads();
+    vector<uint32_t> parts = divide_parts(0, num_keep == 0 ? 0 : num_keep - 1, 4 * num_thread);
+    vector<pair<uint32_t, uint32_t>> row_pairs;
+    row_pairs.reserve(parts.size());
+    row_pairs.push_back(std::make_pair(0, parts[0]));
+    for(int index = 1; index < parts.size(); index++){
+        row_pairs.push_back(std::make_pair(parts[index - 1] + 1, parts[index]));
+    }
+    int num_parts = row_pairs.size();
+    vector<vector<float>> t_rm_grm(num_parts);
+    vector<vector<int>> t_rm_grm_ID1(num_parts), t_rm_grm_ID2(num_parts);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int part_index = 0; part_index < num_parts; part_index++){
+        uint32_t row_from = row_pairs[part_index].first;
+        uint32_t row_to = row_pairs[part_index].second;
+        for(uint32_t i = row_from; i <= row_to && i < num_keep; i++){
+            uint32_t id1 = index_keep[i];
+            const float *cur_grm_pos0 = grm_view->rawRow(id1);
+            for(uint32_t j = 0; j < i; j++){
+                int id2 = index_keep[j];
+                float cur_grm = cur_grm_pos0[id2];
                 if(cur_grm > thresh){
-                    rm_grm_ID1.push_back(id1);
-                    rm_grm_ID2.push_back(id2);
-                    rm_grm.push_back(cur_grm);
+                    // the larger index first as in the scan of GRM rows
+                    t_rm_grm_ID1[part_index].push_back(std::max<int>(id1, id2));
+                    t_rm_grm_ID2[part_index].push_back(std::min<int>(id1, id2));
+                    t_rm_grm[part_index].push_back(cur_grm);
                 }
             }
-            cur_grm_pos0 += id1 + 1;
         }
     }
-    delete [] grm_buf;
+    vector<float> rm_grm;
+    vector<int> rm_grm_ID1, rm_grm_ID2;
+    for(int part_index = 0; part_index < num_parts; part_index++){
+        rm_grm.insert(rm_grm.end(), t_rm_grm[part_index].begin(), t_rm_grm[part_index].end());
+        rm_grm_ID1.insert(rm_grm_ID1.end(), t_rm_grm_ID1[part_index].begin(), t_rm_grm_ID1[part_index].end());
+        rm_grm_ID2.insert(rm_grm_ID2.end(), t_rm_grm_ID2[part_index].begin(), t_rm_grm_ID2[part_index].end());
+    }
 
     if(detail_flag){
         for(int index = 0; index != rm_grm.size(); index++){
@@ -604,38 +604,13 @@ void GRM::cut_rel(float thresh, bool no_grm){
         LOGGER.i(0, "Related family pairs have been saved to " + options["out"] + ".family.txt");
     }
 
-    int i_buf;
-    // copy from GCTA 1.26
-    vector<int> rm_uni_ID(rm_grm_ID1);
-    rm_uni_ID.insert(rm_uni_ID.end(), rm_grm_ID2.begin(), rm_grm_ID2.end());
-    stable_sort(rm_uni_ID.begin(), rm_uni_ID.end());
-    rm_uni_ID.erase(unique(rm_uni_ID.begin(), rm_uni_ID.end()), rm_uni_ID.end());
-    std::map<int, int> rm_uni_ID_count;
-    for (int i = 0; i < rm_uni_ID.size(); i++) {
-        i_buf = count(rm_grm_ID1.begin(), rm_grm_ID1.end(), rm_uni_ID[i]) + count(rm_grm_ID2.begin(), rm_grm_ID2.end(), rm_uni_ID[i]);
-        rm_uni_ID_count.insert(std::pair<int, int>(rm_uni_ID[i], i_buf));
-    }
-
-    // swapping
-    std::map<int, int>::iterator iter1, iter2;
-    for (int i = 0; i < rm_grm_ID1.size(); i++) {
-        iter1 = rm_uni_ID_count.find(rm_grm_ID1[i]);
-        iter2 = rm_uni_ID_count.find(rm_grm_ID2[i]);
-        if (iter1->second < iter2->second) {
-            i_buf = rm_grm_ID1[i];
-            rm_grm_ID1[i] = rm_grm_ID2[i];
-            rm_grm_ID2[i] = i_buf;
-        }
-    }
-
-    stable_sort(rm_grm_ID1.begin(), rm_grm_ID1.end());
-    rm_grm_ID1.erase(unique(rm_grm_ID1.begin(), rm_grm_ID1.end()), rm_grm_ID1.end());
+    vector<int> rm_ID = cut_rel_remove(rm_grm_ID1, rm_grm_ID2);
     vector<string> removed_ID;
-    removed_ID.reserve(rm_grm_ID1.size());
-    for (auto &index : rm_grm_ID1) removed_ID.push_back(grm_ids[index]);
+    removed_ID.reserve(rm_ID.size());
+    for (auto &index : rm_ID) removed_ID.push_back(grm_ids[index]);
 
-    auto diff = [&rm_grm_ID1](int value) ->bool{
-        return std::binary_search(rm_grm_ID1.begin(), rm_grm_ID1.end(), value);
+    auto diff = [&rm_ID](int value) ->bool{
+        return std::binary_search(rm_ID.begin(), rm_ID.end(), value);
     };
     index_keep.erase(std::remove_if(index_keep.begin(), index_keep.end(), diff), index_keep.end());
 
@@ -659,74 +634,24 @@ void GRM::cut_rel(float thresh, bool no_grm){
     }
 
     if(no_grm) {
-        fclose(grmFile);
         return;
     }
 
-    LOGGER.i(0, "Pruning GRM values, total parts " + std::to_string(index_grm_pairs.size()));
-    FILE *grm_out_file = fopen((options["out"] + ".grm.bin").c_str(), "wb");
-    if(!grm_out_file){
-        LOGGER.e(0, "can't open [" + options["out"] + ".grm.bin] to write");
-    }
-    fseek(grmFile, 0, SEEK_SET);
-    outBinFile(grmFile, grm_out_file);
-    fclose(grmFile);
-    fclose(grm_out_file);
+    LOGGER.i(0, "Pruning GRM values...");
+    grm_view->setKeep(index_keep);
+    grm_view->save(options["out"] + ".grm.bin");
     LOGGER.i(2, "GRM values have been saved to [" + options["out"] + ".grm.bin]");
 
-    LOGGER.i(0, "Pruning number of SNPs to calculate GRM, total parts " + std::to_string(index_grm_pairs.size()));
-    FILE *NFile = fopen((grm_file + ".grm.N.bin").c_str(), "rb");
-    if(!NFile){
+    if(!N_view){
         LOGGER.w(2, "There is no [" + grm_file + ".grm.N.bin]");
         return;
     }
-    FILE *N_out_file = fopen((options["out"] + ".grm.N.bin").c_str(), "wb");
-    if(!N_out_file){
-        LOGGER.w(2, "can't open [" + options["out"] + ".grm.N.bin] to write. Ignore this step");
-        fclose(NFile);
-        return;
-    }
-    outBinFile(NFile, N_out_file);
-    fclose(NFile);
-    fclose(N_out_file);
+    LOGGER.i(0, "Pruning number of SNPs to calculate GRM...");
+    N_view->setKeep(index_keep);
+    N_view->save(options["out"] + ".grm.N.bin");
     LOGGER.i(2, "Number of SNPs has been saved to [" + options["out"] + ".grm.N.bin]");
 }
 
-void GRM::outBinFile(FILE *sFile, FILE *dFile) {
-    std::unordered_set<int> keeps(index_keep.begin(), index_keep.end());
-    float *grm_buf = new float[num_byte_buffer];
-    float *grm_out_buffer = new float[num_byte_buffer];
-    float *cur_grm_pos, *cur_out_pos;
-    for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(grm_buf, sizeof(float), byte_part_grms[part_index], sFile) != byte_part_grms[part_index]){
-            LOGGER.e(0, "Failed to read GRM between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
-                        + to_string(index_grm_pairs[part_index].second + 1));
-        };
-        if(part_index % 50 == 0){
-            LOGGER.i(2, "Processing part " + to_string(part_index + 1));
-        }
-        cur_grm_pos = grm_buf;
-        cur_out_pos = grm_out_buffer;
-        for(int id1 = index_grm_pairs[part_index].first; id1 != index_grm_pairs[part_index].second + 1; id1++) {
-            if (keeps.find(id1) == keeps.end()) {
-                cur_grm_pos += id1 + 1;
-                continue;
-            }
-            for (int id2 : index_keep) {
-                if(id2 > id1) break;
-                *(cur_out_pos++) = *(cur_grm_pos + id2);
-            }
-            cur_grm_pos += id1 + 1;
-        }
-        uint64_t size_write = cur_out_pos - grm_out_buffer;
-        if(fwrite(grm_out_buffer, sizeof(float), size_write, dFile) != size_write){
-            LOGGER.e(0, "Failed to write the output file, please check the disk condition or permission");
-        };
-    }
-    delete [] grm_buf;
-    delete [] grm_out_buffer;
-}
-
 
 GRM::GRM(Pheno* pheno, Marker* marker) {
     //clock_t begin = t_begin();
@@ -738,6 +663,23 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
     this->part = std::stoi(options["cur_part"]);
     this->num_parts = std::stoi(options["num_parts"]);
 
+    if(options_b.find("isMtd") != options_b.end()){
+        isMtd = options_b["isMtd"];
+    }
+
+    // the dense GRM is never held in memory for the direct sparse GRM
+    if(options_b.find("directSparse") != options_b.end() && options_b["directSparse"]){
+        bDirectSparse = true;
+        num_individual = pheno->count_keep();
+        part_keep_indices = std::make_pair(0, num_individual - 1);
+        sub_miss = new uint32_t[num_individual + 64]();
+        LOGGER.i(0, "Computing the sparse genetic relationship matrix (GRM) directly from the genotypes...");
+        LOGGER.i(1, to_string(num_individual) + " samples, " + to_string(marker->count_extract()) + " markers");
+        o_name = options["out"];
+        output_id();
+        return;
+    }
+
     // divide the genotype into equal length
     vector<uint32_t> parts;
     if(options.find("use_blas") != options.end()){
@@ -763,6 +705,33 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         }
     }
 
+    // new samples are appended to an existing GRM: the samples of the existing GRM shall be the first ones
+    // in the genotype data in the same order, then only the rows of the new samples are computed
+    if(options.find("grm_append") != options.end()){
+        if(!geno->getHasPreAF()){
+            LOGGER.e(0, "--grm-append requires the allele frequencies used for the existing GRM by --update-freq.");
+        }
+        // with the fixed frequencies the SNPs kept depend on the SNPs only, the missingness and INFO filters would
+        //   be computed on the enlarged samples and give SNPs (and N) different from the existing GRM
+        if(geno->getFilterMiss() > 0 || geno->getFilterInfo() > 0){
+            LOGGER.e(0, "--grm-append can't be used with --geno or --info, as the SNPs filtered in all the samples may differ "
+                    "from those of the existing GRM. Extract the SNPs of the existing GRM by --extract instead.");
+        }
+        string old_id_file = options["grm_append"] + ".grm.id";
+        vector<string> old_ids = Pheno::read_sublist(old_id_file);
+        uint32_t num_old = old_ids.size();
+        uint32_t num_keep = pheno->count_keep();
+        if(num_old >= num_keep){
+            LOGGER.e(0, "no new sample to append to the GRM [" + options["grm_append"] + "].");
+        }
+        if(pheno->get_id(0, num_old - 1) != old_ids){
+            LOGGER.e(0, "the samples in [" + old_id_file + "] shall be the first samples in the genotype data in the same order.");
+        }
+        part_keep_indices = std::make_pair(num_old, num_keep - 1);
+        bAppend = true;
+        LOGGER.i(0, "Appending " + to_string(num_keep - num_old) + " new samples to the GRM of " + to_string(num_old) + " samples in [" + options["grm_append"] + "].");
+    }
+
     // init the geno buffers
     /*
     if(!bBLAS){
@@ -805,19 +774,18 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         fill_grm = (uint64_t)num_individual * (part_keep_indices.second + 1);
     }
 
-    int ret_grm = posix_memalign((void **)&grm, 32, fill_grm * sizeof(double));
-    if(ret_grm){
-        LOGGER.e(0, "can't allocate enough memory to store the (parted) GRM: " + to_string(fill_grm*sizeof(double) / 1024.0/1024/1024) + "GB required.");
-    }
-    memset(grm, 0, fill_grm * sizeof(double));
-
-    int ret_N = posix_memalign((void **)&N, 32, fill_N * sizeof(uint32_t));
-    if(ret_N){
-        LOGGER.e(0, "can't allocate enough memory to store (parted) N: " + to_string(fill_grm*sizeof(uint32_t) / 1024.0/1024/1024) + "GB required.");
+    if(options_b.find("isDominance") != options_b.end()){
+        isDominance = options_b["isDominance"];
     }
-    memset(N, 0, fill_N * sizeof(uint32_t));
 
-    sub_miss = new uint32_t[index_keep.size() + 64]();
+    init_groups();
+    // one more accumulator to hold the sum of all chromosomes
+    uint32_t num_accum = num_group + (bLOCO ? 1 : 0);
+    grm_stride = fill_grm;
+    N_stride = fill_N;
+    miss_stride = index_keep.size() + 64;
+    group_valid_markers.assign(num_accum, 0);
+    group_sum_sd.assign(num_accum, 0.0);
 
     //calculate each index in pair thread;
     int num_thread = omp_get_max_threads();
@@ -832,14 +800,44 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         index_grm_pairs.push_back(std::make_pair(thread_parts[index - 1] + 1, thread_parts[index]));
     }
 
-    if(options_b.find("isDominance") != options_b.end()){
-        isDominance = options_b["isDominance"];
+    // all the accumulators are held together, check it before the allocation rather than be killed in the middle
+    if(num_accum > 1){
+        double mem_GB = (fill_grm * sizeof(double) + fill_N * sizeof(uint32_t) + miss_stride * sizeof(uint32_t))
+            * num_accum / 1024.0/1024/1024;
+        double avail_GB = getMemAvailKB() / 1024.0/1024;
+        LOGGER.i(0, to_string(num_accum) + " GRMs are held in memory together, " + to_string(mem_GB) + "GB required.");
+        if(avail_GB > 0 && mem_GB > avail_GB){
+            LOGGER.e(0, "not enough memory to hold the " + to_string(num_accum) + " GRMs: " + to_string(mem_GB) + "GB required, "
+                    + to_string(avail_GB) + "GB available.");
+        }
     }
 
-    if(options_b.find("isMtd") != options_b.end()){
-        isMtd = options_b["isMtd"];
+    // the accumulators are zeroed by the threads that later work on them (first touch), so that
+    // the pages are spread over the NUMA nodes instead of the node of the allocating thread
+    int ret_grm = posix_memalign((void **)&grm, 32, fill_grm * num_accum * sizeof(double));
+    if(ret_grm){
+        LOGGER.e(0, "can't allocate enough memory to store the (parted) GRM: " + to_string(fill_grm * num_accum * sizeof(double) / 1024.0/1024/1024) + "GB required.");
+    }
+    first_touch_zero(grm, fill_grm * num_accum * sizeof(double));
+
+    int ret_N = posix_memalign((void **)&N, 32, fill_N * num_accum * sizeof(uint32_t));
+    if(ret_N){
+        LOGGER.e(0, "can't allocate enough memory to store (parted) N: " + to_string(fill_N * num_accum * sizeof(uint32_t) / 1024.0/1024/1024) + "GB required.");
+    }
+    // N rows of index_grm_pairs[index] are counted by thread index in N_thread
+    for(uint32_t accum = 0; accum < num_accum; accum++){
+        #pragma omp parallel for
+        for(int index = 0; index < index_grm_pairs.size(); index++){
+            uint64_t row_from = index_grm_pairs[index].first, row_to = index_grm_pairs[index].second;
+            uint64_t start = (row_from + 1 + part_keep_indices.first) * (row_from - part_keep_indices.first) / 2;
+            uint64_t end = (row_to + 2 + part_keep_indices.first) * (row_to + 1 - part_keep_indices.first) / 2;
+            memset(N + accum * N_stride + start, 0, (end - start) * sizeof(uint32_t));
+        }
+        memset(N + accum * N_stride + num_grm, 0, (fill_N - num_grm) * sizeof(uint32_t));
     }
 
+    sub_miss = new uint32_t[miss_stride * num_accum]();
+
     //t_print(begin, "  INIT finished");
 
     string fstring = bBLAS ? " v2 " : " ";
@@ -854,6 +852,30 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         o_name += ".d";
     }
 
+    // accumulators of a GRM of the same samples from other SNPs
+    if(options.find("acc_prefix") != options.end()){
+        string acc_prefix = options["acc_prefix"];
+        acc_file.reset(new MappedFile(acc_prefix + ".grm.acc", true));
+        uint64_t num_sample = index_keep.size();
+        GRMAccHeader acc_head;
+        if(acc_file->size() < sizeof(GRMAccHeader)){
+            LOGGER.e(0, "[" + acc_file->name() + "] is not a GRM accumulator file.");
+        }
+        memcpy(&acc_head, acc_file->data(), sizeof(GRMAccHeader));
+        if(memcmp(acc_head.magic, "GACC", 4) != 0 || acc_head.version != 1){
+            LOGGER.e(0, "[" + acc_file->name() + "] is not a GRM accumulator file.");
+        }
+        if(acc_head.num_indi != num_sample || acc_file->size() != sizeof(GRMAccHeader) + num_sample * (num_sample + 1) / 2 * (sizeof(double) + sizeof(uint32_t))){
+            LOGGER.e(0, "the size of [" + acc_file->name() + "] does not match the " + to_string(num_sample) + " samples.");
+        }
+        if((bool)acc_head.isDominance != isDominance){
+            LOGGER.e(0, "[" + acc_file->name() + "] is " + (acc_head.isDominance ? "" : "not ") + "of a dominance GRM.");
+        }
+        if(pheno->get_id(0, num_sample - 1) != Pheno::read_sublist(acc_prefix + ".grm.id")){
+            LOGGER.e(0, "the samples shall be the same and in the same order as [" + acc_prefix + ".grm.id].");
+        }
+    }
+
     output_id();
 
 #ifndef NDEBUG
@@ -863,10 +885,81 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
 }
 
 
+// marker groups accumulated in one sweep: MAF/LD bins of --grm-bins or chromosomes for --make-grm-loco
+void GRM::init_groups(){
+    if(options.find("grm_bins_file") != options.end()){
+        string bin_file = options["grm_bins_file"];
+        std::ifstream h_bin(bin_file.c_str());
+        if(!h_bin){
+            LOGGER.e(0, "can't open [" + bin_file + "] to read.");
+        }
+        LOGGER.i(0, "Reading the bins of SNPs from [" + bin_file + "]...");
+        vector<string> snps;
+        vector<int32_t> snp_bins;
+        std::map<string, int32_t> bin_index;
+        string line;
+        while(std::getline(h_bin, line)){
+            vector<string> line_elements;
+            boost::trim(line);
+            if(line.empty()) continue;
+            boost::split(line_elements, line, boost::is_any_of("\t "), boost::token_compress_on);
+            if(line_elements.size() < 2){
+                LOGGER.e(0, "each line of [" + bin_file + "] shall contain the SNP and its bin: " + line);
+            }
+            auto it = bin_index.find(line_elements[1]);
+            if(it == bin_index.end()){
+                it = bin_index.insert(std::make_pair(line_elements[1], (int32_t)group_names.size())).first;
+                group_names.push_back(line_elements[1]);
+            }
+            snps.push_back(line_elements[0]);
+            snp_bins.push_back(it->second);
+        }
+        h_bin.close();
+
+        vector<uint32_t> extract_index, list_index;
+        marker->matchExtractName(snps, extract_index, list_index);
+        marker_group.assign(marker->count_extract(), -1);
+        for(int i = 0; i < extract_index.size(); i++){
+            marker_group[extract_index[i]] = snp_bins[list_index[i]];
+        }
+        num_group = group_names.size();
+        if(num_group == 0){
+            LOGGER.e(0, "no bin in [" + bin_file + "].");
+        }
+        LOGGER.i(0, to_string(extract_index.size()) + " SNPs in " + to_string(num_group) + " bins are included, one GRM is computed for each bin in one pass.");
+        return;
+    }
+
+    if(options_b.find("grm_loco") == options_b.end() || !options_b["grm_loco"]){
+        return;
+    }
+    bLOCO = true;
+    marker_group.assign(marker->count_extract(), -1);
+    std::map<uint8_t, int32_t> chr_groups;
+    for(auto index : marker->get_extract_index_autosome()){
+        uint8_t cur_chr = marker->getChrExtract(index);
+        auto it = chr_groups.find(cur_chr);
+        if(it == chr_groups.end()){
+            it = chr_groups.insert(std::make_pair(cur_chr, (int32_t)group_names.size())).first;
+            group_names.push_back(to_string(cur_chr));
+        }
+        marker_group[index] = it->second;
+    }
+    num_group = group_names.size();
+    if(num_group < 2){
+        LOGGER.e(0, "--make-grm-loco requires markers on at least 2 chromosomes.");
+    }
+    LOGGER.i(0, "The leave-one-chromosome-out GRMs of " + to_string(num_group) + " chromosomes are computed in one pass.");
+}
+
 void GRM::output_id() {
-    vector<string> out_id = pheno->get_id(part_keep_indices.first, part_keep_indices.second);
+    output_id(o_name);
+}
 
-    string o_grm_id = o_name + ".grm.id";
+void GRM::output_id(const string &out_name) {
+    vector<string> out_id = pheno->get_id(bAppend ? 0 : part_keep_indices.first, part_keep_indices.second);
+
+    string o_grm_id = out_name + ".grm.id";
     std::ofstream grm_id(o_grm_id.c_str());
 
     if (!grm_id) { LOGGER.e(0, "cannot open the file [" + o_grm_id + "] to write"); }
@@ -933,11 +1026,8 @@ uint32_t popcounts(uint64_t dw){
 void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex){
     int num_marker = markerIndex.size();
 
-    static int m = part_keep_indices.second - part_keep_indices.first + 1;
-    static int n = part_keep_indices.second + 1;
-    static int n_sample = n;
-    static int s_n = n - m;
-    static int bytesStdGeno = sizeof(double) * n_sample;
+    int n_sample = part_keep_indices.second + 1;
+    uint64_t bytesStdGeno = sizeof(double) * n_sample;
 
    // GenoBufItem items[num_marker];
  
@@ -956,39 +1046,83 @@ void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex
         }
     }
 
+    // markers of the same group are put together, each group goes to its own GRM
+    vector<int> group_start(num_group + 1, 0);
+    if(marker_group.empty()){
+        group_start[1] = validIndex.size();
+    }else{
+        for(auto index : validIndex){
+            group_start[marker_group[markerIndex[index]] + 1]++;
+        }
+        std::partial_sum(group_start.begin(), group_start.end(), group_start.begin());
+        vector<int> pos(group_start.begin(), group_start.end() - 1);
+        vector<int> groupIndex(validIndex.size());
+        for(auto index : validIndex){
+            groupIndex[pos[marker_group[markerIndex[index]]]++] = index;
+        }
+        validIndex.swap(groupIndex);
+    }
+
     int curNumValidMarkers = validIndex.size();
 
+    #pragma omp parallel for schedule(static)
     for(int i = 0; i < curNumValidMarkers; i++){
         int curIndex = validIndex[i];
         memcpy(stdGeno + i * n_sample, gbufitems[curIndex].geno.data(), bytesStdGeno);
-        sd.push_back(gbufitems[curIndex].sd);
         /*
         if(gbufitems[i].missing[41/64] & (1UL << (41 %64))){
         */
     }
 
+    for(uint32_t group = 0; group < num_group; group++){
+        int cur_num = group_start[group + 1] - group_start[group];
+        if(cur_num == 0) continue;
+        for(int i = group_start[group]; i < group_start[group + 1]; i++){
+            double cur_sd = gbufitems[validIndex[i]].sd;
+            group_sum_sd[group] += isDominance ? cur_sd * cur_sd : cur_sd;
+        }
+        group_valid_markers[group] += cur_num;
+        accumulate_GRM_blas(validIndex, group_start[group], cur_num, group);
+    }
+
+    finished_marker += num_marker;
+
+    numValidMarkers += curNumValidMarkers;
+
+}
+
+// add the markers validIndex[start, start + num), which are in stdGeno from the column start, to the GRM and N of group
+void GRM::accumulate_GRM_blas(const vector<int> &validIndex, int start, int num, uint32_t group){
+    int m = part_keep_indices.second - part_keep_indices.first + 1;
+    int n = part_keep_indices.second + 1;
+    int n_sample = n;
+    int s_n = n - m;
+    double *cur_grm = grm + group * grm_stride;
+    uint32_t *cur_sub_miss = sub_miss + group * miss_stride;
+    double *cur_geno = stdGeno + (uint64_t)start * n_sample;
+
     static char notrans='N', trans='T';
     static double alpha = 1.0, beta = 1.0;
     static char uplo='L';
    // A * At 
     if(part_keep_indices.first == 0){
 #if GCTA_CPU_x86
-        dsyrk(&uplo, &notrans, &n, &curNumValidMarkers, &alpha, stdGeno, &n_sample, &beta, grm, &m);
+        dsyrk(&uplo, &notrans, &n, &num, &alpha, cur_geno, &n_sample, &beta, cur_grm, &m);
 #else
-        dsyrk_(&uplo, &notrans, &n, &curNumValidMarkers, &alpha, stdGeno, &n_sample, &beta, grm, &m);
+        dsyrk_(&uplo, &notrans, &n, &num, &alpha, cur_geno, &n_sample, &beta, cur_grm, &m);
 #endif
     }else{
         //dgemm(&notrans, &trans, &m, &n, &num_marker, &alpha, stdGeno + part_keep_indices.first, &n_sample, stdGeno, &n_sample, &beta, grm, &m);
 #if GCTA_CPU_x86
-        dgemm(&notrans, &trans, &m, &s_n, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, stdGeno, &n_sample, &beta, grm, &m);
+        dgemm(&notrans, &trans, &m, &s_n, &num, &alpha, cur_geno + part_keep_indices.first, &n_sample, cur_geno, &n_sample, &beta, cur_grm, &m);
 #else
-        dgemm_(&notrans, &trans, &m, &s_n, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, stdGeno, &n_sample, &beta, grm, &m);
+        dgemm_(&notrans, &trans, &m, &s_n, &num, &alpha, cur_geno + part_keep_indices.first, &n_sample, cur_geno, &n_sample, &beta, cur_grm, &m);
 #endif
-        double * grm_start = grm + ((uint64_t)s_n) * m;
+        double * grm_start = cur_grm + ((uint64_t)s_n) * m;
 #if GCTA_CPU_x86
-        dsyrk(&uplo, &notrans, &m, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, &beta, grm_start, &m); 
+        dsyrk(&uplo, &notrans, &m, &num, &alpha, cur_geno + part_keep_indices.first, &n_sample, &beta, grm_start, &m); 
 #else
-        dsyrk_(&uplo, &notrans, &m, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, &beta, grm_start, &m); 
+        dsyrk_(&uplo, &notrans, &m, &num, &alpha, cur_geno + part_keep_indices.first, &n_sample, &beta, grm_start, &m); 
 #endif
     }
 
@@ -996,21 +1130,21 @@ void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex
 
     //LOGGER << "count N" << std::endl;
     const int markerPerN = sizeof(uintptr_t) * CHAR_BIT;
-    int numNblock = (curNumValidMarkers + markerPerN - 1) / markerPerN;
-    static int numNSampleBlock = (n + markerPerN - 1) / markerPerN;
+    int numNblock = (num + markerPerN - 1) / markerPerN;
+    int numNSampleBlock = (n + markerPerN - 1) / markerPerN;
     //LOGGER << "marker block: " << numNblock << ", sample block:" << numNSampleBlock << ", MarkerPerN: " << markerPerN << std::endl;
     //LOGGER << ", n: " << n << std::endl;
     uintptr_t *sample_miss = new uintptr_t[numNSampleBlock * markerPerN]; // don't need to set to 0
     for(int i = 0; i < numNblock; i++){
         int lastIndex = markerPerN * (i + 1);
-        int lastValidIndex = lastIndex > curNumValidMarkers ? curNumValidMarkers : lastIndex;
+        int lastValidIndex = lastIndex > num ? num : lastIndex;
 
         int baseMarkerIndex = markerPerN * i;
         #pragma omp parallel for
         for(int j = 0; j < numNSampleBlock; j++){
             int baseMissIndex = j * markerPerN;
             for(int k = baseMarkerIndex; k < lastValidIndex; k++){
-                int curMarkerIndex = validIndex[k];
+                int curMarkerIndex = validIndex[start + k];
                 sample_miss[baseMissIndex + k - baseMarkerIndex] = revbits(gbufitems[curMarkerIndex].missing[j]);
             }
             for(int k = lastValidIndex; k < lastIndex; k++){
@@ -1020,21 +1154,16 @@ void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex
             flip64(&sample_miss[baseMissIndex]);
 
             for(int k = baseMissIndex; k < baseMissIndex + markerPerN; k++){
-                sub_miss[k] += popcounts(sample_miss[k]); // give sub_miss a little more avoid overflow
+                cur_sub_miss[k] += popcounts(sample_miss[k]); // give sub_miss a little more avoid overflow
             }
         }
         #pragma omp parallel for
         for(int index = 0; index < index_grm_pairs.size(); index++){
             auto index_pair = index_grm_pairs[index];
-            N_thread(index_pair.first, index_pair.second, sample_miss);
+            N_thread(index_pair.first, index_pair.second, sample_miss, group);
         }
     }
     delete[] sample_miss;
-
-    finished_marker += num_marker;
-
-    numValidMarkers += curNumValidMarkers;
-
 }
 
     /*
@@ -1353,8 +1482,140 @@ bool write_GRM(float *grm, float *N, FILE *grm_out, FILE *N_out, uint32_t row_in
 }
 
 
+float GRM::getMtdWeight(){
+    float mtd_weight = 1.0;
+    if(options_b["isMtd"]){
+        float weight = 0;
+        if(!isDominance){
+            for(int i = 0; i < numValidMarkers; i++){
+                //float af = geno->AFA1[i];
+                //float sd = 2.0 * af * (1.0 - af); 
+                weight += sd[i];
+            }
+        }else{
+            for(int i = 0; i < numValidMarkers; i++){
+                //float af = geno->AFA1[i];
+                //float sd = 2.0 * af * (1.0 - af); 
+                weight += sd[i] * sd[i];
+            }
+        }
+        mtd_weight = getMtdWeight(weight, numValidMarkers);
+    }
+    return mtd_weight;
+}
+
+float GRM::getMtdWeight(double sum_sd, uint32_t num_valid){
+    return 1.0 / (sum_sd / num_valid);
+}
+
 void GRM::deduce_GRM(){
     LOGGER.i(0, "The GRM computation is completed.");
+    //Just for test
+#ifndef NDEBUG
+    fclose(o_geno0);
+    fclose(o_mask0);
+#endif
+    if(num_group == 1){
+        deduce_GRM(o_name, 0);
+        return;
+    }
+
+    if(!bLOCO){
+        // one GRM for each bin, listed in [out].mgrm for --mgrm
+        string mgrm_name = o_name + ".mgrm";
+        std::ofstream o_mgrm(mgrm_name.c_str());
+        if(!o_mgrm){
+            LOGGER.e(0, "can't open [" + mgrm_name + "] to write.");
+        }
+        for(uint32_t group = 0; group < num_group; group++){
+            string bin_name = o_name + "." + group_names[group];
+            LOGGER.i(0, "Saving the GRM of bin " + group_names[group] + " (" + to_string(group_valid_markers[group]) + " valid SNPs)...");
+            if(group_valid_markers[group] == 0){
+                LOGGER.w(0, "no valid SNP in bin " + group_names[group] + ".");
+            }
+            output_id(bin_name);
+            deduce_GRM(bin_name, group);
+            o_mgrm << bin_name << std::endl;
+        }
+        o_mgrm.close();
+        LOGGER.i(0, "The list of the GRMs has been saved in the file [" + mgrm_name + "]");
+        return;
+    }
+
+    // the full GRM is the sum over chromosomes, each LOCO GRM is the full one minus a chromosome
+    uint32_t total = num_group;
+    sum_groups(total);
+    LOGGER.i(0, "Saving the GRM of all the " + to_string(num_group) + " chromosomes...");
+    deduce_GRM(o_name, total);
+    for(uint32_t group = 0; group < num_group; group++){
+        string loco_name = o_name + ".loco_chr" + group_names[group];
+        LOGGER.i(0, "Saving the GRM leaving out chromosome " + group_names[group] + "...");
+        output_id(loco_name);
+        deduce_GRM(loco_name, total, group);
+    }
+}
+
+// accumulators of all the groups are added to the group total
+void GRM::sum_groups(uint32_t total){
+    double *total_grm = grm + total * grm_stride;
+    uint32_t *total_N = N + total * N_stride;
+    uint32_t *total_miss = sub_miss + total * miss_stride;
+    for(uint32_t group = 0; group < num_group; group++){
+        const double *cur_grm = grm + group * grm_stride;
+        const uint32_t *cur_N = N + group * N_stride;
+        const uint32_t *cur_miss = sub_miss + group * miss_stride;
+        #pragma omp parallel for
+        for(uint64_t index = 0; index < grm_stride; index++){
+            total_grm[index] += cur_grm[index];
+        }
+        #pragma omp parallel for
+        for(uint64_t index = 0; index < N_stride; index++){
+            total_N[index] += cur_N[index];
+        }
+        for(uint64_t index = 0; index < miss_stride; index++){
+            total_miss[index] += cur_miss[index];
+        }
+        group_valid_markers[total] += group_valid_markers[group];
+        group_sum_sd[total] += group_sum_sd[group];
+    }
+}
+
+// row i of .grm.acc: double sum[i + 1], then uint32_t N[i + 1]; rows are not aligned, thus copied
+void GRM::read_acc_row(uint32_t row, vector<double> &row_grm, vector<uint32_t> &row_N){
+    const char *row_start = acc_file->data() + sizeof(GRMAccHeader) + (uint64_t)row * (row + 1) / 2 * (sizeof(double) + sizeof(uint32_t));
+    row_grm.resize(row + 1);
+    row_N.resize(row + 1);
+    memcpy(row_grm.data(), row_start, sizeof(double) * (row + 1));
+    memcpy(row_N.data(), row_start + sizeof(double) * (row + 1), sizeof(uint32_t) * (row + 1));
+    // each row is read once
+    acc_file->release(row_start - acc_file->data(), (sizeof(double) + sizeof(uint32_t)) * (row + 1));
+}
+
+// copy the whole [in_name] of size bytes to out
+static void copy_file_to(FILE *out, const string &in_name, uint64_t size){
+    FILE *h_in = fopen(in_name.c_str(), "rb");
+    if(!h_in){
+        LOGGER.e(0, "can't read [" + in_name + "].");
+    }
+    fseek(h_in, 0, SEEK_END);
+    if((uint64_t)ftell(h_in) != size){
+        LOGGER.e(0, "the size of [" + in_name + "] does not match its .grm.id file.");
+    }
+    fseek(h_in, 0, SEEK_SET);
+    vector<char> buffer(64 * 1024 * 1024);
+    uint64_t remain = size;
+    while(remain){
+        uint64_t cur_size = std::min(remain, (uint64_t)buffer.size());
+        if(fread(buffer.data(), 1, cur_size, h_in) != cur_size || fwrite(buffer.data(), 1, cur_size, out) != cur_size){
+            LOGGER.e(0, "failed to copy [" + in_name + "].");
+        }
+        remain -= cur_size;
+    }
+    fclose(h_in);
+}
+
+// save the GRM of group, or of group minus sub_group (e.g. all chromosomes minus one)
+void GRM::deduce_GRM(const string &out_name, uint32_t group, int32_t sub_group){
     float thresh = -99;
     bool isSparse = false;
     if(options_d.find("sparse_cutoff") != options_d.end()){
@@ -1364,49 +1625,74 @@ void GRM::deduce_GRM(){
     }else{
         LOGGER.i(0, "Saving GRM...");
     }
-    //Just for test
-#ifndef NDEBUG
-    fclose(o_geno0);
-    fclose(o_mask0);
-#endif
 
     //clock_t begin = t_begin();
     FILE *grm_out, *N_out;
     if(isSparse){
-        string grm_name = o_name + ".grm.sp";
+        string grm_name = out_name + ".grm.sp";
         grm_out = fopen(grm_name.c_str(), "wb");
         N_out = NULL;
         if(!grm_out){
-            LOGGER.e(0, "can't open " + o_name + ".grm.sp to write");
+            LOGGER.e(0, "can't open " + out_name + ".grm.sp to write");
         }
     }else{
-        string grm_name = o_name + ".grm.bin";
-        string N_name = o_name + ".grm.N.bin";
+        string grm_name = out_name + ".grm.bin";
+        string N_name = out_name + ".grm.N.bin";
         grm_out = fopen(grm_name.c_str(), "wb");
         N_out = fopen(N_name.c_str(), "wb");
         if((!grm_out) || (!N_out)){
-            LOGGER.e(0, "can't open " + o_name + ".grm.bin or .grm.N.bin to write");
-        }
-    }
-
-    float mtd_weight = 1.0;
-    if(options_b["isMtd"]){
-        float weight = 0;
-        if(!isDominance){
-            for(int i = 0; i < numValidMarkers; i++){
-                //float af = geno->AFA1[i];
-                //float sd = 2.0 * af * (1.0 - af); 
-                weight += sd[i];
-            }
-        }else{
-            for(int i = 0; i < numValidMarkers; i++){
-                //float af = geno->AFA1[i];
-                //float sd = 2.0 * af * (1.0 - af); 
-                weight += sd[i] * sd[i];
-            }
-        }
-        mtd_weight = 1.0 / (weight / numValidMarkers);
-    }
+            LOGGER.e(0, "can't open " + out_name + ".grm.bin or .grm.N.bin to write");
+        }
+        // the rows of the existing GRM go first, the rows of new samples follow
+        if(bAppend){
+            uint64_t old_size = (uint64_t)part_keep_indices.first * (part_keep_indices.first + 1) / 2 * sizeof(float);
+            copy_file_to(grm_out, options["grm_append"] + ".grm.bin", old_size);
+            copy_file_to(N_out, options["grm_append"] + ".grm.N.bin", old_size);
+        }
+    }
+
+    uint32_t num_valid = group_valid_markers[group];
+    double sum_sd = group_sum_sd[group];
+    if(sub_group >= 0){
+        num_valid -= group_valid_markers[sub_group];
+        sum_sd -= group_sum_sd[sub_group];
+    }
+
+    // the accumulators of --grm-acc-add/--grm-acc-subtract are combined with this run, the sums are saved by --save-grm-acc
+    double acc_sign = 0.0;
+    int64_t total_valid = num_valid;
+    double total_sum_sd = sum_sd;
+    if(acc_file){
+        acc_sign = options_b["acc_subtract"] ? -1.0 : 1.0;
+        const GRMAccHeader *acc_head = (const GRMAccHeader *)acc_file->data();
+        total_valid = (int64_t)acc_head->num_marker + (int64_t)acc_sign * num_valid;
+        total_sum_sd = acc_head->sum_sd + acc_sign * sum_sd;
+        if(total_valid < 0){
+            LOGGER.e(0, "more SNPs are subtracted than those in [" + acc_file->name() + "].");
+        }
+        LOGGER.i(0, to_string(num_valid) + " SNPs are " + (acc_sign > 0 ? "added to " : "subtracted from ") + "the "
+                + to_string(acc_head->num_marker) + " SNPs in [" + acc_file->name() + "], " + to_string(total_valid) + " SNPs in total.");
+    }
+    FILE *acc_out = NULL;
+    vector<double> acc_row_grm, out_row_grm;
+    vector<uint32_t> acc_row_N, out_row_N;
+    if(options_b["save_acc"]){
+        string acc_name = out_name + ".grm.acc";
+        acc_out = fopen(acc_name.c_str(), "wb");
+        if(!acc_out){
+            LOGGER.e(0, "can't open " + acc_name + " to write");
+        }
+        GRMAccHeader acc_head;
+        memset(&acc_head, 0, sizeof(GRMAccHeader));
+        memcpy(acc_head.magic, "GACC", 4);
+        acc_head.version = 1;
+        acc_head.num_indi = index_keep.size();
+        acc_head.num_marker = total_valid;
+        acc_head.sum_sd = total_sum_sd;
+        acc_head.isDominance = isDominance;
+        fwrite(&acc_head, sizeof(GRMAccHeader), 1, acc_out);
+    }
+    float mtd_weight = isMtd ? getMtdWeight(total_sum_sd, total_valid) : 1.0;
 
  
     /* X chr adjustment
@@ -1421,8 +1707,22 @@ void GRM::deduce_GRM(){
     float *w_grm = new float[num_sample];
     float *w_N = new float[num_sample];
 
-    double *po_grm = grm;
-    uint32_t *po_N = N;
+    double *po_grm = grm + group * grm_stride;
+    uint32_t *po_N = N + group * N_stride;
+    const uint32_t *g_miss = sub_miss + group * miss_stride;
+    // zeros are subtracted if there is no sub group
+    const double *po_sgrm = po_grm;
+    const uint32_t *po_sN = po_N;
+    const uint32_t *s_miss = g_miss;
+    double grm_sign = 0.0;
+    uint32_t N_sign = 0;
+    if(sub_group >= 0){
+        po_sgrm = grm + sub_group * grm_stride;
+        po_sN = N + sub_group * N_stride;
+        s_miss = sub_miss + sub_group * miss_stride;
+        grm_sign = 1.0;
+        N_sign = 1;
+    }
 
     uint64_t m = part_keep_indices.second - part_keep_indices.first + 1;
     //LOGGER << "mtd weight: " << mtd_weight << std::endl;
@@ -1437,13 +1737,33 @@ void GRM::deduce_GRM(){
     
     if(bBLAS){
         for(int pair1 = part_keep_indices.first; pair1 != part_keep_indices.second + 1; pair1++){
-            uint32_t sub_miss1 = numValidMarkers - sub_miss[pair1];
+            uint32_t sub_miss1 = num_valid - (g_miss[pair1] - N_sign * s_miss[pair1]);
+            if(acc_file){
+                read_acc_row(pair1, acc_row_grm, acc_row_N);
+            }
+            if(acc_out){
+                out_row_grm.resize(pair1 + 1);
+                out_row_N.resize(pair1 + 1);
+            }
             for(int pair2 = 0; pair2 != pair1 + 1; pair2++){
-                uint32_t sub_N = *(po_N + pair2) + sub_miss1 - sub_miss[pair2];
+                uint32_t sub_N = (*(po_N + pair2) - N_sign * *(po_sN + pair2)) + sub_miss1 - (g_miss[pair2] - N_sign * s_miss[pair2]);
+                uint64_t grm_pos = (uint64_t)pair2 * m;
+                double sub_grm = *(po_grm + grm_pos) - grm_sign * *(po_sgrm + grm_pos);
+                if(acc_file){
+                    sub_grm = acc_row_grm[pair2] + acc_sign * sub_grm;
+                    sub_N = (uint32_t)((int64_t)acc_row_N[pair2] + (int64_t)acc_sign * sub_N);
+                }
+                if(acc_out){
+                    out_row_grm[pair2] = sub_grm;
+                    out_row_N[pair2] = sub_N;
+                }
                 w_N[pair2] = (float)sub_N;
 
                 if(sub_N){
-                    w_grm[pair2] = (float)((*(po_grm + (uint64_t)pair2 * m))/sub_N) * mtd_weight;
+                    w_grm[pair2] = (float)(sub_grm/sub_N) * mtd_weight;
+                    if(!sample_scale.empty()){
+                        w_grm[pair2] *= sample_scale[pair1] * sample_scale[pair2];
+                    }
                 }else{
                     w_grm[pair2] = 0.0;
                 }
@@ -1453,8 +1773,16 @@ void GRM::deduce_GRM(){
             //fwrite(w_grm, sizeof(float), pair1 + 1, grm_out);
             //fwrite(w_N, sizeof(float), pair1 + 1, N_out);
             write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh);
+            if(acc_out){
+                if(fwrite(out_row_grm.data(), sizeof(double), pair1 + 1, acc_out) != pair1 + 1 ||
+                        fwrite(out_row_N.data(), sizeof(uint32_t), pair1 + 1, acc_out) != pair1 + 1){
+                    LOGGER.e(0, "failed to write " + out_name + ".grm.acc");
+                }
+            }
             po_N = po_N + pair1 + 1;
             po_grm = po_grm + 1;
+            po_sN = po_sN + pair1 + 1;
+            po_sgrm = po_sgrm + 1;
         }
     }
     /* // don't need special case
@@ -1507,23 +1835,27 @@ void GRM::deduce_GRM(){
 
     if(grm_out)fclose(grm_out);
     if(N_out)fclose(N_out);
+    if(acc_out){
+        fclose(acc_out);
+        LOGGER.i(0, "The accumulators of the GRM have been saved in the file [" + out_name + ".grm.acc]");
+    }
     delete[] w_grm;
     delete[] w_N;
     //t_print(begin, "  GRM deduce finished");
     if(!isSparse){
-        LOGGER.i(0, "GRM has been saved in the file [" + o_name + ".grm.bin]");
-        LOGGER.i(0, "Number of SNPs in each pair of individuals has been saved in the file [" + o_name + ".grm.N.bin]");
+        LOGGER.i(0, "GRM has been saved in the file [" + out_name + ".grm.bin]");
+        LOGGER.i(0, "Number of SNPs in each pair of individuals has been saved in the file [" + out_name + ".grm.N.bin]");
     }else{
-        LOGGER.i(0, "GRM has been saved in the file [" + o_name + ".grm.sp]");
+        LOGGER.i(0, "GRM has been saved in the file [" + out_name + ".grm.sp]");
     }
 
 }
 
 
-void GRM::N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cur_cmask){
+void GRM::N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cur_cmask, uint32_t group){
     uint64_t startPos = ((uint64_t)grm_index_from + 1 + part_keep_indices.first) * (grm_index_from - part_keep_indices.first) / 2;
 
-    uint32_t *po_N_start = N + startPos;
+    uint32_t *po_N_start = N + group * N_stride + startPos;
     //for(int cur_block = 0; cur_block != Constants::NUM_MARKER_READ / num_cmask_block; cur_block++){
     //uint64_t *cur_cmask = cmask_buf + cur_block * index_keep.size();
     uint32_t *po_N = po_N_start;
@@ -1848,6 +2180,171 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
     }
  
 
+    string op_grm_sp_direct = "--make-grm-sparse";
+    options_b["directSparse"] = false;
+    if(options_in.find(op_grm_sp_direct) != options_in.end()){
+        if(options.find("grm_file") != options.end()){
+            LOGGER.e(0, op_grm_sp_direct + " computes the sparse GRM from the genotypes, please use --make-bK-sparse to prune an existing GRM.");
+        }
+        if(bool_part_grm || bool_part_grm_d || bool_part_grm_xchr || isDominance){
+            LOGGER.e(0, op_grm_sp_direct + " can't be used together with --make-grm-part, --make-grm-d or --make-grm-xchr.");
+        }
+        if(options_in[op_grm_sp_direct].size() == 1){
+            options_d["sparse_cutoff"] = std::stod(options_in[op_grm_sp_direct][0]);
+        }else if(options_in[op_grm_sp_direct].size() > 1){
+            LOGGER.e(0, op_grm_sp_direct + " can't deal with more than one value.");
+        }else if(options_d.find("sparse_cutoff") == options_d.end()){
+            options_d["sparse_cutoff"] = 0.05;
+        }
+
+        // number of thinned SNPs and KING kinship threshold to prescreen the pairs
+        options_d["prescreen_snps"] = 10000;
+        options_d["prescreen_king"] = options_d["sparse_cutoff"] / 4.0;
+        string op_prescreen = "--sparse-prescreen";
+        if(options_in.find(op_prescreen) != options_in.end()){
+            vector<string> &values = options_in[op_prescreen];
+            if(values.size() < 1 || values.size() > 2){
+                LOGGER.e(0, op_prescreen + " takes the number of SNPs and optionally the KING kinship threshold.");
+            }
+            try{
+                options_d["prescreen_snps"] = std::stoi(values[0]);
+                if(values.size() == 2){
+                    options_d["prescreen_king"] = std::stod(values[1]);
+                }
+            }catch(std::invalid_argument&){
+                LOGGER.e(0, op_prescreen + " can only deal with numeric values.");
+            }
+            if(options_d["prescreen_snps"] < 1){
+                LOGGER.e(0, op_prescreen + ": the number of SNPs should be >= 1.");
+            }
+            options_in.erase(op_prescreen);
+        }
+
+        options_b["directSparse"] = true;
+        processFunctions.push_back("make_grm_sparse");
+        options_in.erase(op_grm_sp_direct);
+
+        std::map<string, vector<string>> t_option;
+        t_option["--autosome"] = {};
+        Marker::registerOption(t_option);
+
+        return_value++;
+    }
+
+    // SNP to bin assignment, one GRM per bin in one pass (e.g. GREML-LDMS)
+    string op_grm_bins = "--grm-bins";
+    if(options_in.find(op_grm_bins) != options_in.end()){
+        if(options_in[op_grm_bins].size() != 1){
+            LOGGER.e(0, op_grm_bins + " takes one file of SNPs and their bins.");
+        }
+        if(options_b["xchr"] || options_b["directSparse"] || options_in.find("--make-grm-loco") != options_in.end()){
+            LOGGER.e(0, op_grm_bins + " can't be used together with --make-grm-xchr, --make-grm-sparse or --make-grm-loco.");
+        }
+        options["grm_bins_file"] = options_in[op_grm_bins][0];
+        options_in.erase(op_grm_bins);
+    }
+
+    // all the leave-one-chromosome-out GRMs along with the full GRM in one pass
+    string op_grm_loco = "--make-grm-loco";
+    options_b["grm_loco"] = false;
+    if(options_in.find(op_grm_loco) != options_in.end()){
+        if(options.find("grm_file") != options.end() || options_b["xchr"] || options_b["directSparse"]){
+            LOGGER.e(0, op_grm_loco + " can't be used together with --grm, --make-grm-xchr or --make-grm-sparse.");
+        }
+        options_b["grm_loco"] = true;
+        if(std::find(processFunctions.begin(), processFunctions.end(), "make_grm") == processFunctions.end()){
+            options_in["--make-grm"] = {};
+        }
+        options_in.erase(op_grm_loco);
+    }
+
+    // unnormalised accumulators (sum of products, N and the number of SNPs) saved with the GRM;
+    // a later run on other SNPs adds them to (or subtracts them from) the saved ones without the original genotypes
+    string op_acc_save = "--save-grm-acc";
+    string op_acc_add = "--grm-acc-add";
+    string op_acc_sub = "--grm-acc-subtract";
+    options_b["save_acc"] = false;
+    options_b["acc_subtract"] = false;
+    bool has_acc_add = options_in.find(op_acc_add) != options_in.end();
+    bool has_acc_sub = options_in.find(op_acc_sub) != options_in.end();
+    if(options_in.find(op_acc_save) != options_in.end() || has_acc_add || has_acc_sub){
+        if(has_acc_add && has_acc_sub){
+            LOGGER.e(0, op_acc_add + " and " + op_acc_sub + " can't be used together.");
+        }
+        if(num_parts != 1 || options_b["xchr"] || options_b["directSparse"] || options_b["grm_loco"] ||
+                options.find("grm_bins_file") != options.end() || options_d.find("sparse_cutoff") != options_d.end() ||
+                options_in.find("--grm-append") != options_in.end()){
+            LOGGER.e(0, "the GRM accumulators can't be used together with --make-grm-part, --make-grm-xchr, --make-grm-sparse, "
+                    "--make-grm-loco, --grm-bins, --sparse-cutoff or --grm-append.");
+        }
+        string op_acc = has_acc_add ? op_acc_add : op_acc_sub;
+        if(has_acc_add || has_acc_sub){
+            if(options_in[op_acc].size() != 1){
+                LOGGER.e(0, op_acc + " takes the prefix of the GRM with its .grm.acc file.");
+            }
+            options["acc_prefix"] = options_in[op_acc][0];
+            options_b["acc_subtract"] = has_acc_sub;
+        }
+        options_b["save_acc"] = true;
+        if(std::find(processFunctions.begin(), processFunctions.end(), "make_grm") == processFunctions.end()){
+            options_in["--make-grm"] = {};
+        }
+        options_in.erase(op_acc_save);
+        options_in.erase(op_acc_add);
+        options_in.erase(op_acc_sub);
+    }
+
+    // the rows of new samples only, appended to an existing GRM of the old samples
+    string op_grm_append = "--grm-append";
+    if(options_in.find(op_grm_append) != options_in.end()){
+        if(options_in[op_grm_append].size() != 1){
+            LOGGER.e(0, op_grm_append + " takes the prefix of the existing GRM.");
+        }
+        if(num_parts != 1 || options_b["xchr"] || options_b["directSparse"] || options_b["grm_loco"] ||
+                options.find("grm_bins_file") != options.end() || options_d.find("sparse_cutoff") != options_d.end()){
+            LOGGER.e(0, op_grm_append + " can't be used together with --make-grm-part, --make-grm-xchr, --make-grm-sparse, "
+                    "--make-grm-loco, --grm-bins or --sparse-cutoff.");
+        }
+        options["grm_append"] = options_in[op_grm_append][0];
+        if(std::find(processFunctions.begin(), processFunctions.end(), "make_grm") == processFunctions.end()){
+            options_in["--make-grm"] = {};
+        }
+        options_in.erase(op_grm_append);
+    }
+
+    // converts --grm-sparse to the binary format; --grm-sparse is kept for the following fastGWA
+    string op_grm_spb = "--make-grm-spb";
+    if(options_in.find(op_grm_spb) != options_in.end()){
+        if(options_in.find("--grm-sparse") == options_in.end() || options_in["--grm-sparse"].size() != 1){
+            LOGGER.e(0, op_grm_spb + " requires one sparse GRM by --grm-sparse.");
+        }
+        options["grm_spb_input"] = options_in["--grm-sparse"][0];
+        processFunctions.push_back("make_grm_spb");
+        options_in.erase(op_grm_spb);
+        return_value++;
+    }
+
+    // --grm converted to half precision, a constant N or zstd tiles
+    string op_grm_compact = "--make-grm-compact";
+    if(options_in.find(op_grm_compact) != options_in.end()){
+        vector<string> &args = options_in[op_grm_compact];
+        if(options.find("grm_file") == options.end()){
+            LOGGER.e(0, op_grm_compact + " requires the GRM by --grm.");
+        }
+        if(options["grm_file"] == options["out"]){
+            LOGGER.e(0, "it is not allowed to have the same file name for the input and the output files.");
+        }
+        if(args.size() < 1 || args.size() > 2 || (args[0] != "fp16" && args[0] != "bf16" && args[0] != "float") ||
+                (args.size() == 2 && args[1] != "zstd")){
+            LOGGER.e(0, op_grm_compact + " takes the encoding (fp16, bf16 or float), optionally followed by zstd.");
+        }
+        options["grm_compact"] = args[0];
+        options_b["grm_compact_zstd"] = args.size() == 2;
+        processFunctions.push_back("make_grm_compact");
+        options_in.erase(op_grm_compact);
+        return_value++;
+    }
+
     string op_grm_unify = "--unify-grm";
     if(options_in.find(op_grm_unify) != options_in.end()){
         processFunctions.push_back("unify_grm");
@@ -1862,6 +2359,13 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
         return_value++;
     }
 
+    // --mgrm --make-grm: the GRMs are merged weighted by the number of SNPs
+    if(options_in.find("--make-grm") != options_in.end() && options.find("mgrm") != options.end()){
+        processFunctions.push_back("merge_grm");
+        options_in.erase("--make-grm");
+        return_value++;
+    }
+
     if(options_in.find("--make-grm") != options_in.end()){
         isDominance = false;
         if(options.find("grm_file") == options.end()){
@@ -1980,6 +2484,7 @@ void GRM::processMakeGRM(){
     if(ret != 0){
         LOGGER.e(0, "can't allocate enough memory for the genotype buffer.");
     }
+    first_touch_zero(stdGeno, num_byte_geno);
     
     vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
     if(options.find("use_blas") != options.end()){
@@ -1992,7 +2497,10 @@ void GRM::processMakeGRM(){
     bool isSTD = true;
     if(isMtd) isSTD = false;
     vector<uint32_t> processIndex = marker->get_extract_index_autosome();
-    sd.reserve(processIndex.size());
+    if(!marker_group.empty()){
+        processIndex.erase(std::remove_if(processIndex.begin(), processIndex.end(), [this](uint32_t index){
+                    return marker_group[index] < 0;}), processIndex.end());
+    }
     LOGGER << "Computing GRM..." << std::endl;
     geno->loopDouble(processIndex, nMarkerBlock, true, true, isSTD, true, callBacks);
     LOGGER << "  Used " << numValidMarkers << " valid SNPs."<< std::endl;
@@ -2018,6 +2526,7 @@ void GRM::processMakeGRMX(){
     if(ret != 0){
         LOGGER.e(0, "can't allocate enough memory for the genotype buffer.");
     }
+    first_touch_zero(stdGeno, num_byte_geno);
     
     vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
     if(options.find("use_blas") != options.end()){
@@ -2027,6 +2536,19 @@ void GRM::processMakeGRMX(){
         LOGGER.e(0, "the original version has been deleted. Please use GCTA >= 1.92.4");
     }
     geno->setGRMMode(true, isDominance);
+    // the male weight (dosage compensation) is applied to the GRM after the SYRK rather than to each SNP in decoding
+    geno->setDeferGRMMaleWeight(true);
+    double male_weight = geno->getGRMMaleWeight();
+    if(std::abs(male_weight - 1.0) > 1e-6){
+        vector<uint64_t> male_mask((pheno->count_keep() + 63) / 64, 0);
+        pheno->getMaskBitMale(male_mask.data());
+        sample_scale.assign(part_keep_indices.second + 1, 1.0);
+        for(uint32_t i = 0; i <= part_keep_indices.second; i++){
+            if((male_mask[i / 64] >> (i % 64)) & 1){
+                sample_scale[i] = male_weight;
+            }
+        }
+    }
     bool isSTD = true;
     if(isMtd) isSTD = false;
     vector<uint32_t> processIndex = marker->get_extract_index_X();
@@ -2038,7 +2560,294 @@ void GRM::processMakeGRMX(){
     delete[] gbufitems;
     posix_mem_free(stdGeno);
     geno->setGRMMode(false, false);
+    geno->setDeferGRMMaleWeight(false);
+    sample_scale.clear();
+
+}
+
+// KING-robust (within-family) kinship, as in plink2 --make-king:
+//   phi = (N_AaAa - 2 * N_IBS0) / (N_Aa(i) + N_Aa(j)), counted over SNPs called in both samples
+void GRM::king_func(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
+
+    #pragma omp parallel for
+    for(int i = 0; i < num_marker; i++){
+        GenoBufItem &item = gbufitems[i];
+        item.extractedMarkerIndex = markerIndex[i];
+        geno->getGenoDouble(buf, i, &item);
+    }
+
+    vector<int> validIndex;
+    validIndex.reserve(num_marker);
+    for(int i = 0; i < num_marker; i++){
+        if(gbufitems[i].valid){
+            validIndex.push_back(i);
+        }
+    }
+    int curNumValidMarkers = validIndex.size();
+
+    #pragma omp parallel for
+    for(uint32_t sample = 0; sample < num_individual; sample++){
+        uint64_t *hom0 = king_hom0 + (uint64_t)sample * num_king_word;
+        uint64_t *het = king_het + (uint64_t)sample * num_king_word;
+        uint64_t *hom2 = king_hom2 + (uint64_t)sample * num_king_word;
+        uint32_t word = sample / 64;
+        uint32_t shift = sample % 64;
+        for(int k = 0; k < curNumValidMarkers; k++){
+            const GenoBufItem &item = gbufitems[validIndex[k]];
+            if((item.missing[word] >> shift) & 1UL) continue;
+            uint32_t bit_index = num_king_marker + k;
+            uint64_t bit = 1ULL << (bit_index % 64);
+            double g = item.geno[sample];
+            if(g < 0.5){
+                hom0[bit_index / 64] |= bit;
+            }else if(g > 1.5){
+                hom2[bit_index / 64] |= bit;
+            }else{
+                het[bit_index / 64] |= bit;
+            }
+        }
+    }
 
+    num_king_marker += curNumValidMarkers;
+}
+
+void GRM::sparse_grm_func(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
+
+    #pragma omp parallel for
+    for(int i = 0; i < num_marker; i++){
+        GenoBufItem &item = gbufitems[i];
+        item.extractedMarkerIndex = markerIndex[i];
+        geno->getGenoDouble(buf, i, &item);
+    }
+
+    vector<int> validIndex;
+    validIndex.reserve(num_marker);
+    for(int i = 0; i < num_marker; i++){
+        if(gbufitems[i].valid){
+            validIndex.push_back(i);
+            sd.push_back(gbufitems[i].sd);
+        }
+    }
+    int curNumValidMarkers = validIndex.size();
+
+    // diagonals of all samples, transpose the candidate samples into stdGeno (sample major)
+    #pragma omp parallel for
+    for(uint32_t sample = 0; sample < num_individual; sample++){
+        uint32_t word = sample / 64;
+        uint32_t shift = sample % 64;
+        int32_t row = cand_row[sample];
+        double *panel = (row >= 0) ? (stdGeno + (uint64_t)row * nMarkerBlock) : NULL;
+        double diag = 0.0;
+        uint32_t miss = 0;
+        uint64_t miss_bits = 0;
+        for(int k = 0; k < curNumValidMarkers; k++){
+            const GenoBufItem &item = gbufitems[validIndex[k]];
+            double g = item.geno[sample];
+            uint64_t bit = (item.missing[word] >> shift) & 1UL;
+            diag += g * g;
+            miss += bit;
+            miss_bits |= bit << k;
+            if(panel) panel[k] = g;
+        }
+        diag_grm[sample] += diag;
+        sub_miss[sample] += miss;
+        if(panel){
+            cand_miss_bits[row] = miss_bits;
+        }
+    }
+
+    int64_t num_pairs = cand_id1.size();
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for(int64_t index = 0; index < num_pairs; index++){
+        int32_t row1 = cand_row[cand_id1[index]];
+        int32_t row2 = cand_row[cand_id2[index]];
+        const double *g1 = stdGeno + (uint64_t)row1 * nMarkerBlock;
+        const double *g2 = stdGeno + (uint64_t)row2 * nMarkerBlock;
+        double sum = 0.0;
+        for(int k = 0; k < curNumValidMarkers; k++){
+            sum += g1[k] * g2[k];
+        }
+        cand_grm[index] += sum;
+        cand_miss[index] += popcounts(cand_miss_bits[row1] & cand_miss_bits[row2]);
+    }
+
+    numValidMarkers += curNumValidMarkers;
+}
+
+void GRM::processMakeSparseGRM(){
+    float thresh = options_d["sparse_cutoff"];
+    double king_thresh = options_d["prescreen_king"];
+    uint32_t num_prescreen = options_d["prescreen_snps"];
+
+    vector<uint32_t> processIndex = marker->get_extract_index_autosome();
+    if(processIndex.size() == 0){
+        LOGGER.e(0, "no SNP on the autosomes to compute the sparse GRM.");
+    }
+
+    // one bit per SNP in each plane, thus the block shall not exceed 64 SNPs
+    nMarkerBlock = 64;
+    gbufitems = new GenoBufItem[nMarkerBlock];
+
+    //step 1: prescreen the pairs with the KING-robust kinship on evenly thinned SNPs
+    vector<uint32_t> kingIndex;
+    if(processIndex.size() <= num_prescreen){
+        kingIndex = processIndex;
+    }else{
+        kingIndex.reserve(num_prescreen);
+        double step = 1.0 * processIndex.size() / num_prescreen;
+        for(uint32_t i = 0; i < num_prescreen; i++){
+            kingIndex.push_back(processIndex[(uint64_t)(i * step)]);
+        }
+    }
+
+    num_king_word = (kingIndex.size() + 63) / 64;
+    uint64_t num_byte_king = sizeof(uint64_t) * num_king_word * num_individual;
+    int ret1 = posix_memalign((void **)&king_hom0, 32, num_byte_king);
+    int ret2 = posix_memalign((void **)&king_het, 32, num_byte_king);
+    int ret3 = posix_memalign((void **)&king_hom2, 32, num_byte_king);
+    if(ret1 != 0 || ret2 != 0 || ret3 != 0){
+        LOGGER.e(0, "can't allocate enough memory for the prescreen buffer: " + to_string(3.0 * num_byte_king / 1024.0/1024/1024) + "GB required.");
+    }
+    memset(king_hom0, 0, num_byte_king);
+    memset(king_het, 0, num_byte_king);
+    memset(king_hom2, 0, num_byte_king);
+
+    double preAF = geno->getMAF();
+    if(preAF < 0.05){
+        geno->setMAF(0.05);
+    }
+    LOGGER.i(0, "Prescreening related pairs by the KING-robust kinship (> " + to_string(king_thresh) + ") on " + to_string(kingIndex.size()) + " thinned SNPs with MAF >= 0.05...");
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(bind(&GRM::king_func, this, _1, _2));
+    geno->loopDouble(kingIndex, nMarkerBlock, true, false, false, true, callBacks);
+    geno->setMAF(preAF);
+    LOGGER << "  Used " << num_king_marker << " valid SNPs." << std::endl;
+    if(num_king_marker == 0){
+        LOGGER.e(0, "no valid SNP to prescreen the related pairs.");
+    }
+
+    int num_thread = omp_get_max_threads();
+    vector<uint32_t> thread_parts = divide_parts(0, num_individual - 1, num_thread * 16);
+    vector<pair<uint32_t, uint32_t>> row_parts;
+    row_parts.push_back(std::make_pair(0, thread_parts[0]));
+    for(int index = 1; index < thread_parts.size(); index++){
+        row_parts.push_back(std::make_pair(thread_parts[index - 1] + 1, thread_parts[index]));
+    }
+
+    vector<vector<uint32_t>> part_id1(row_parts.size()), part_id2(row_parts.size());
+    #pragma omp parallel for schedule(dynamic)
+    for(int index = 0; index < row_parts.size(); index++){
+        for(uint32_t id1 = row_parts[index].first; id1 <= row_parts[index].second; id1++){
+            const uint64_t *hom0_1 = king_hom0 + (uint64_t)id1 * num_king_word;
+            const uint64_t *het_1 = king_het + (uint64_t)id1 * num_king_word;
+            const uint64_t *hom2_1 = king_hom2 + (uint64_t)id1 * num_king_word;
+            for(uint32_t id2 = 0; id2 < id1; id2++){
+                const uint64_t *hom0_2 = king_hom0 + (uint64_t)id2 * num_king_word;
+                const uint64_t *het_2 = king_het + (uint64_t)id2 * num_king_word;
+                const uint64_t *hom2_2 = king_hom2 + (uint64_t)id2 * num_king_word;
+                uint32_t ibs0 = 0, hethet = 0, het1 = 0, het2 = 0;
+                for(uint32_t w = 0; w < num_king_word; w++){
+                    uint64_t valid1 = hom0_1[w] | het_1[w] | hom2_1[w];
+                    uint64_t valid2 = hom0_2[w] | het_2[w] | hom2_2[w];
+                    ibs0 += popcounts((hom0_1[w] & hom2_2[w]) | (hom2_1[w] & hom0_2[w]));
+                    hethet += popcounts(het_1[w] & het_2[w]);
+                    het1 += popcounts(het_1[w] & valid2);
+                    het2 += popcounts(het_2[w] & valid1);
+                }
+                uint32_t het_sum = het1 + het2;
+                if(het_sum && ((double)hethet - 2.0 * ibs0) > king_thresh * het_sum){
+                    part_id1[index].push_back(id1);
+                    part_id2[index].push_back(id2);
+                }
+            }
+        }
+    }
+    posix_mem_free(king_hom0);
+    posix_mem_free(king_het);
+    posix_mem_free(king_hom2);
+    king_hom0 = NULL;
+    king_het = NULL;
+    king_hom2 = NULL;
+
+    for(int index = 0; index < row_parts.size(); index++){
+        cand_id1.insert(cand_id1.end(), part_id1[index].begin(), part_id1[index].end());
+        cand_id2.insert(cand_id2.end(), part_id2[index].begin(), part_id2[index].end());
+        vector<uint32_t>().swap(part_id1[index]);
+        vector<uint32_t>().swap(part_id2[index]);
+    }
+    uint64_t num_pairs = cand_id1.size();
+    LOGGER.i(0, to_string(num_pairs) + " candidate pairs passed the prescreen.");
+
+    //step 2: exact GRM of the candidate pairs and the diagonals
+    cand_row.resize(num_individual, -1);
+    for(uint64_t index = 0; index < num_pairs; index++){
+        cand_row[cand_id1[index]] = 0;
+        cand_row[cand_id2[index]] = 0;
+    }
+    uint32_t num_cand_sample = 0;
+    for(auto &row : cand_row){
+        if(row == 0){
+            row = num_cand_sample++;
+        }
+    }
+    cand_grm.resize(num_pairs, 0.0);
+    cand_miss.resize(num_pairs, 0);
+    cand_miss_bits.resize(num_cand_sample, 0);
+    diag_grm.resize(num_individual, 0.0);
+
+    this->num_byte_geno = sizeof(double) * nMarkerBlock * ((uint64_t)num_cand_sample + 1);
+    int ret = posix_memalign((void **)&stdGeno, 32, num_byte_geno);
+    if(ret != 0){
+        LOGGER.e(0, "can't allocate enough memory for the genotype buffer.");
+    }
+
+    geno->setGRMMode(true, false);
+    bool isSTD = true;
+    if(isMtd) isSTD = false;
+    sd.reserve(processIndex.size());
+    LOGGER << "Computing the GRM of " << num_cand_sample << " samples in candidate pairs..." << std::endl;
+    callBacks.clear();
+    callBacks.push_back(bind(&GRM::sparse_grm_func, this, _1, _2));
+    geno->loopDouble(processIndex, nMarkerBlock, true, true, isSTD, true, callBacks);
+    LOGGER << "  Used " << numValidMarkers << " valid SNPs."<< std::endl;
+    delete[] gbufitems;
+    gbufitems = NULL;
+    posix_mem_free(stdGeno);
+    stdGeno = NULL;
+    geno->setGRMMode(false, false);
+
+    float mtd_weight = getMtdWeight();
+
+    string grm_name = o_name + ".grm.sp";
+    std::ofstream o_sp(grm_name.c_str());
+    if(!o_sp){
+        LOGGER.e(0, "can't open " + grm_name + " to write");
+    }
+    o_sp << std::setprecision(std::numeric_limits<float>::digits10+2);
+
+    uint64_t num_saved = 0;
+    uint64_t index = 0;
+    for(uint32_t id1 = 0; id1 < num_individual; id1++){
+        uint32_t miss1 = sub_miss[id1];
+        for(; index < num_pairs && cand_id1[index] == id1; index++){
+            uint32_t id2 = cand_id2[index];
+            uint32_t sub_N = numValidMarkers - miss1 - sub_miss[id2] + cand_miss[index];
+            float cur_grm = sub_N ? (float)(cand_grm[index] / sub_N) * mtd_weight : 0.0;
+            if(cur_grm >= thresh){
+                o_sp << id1 << "\t" << id2 << "\t" << cur_grm << "\n";
+                num_saved++;
+            }
+        }
+        uint32_t sub_N = numValidMarkers - miss1;
+        float cur_diag = sub_N ? (float)(diag_grm[id1] / sub_N) * mtd_weight : 0.0;
+        o_sp << id1 << "\t" << id1 << "\t" << cur_diag << "\n";
+    }
+    o_sp.close();
+
+    LOGGER.i(0, to_string(num_saved) + " of " + to_string(num_pairs) + " candidate pairs have GRM >= " + to_string(thresh) + ".");
+    LOGGER.i(0, "Sparse GRM has been saved in the file [" + grm_name + "]");
 }
 
 void GRM::processMain() {
@@ -2053,6 +2862,19 @@ void GRM::processMain() {
             return;
         }
 
+        if(process_function == "make_grm_sparse"){
+            Pheno pheno;
+            Marker marker;
+            GRM grm(&pheno, &marker);
+            grm.processMakeSparseGRM();
+            return;
+        }
+
+        if(process_function == "make_grm_spb"){
+            SpGRM::convert(options["grm_spb_input"], options["out"] + SpGRM::suffix);
+            return;
+        }
+
         if(process_function == "make_grmx"){
             LOGGER.i(0, "Note: this function takes X chromosome as non-PAR region.");
 
@@ -2094,6 +2916,14 @@ void GRM::processMain() {
             GRM grm;
             grm.subtract_grm(options["mgrm"], options["out"]);
         }
+        if(process_function == "make_grm_compact"){
+            GRM grm;
+            grm.save_compact(options["grm_compact"], options_b["grm_compact_zstd"]);
+        }
+        if(process_function == "merge_grm"){
+            GRM grm;
+            grm.merge_grm(options["mgrm"], options["out"]);
+        }
     }
 
 }
@@ -0,0 +1,509 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Memory-mapped view of a lower-triangular binary GRM
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "GRMView.h"
+#include "Logger.h"
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <omp.h>
+#include "zstd.h"
+
+using std::to_string;
+
+static_assert(sizeof(GRMCompactHeader) == 64, "the header of the compact GRM shall be 64 bytes");
+
+// IEEE half precision, round to nearest even
+static uint16_t float_to_fp16(float f){
+    uint32_t x;
+    memcpy(&x, &f, sizeof(float));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exp = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+    if(exp == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    int32_t e = (int32_t)exp - 127 + 15;
+    if(e >= 0x1f) return sign | 0x7c00;
+    if(e <= 0){
+        // subnormal
+        if(e < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - e;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if(rem > halfway || (rem == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+    uint32_t half = sign | (e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    // a carry into the exponent is still correct
+    if(rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++;
+    return half;
+}
+
+static float fp16_to_float(uint16_t h){
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if(exp == 0){
+        if(mant == 0){
+            x = sign;
+        }else{
+            exp = 127 - 15 + 1;
+            while(!(mant & 0x400)){
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    }else if(exp == 0x1f){
+        x = sign | 0x7f800000 | (mant << 13);
+    }else{
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+static uint16_t float_to_bf16(float f){
+    uint32_t x;
+    memcpy(&x, &f, sizeof(float));
+    if((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    x += 0x7fff + ((x >> 16) & 1);
+    return x >> 16;
+}
+
+static float bf16_to_float(uint16_t b){
+    uint32_t x = (uint32_t)b << 16;
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+static void encode_items(const float *in, uint64_t num_item, uint32_t encoding, char *out){
+    if(encoding == GRMView::ENC_FLOAT){
+        memcpy(out, in, sizeof(float) * num_item);
+        return;
+    }
+    uint16_t *out16 = (uint16_t *)out;
+    if(encoding == GRMView::ENC_FP16){
+        for(uint64_t k = 0; k < num_item; k++) out16[k] = float_to_fp16(in[k]);
+    }else{
+        for(uint64_t k = 0; k < num_item; k++) out16[k] = float_to_bf16(in[k]);
+    }
+}
+
+static void decode_items(const char *in, uint64_t num_item, uint32_t encoding, float *out){
+    if(encoding == GRMView::ENC_FLOAT){
+        memcpy(out, in, sizeof(float) * num_item);
+        return;
+    }
+    uint16_t item;
+    if(encoding == GRMView::ENC_FP16){
+        for(uint64_t k = 0; k < num_item; k++){
+            memcpy(&item, in + 2 * k, 2);
+            out[k] = fp16_to_float(item);
+        }
+    }else{
+        for(uint64_t k = 0; k < num_item; k++){
+            memcpy(&item, in + 2 * k, 2);
+            out[k] = bf16_to_float(item);
+        }
+    }
+}
+
+static uint64_t num_tri(uint64_t row){
+    return row * (row + 1) / 2;
+}
+
+GRMView::GRMView(string filename, uint64_t num_subjects, bool bSequential) : file(filename, bSequential){
+    num_raw = num_subjects;
+    if(num_tri(num_raw) * sizeof(float) == file.size()){
+        data = (const float *)file.data();
+    }else if(file.size() >= sizeof(GRMCompactHeader) && memcmp(file.data(), "GCGR", 4) == 0){
+        openCompact();
+    }else{
+        LOGGER.e(0, "the size of [" + filename + "] does not match " + to_string(num_raw) + " samples in the GRM ID file.");
+    }
+    keep.resize(num_raw);
+    std::iota(keep.begin(), keep.end(), 0);
+}
+
+void GRMView::openCompact(){
+    GRMCompactHeader head;
+    memcpy(&head, file.data(), sizeof(GRMCompactHeader));
+    const string &filename = file.name();
+    if(head.version != 1){
+        LOGGER.e(0, "unsupported version " + to_string(head.version) + " of the compact GRM [" + filename + "].");
+    }
+    if(head.num_indi != num_raw){
+        LOGGER.e(0, "[" + filename + "] has " + to_string(head.num_indi) + " samples, but " + to_string(num_raw) + " samples in the GRM ID file.");
+    }
+    const char *cur_body = file.data() + sizeof(GRMCompactHeader);
+    uint64_t body_size = file.size() - sizeof(GRMCompactHeader);
+
+    if(head.encoding == ENC_CONSTANT){
+        if(body_size != 0){
+            LOGGER.e(0, "the size of [" + filename + "] is not correct.");
+        }
+        bConstant = true;
+        constant = head.constant;
+        return;
+    }
+    if(head.encoding != ENC_FLOAT && head.encoding != ENC_FP16 && head.encoding != ENC_BF16){
+        LOGGER.e(0, "unknown encoding " + to_string(head.encoding) + " of the compact GRM [" + filename + "].");
+    }
+    encoding = head.encoding;
+    item_bytes = encoding == ENC_FLOAT ? sizeof(float) : sizeof(uint16_t);
+    uint64_t num_item = num_tri(num_raw);
+
+    if(head.compress == 0){
+        if(body_size != num_item * item_bytes){
+            LOGGER.e(0, "the size of [" + filename + "] is not correct, the file may be truncated.");
+        }
+        if(encoding == ENC_FLOAT){
+            data = (const float *)cur_body;
+        }else{
+            body = cur_body;
+        }
+    }else if(head.compress == 1){
+        uint64_t num_tiles = head.num_tiles;
+        uint64_t index_size = (num_tiles + 1) * 2 * sizeof(uint64_t);
+        if(num_tiles == 0 || body_size < index_size){
+            LOGGER.e(0, "the size of [" + filename + "] is not correct, the file may be truncated.");
+        }
+        vector<uint64_t> index((num_tiles + 1) * 2);
+        memcpy(index.data(), cur_body, index_size);
+        frames = cur_body + index_size;
+        uint64_t frames_size = body_size - index_size;
+        bool valid = index[0] == 0 && index[1] == 0 && index[2 * num_tiles] == num_raw && index[2 * num_tiles + 1] == frames_size;
+        for(uint64_t t = 0; valid && t < num_tiles; t++){
+            valid = index[2 * t] < index[2 * t + 2] && index[2 * t + 1] <= index[2 * t + 3];
+        }
+        tile_rows.resize(num_tiles + 1);
+        tile_offsets.resize(num_tiles + 1);
+        for(uint64_t t = 0; t <= num_tiles; t++){
+            tile_rows[t] = index[2 * t];
+            tile_offsets[t] = index[2 * t + 1];
+        }
+        // the frame headers only, the tiles are decompressed when touched
+        for(uint64_t t = 0; valid && t < num_tiles; t++){
+            unsigned long long content = ZSTD_getFrameContentSize(frames + tile_offsets[t], tile_offsets[t + 1] - tile_offsets[t]);
+            valid = content == (num_tri(tile_rows[t + 1]) - num_tri(tile_rows[t])) * item_bytes;
+        }
+        if(!valid){
+            LOGGER.e(0, "invalid tile index in [" + filename + "].");
+        }
+    }else{
+        LOGGER.e(0, "unknown compression " + to_string(head.compress) + " of the compact GRM [" + filename + "].");
+    }
+
+    caches.resize(omp_get_max_threads());
+    for(auto &cache : caches){
+        for(int k = 0; k < cache_tiles; k++){
+            cache.tile[k] = UINT64_MAX;
+            cache.last_use[k] = 0;
+        }
+    }
+}
+
+void GRMView::decodeTile(uint64_t tile, float *out) const{
+    uint64_t tile_item = num_tri(tile_rows[tile + 1]) - num_tri(tile_rows[tile]);
+    const char *frame = frames + tile_offsets[tile];
+    size_t frame_size = tile_offsets[tile + 1] - tile_offsets[tile];
+    size_t dSize;
+    if(item_bytes == sizeof(float)){
+        dSize = ZSTD_decompress(out, tile_item * item_bytes, frame, frame_size);
+    }else{
+        vector<char> &encoded = caches[omp_get_thread_num()].encoded;
+        encoded.resize(tile_item * item_bytes);
+        dSize = ZSTD_decompress(encoded.data(), encoded.size(), frame, frame_size);
+        if(!ZSTD_isError(dSize) && dSize == encoded.size()){
+            decode_items(encoded.data(), tile_item, encoding, out);
+        }
+    }
+    if(ZSTD_isError(dSize) || dSize != tile_item * item_bytes){
+        #pragma omp critical
+        LOGGER.e(0, "failed to decompress [" + file.name() + "], the file is corrupted.");
+    }
+}
+
+// the tile in the cache of the calling thread, the least recently used one is replaced
+const float *GRMView::getTile(uint64_t tile) const{
+    TileCache &cache = caches[omp_get_thread_num()];
+    cache.clock++;
+    int slot = 0;
+    for(int k = 0; k < cache_tiles; k++){
+        if(cache.tile[k] == tile){
+            cache.last_use[k] = cache.clock;
+            return cache.items[k].data();
+        }
+        if(cache.last_use[k] < cache.last_use[slot]) slot = k;
+    }
+    vector<float> &items = cache.items[slot];
+    items.resize(num_tri(tile_rows[tile + 1]) - num_tri(tile_rows[tile]));
+    decodeTile(tile, items.data());
+    cache.tile[slot] = tile;
+    cache.last_use[slot] = cache.clock;
+    return items.data();
+}
+
+// i >= j
+float GRMView::compactAt(uint64_t i, uint64_t j) const{
+    if(!frames){
+        float value;
+        decode_items(body + (num_tri(i) + j) * item_bytes, 1, encoding, &value);
+        return value;
+    }
+    uint64_t tile = std::upper_bound(tile_rows.begin(), tile_rows.end(), i) - tile_rows.begin() - 1;
+    return getTile(tile)[num_tri(i) - num_tri(tile_rows[tile]) + j];
+}
+
+const float *GRMView::compactRow(uint64_t raw_index) const{
+    vector<float> &row = caches[omp_get_thread_num()].row;
+    row.resize(raw_index + 1);
+    if(bConstant){
+        std::fill(row.begin(), row.end(), constant);
+    }else if(!frames){
+        decode_items(body + num_tri(raw_index) * item_bytes, raw_index + 1, encoding, row.data());
+    }else{
+        uint64_t tile = std::upper_bound(tile_rows.begin(), tile_rows.end(), raw_index) - tile_rows.begin() - 1;
+        const float *items = getTile(tile) + num_tri(raw_index) - num_tri(tile_rows[tile]);
+        memcpy(row.data(), items, sizeof(float) * (raw_index + 1));
+    }
+    return row.data();
+}
+
+// the items of any row are needed for the samples out of the file order, thus the tiles are decoded once
+void GRMView::decodeAll(){
+    LOGGER.i(0, "Decompressing [" + file.name() + "] as the samples are not in the file order...");
+    decoded.resize(num_tri(num_raw));
+    int64_t num_tiles = tile_rows.size() - 1;
+    #pragma omp parallel for schedule(dynamic)
+    for(int64_t t = 0; t < num_tiles; t++){
+        decodeTile(t, decoded.data() + num_tri(tile_rows[t]));
+    }
+    data = decoded.data();
+    file.release(0, file.size());
+    for(auto &cache : caches){
+        for(int k = 0; k < cache_tiles; k++){
+            cache.tile[k] = UINT64_MAX;
+            vector<float>().swap(cache.items[k]);
+        }
+    }
+}
+
+void GRMView::setKeep(const vector<uint32_t> &index){
+    for(auto cur_index : index){
+        if(cur_index >= num_raw){
+            LOGGER.e(0, "sample index " + to_string(cur_index) + " is out of the GRM [" + file.name() + "].");
+        }
+    }
+    keep = index;
+    if(frames && decoded.empty() && !std::is_sorted(keep.begin(), keep.end())){
+        decodeAll();
+    }
+}
+
+void GRMView::save(string filename, uint32_t encoding, bool bZstd) const{
+    FILE *h_out = fopen(filename.c_str(), "wb");
+    if(!h_out){
+        LOGGER.e(0, "can't open [" + filename + "] to write.");
+    }
+
+    uint64_t num_keep = keep.size();
+    bool bCompact = encoding != ENC_FLOAT || bZstd;
+    GRMCompactHeader head;
+    memset(&head, 0, sizeof(GRMCompactHeader));
+    memcpy(head.magic, "GCGR", 4);
+    head.version = 1;
+    head.num_indi = num_keep;
+    head.encoding = encoding;
+    head.compress = bZstd ? 1 : 0;
+    if(encoding == ENC_CONSTANT){
+        float value;
+        if(!keptConstant(value)){
+            LOGGER.e(0, "the items of [" + file.name() + "] are not the same, can't be saved as a constant.");
+        }
+        head.compress = 0;
+        head.constant = value;
+        if(fwrite(&head, sizeof(GRMCompactHeader), 1, h_out) != 1){
+            LOGGER.e(0, "can't write to [" + filename + "], please check the disk condition or permission.");
+        }
+        fclose(h_out);
+        return;
+    }
+    uint32_t item_bytes = encoding == ENC_FLOAT ? sizeof(float) : sizeof(uint16_t);
+
+    // tiles of ~4M items, each is one zstd frame
+    const uint64_t num_tile_item = 4 * 1024 * 1024;
+    vector<uint64_t> tile_rows = {0};
+    while(tile_rows.back() < num_keep){
+        uint64_t row_from = tile_rows.back(), row_to = row_from + 1;
+        while(row_to < num_keep && num_tri(row_to) - num_tri(row_from) < num_tile_item){
+            row_to++;
+        }
+        tile_rows.push_back(row_to);
+    }
+    uint64_t num_tiles = tile_rows.size() - 1;
+    vector<uint64_t> index;
+    if(bCompact){
+        if(bZstd){
+            head.num_tiles = num_tiles;
+            index.resize((num_tiles + 1) * 2, 0);
+        }
+        // the index is written again when the tiles are done
+        if(fwrite(&head, sizeof(GRMCompactHeader), 1, h_out) != 1 ||
+                fwrite(index.data(), sizeof(uint64_t), index.size(), h_out) != index.size()){
+            LOGGER.e(0, "can't write to [" + filename + "], please check the disk condition or permission.");
+        }
+    }
+
+    // ~256MB of output rows (whole tiles) are filled in parallel, then encoded and written
+    const uint64_t num_buf_item = 64 * 1024 * 1024;
+    vector<float> buf;
+    vector<char> encoded;
+    vector<vector<char>> tile_frames;
+    uint64_t tile_from = 0, frame_offset = 0;
+    while(tile_from < num_tiles){
+        uint64_t tile_to = tile_from + 1;
+        while(tile_to < num_tiles && num_tri(tile_rows[tile_to + 1]) - num_tri(tile_rows[tile_from]) <= num_buf_item){
+            tile_to++;
+        }
+        uint64_t row_from = tile_rows[tile_from], row_to = tile_rows[tile_to];
+        uint64_t base = num_tri(row_from);
+        uint64_t num_item = num_tri(row_to) - base;
+        buf.resize(num_item);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(uint64_t i = row_from; i < row_to; i++){
+            float *out = buf.data() + num_tri(i) - base;
+            if(bConstant){
+                std::fill(out, out + i + 1, constant);
+                continue;
+            }
+            uint64_t raw_i = keep[i];
+            const float *row = rawRow(raw_i);
+            for(uint64_t j = 0; j <= i; j++){
+                uint64_t raw_j = keep[j];
+                out[j] = raw_j <= raw_i ? row[raw_j] : rawAt(raw_j, raw_i);
+            }
+        }
+
+        bool success = true;
+        if(!bCompact){
+            success = fwrite(buf.data(), sizeof(float), num_item, h_out) == num_item;
+        }else if(!bZstd){
+            encoded.resize(num_item * item_bytes);
+            const uint64_t chunk = 1024 * 1024;
+            int64_t num_chunk = (num_item + chunk - 1) / chunk;
+            #pragma omp parallel for
+            for(int64_t c = 0; c < num_chunk; c++){
+                uint64_t item_from = c * chunk;
+                encode_items(buf.data() + item_from, std::min(chunk, num_item - item_from), encoding, encoded.data() + item_from * item_bytes);
+            }
+            success = fwrite(encoded.data(), 1, encoded.size(), h_out) == encoded.size();
+        }else{
+            tile_frames.resize(tile_to - tile_from);
+            #pragma omp parallel for schedule(dynamic)
+            for(int64_t t = tile_from; t < (int64_t)tile_to; t++){
+                uint64_t item_from = num_tri(tile_rows[t]) - base;
+                uint64_t tile_item = num_tri(tile_rows[t + 1]) - base - item_from;
+                vector<char> tile(tile_item * item_bytes);
+                encode_items(buf.data() + item_from, tile_item, encoding, tile.data());
+                vector<char> &frame = tile_frames[t - tile_from];
+                frame.resize(ZSTD_compressBound(tile.size()));
+                size_t cSize = ZSTD_compress(frame.data(), frame.size(), tile.data(), tile.size(), 3);
+                frame.resize(ZSTD_isError(cSize) ? 0 : cSize);
+            }
+            for(uint64_t t = tile_from; t < tile_to && success; t++){
+                vector<char> &frame = tile_frames[t - tile_from];
+                index[2 * t] = tile_rows[t];
+                index[2 * t + 1] = frame_offset;
+                success = !frame.empty() && fwrite(frame.data(), 1, frame.size(), h_out) == frame.size();
+                frame_offset += frame.size();
+            }
+        }
+        if(!success){
+            LOGGER.e(0, "can't write to [" + filename + "], please check the disk condition or permission.");
+        }
+        tile_from = tile_to;
+    }
+
+    if(bZstd){
+        index[2 * num_tiles] = num_keep;
+        index[2 * num_tiles + 1] = frame_offset;
+        if(fseeko(h_out, sizeof(GRMCompactHeader), SEEK_SET) != 0 ||
+                fwrite(index.data(), sizeof(uint64_t), index.size(), h_out) != index.size()){
+            LOGGER.e(0, "can't write to [" + filename + "], please check the disk condition or permission.");
+        }
+    }
+    fclose(h_out);
+}
+
+bool GRMView::keptConstant(float &value) const{
+    if(bConstant){
+        value = constant;
+        return true;
+    }
+    int64_t num_keep = keep.size();
+    if(num_keep == 0){
+        value = 0.0f;
+        return true;
+    }
+    value = rawAt(keep[0], keep[0]);
+    float cur_value = value;
+    bool same = true;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:same)
+    for(int64_t i = 0; i < num_keep; i++){
+        for(int64_t j = 0; j <= i; j++){
+            if(rawAt(keep[i], keep[j]) != cur_value){
+                same = false;
+                break;
+            }
+        }
+    }
+    return same;
+}
+
+void GRMView::release(uint64_t raw_from, uint64_t raw_to) const{
+    if(bConstant || !decoded.empty()) return;
+    if(data || body){
+        uint64_t byte_start = data ? (const char *)data - file.data() : body - file.data();
+        uint64_t byte_from = num_tri(raw_from) * item_bytes;
+        uint64_t byte_to = num_tri(raw_to + 1) * item_bytes;
+        file.release(byte_start + byte_from, byte_to - byte_from);
+        return;
+    }
+    // the tiles ending in the rows, a tile is decoded again if it is touched later
+    uint64_t num_tiles = tile_rows.size() - 1;
+    uint64_t tile = std::upper_bound(tile_rows.begin(), tile_rows.end(), raw_from) - tile_rows.begin() - 1;
+    for(; tile < num_tiles && tile_rows[tile] <= raw_to && tile_rows[tile + 1] - 1 <= raw_to; tile++){
+        for(auto &cache : caches){
+            for(int k = 0; k < cache_tiles; k++){
+                if(cache.tile[k] == tile){
+                    cache.tile[k] = UINT64_MAX;
+                    cache.last_use[k] = 0;
+                    vector<float>().swap(cache.items[k]);
+                }
+            }
+        }
+        file.release(frames - file.data() + tile_offsets[tile], tile_offsets[tile + 1] - tile_offsets[tile]);
+    }
+}
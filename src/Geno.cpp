@@ -621,6 +621,29 @@ void Geno::preGenoDouble(int numMarkerBuf, bool bMakeGeno, bool bGenoCenter, boo
     }
 
     missPtrSize = PgenReader::GetSubsetMaskSize(keepSampleCT);
+
+    // one item per thread for the per-marker callbacks, allocated once here
+    uint32_t genoSize, missSize;
+    setGenoItemSize(genoSize, missSize);
+    threadGenoItems.resize(omp_get_max_threads());
+    for(auto &item : threadGenoItems){
+        item.geno.reserve(genoSize);
+        item.missing.reserve(missSize);
+    }
+    threadSubsetBufs.resize(omp_get_max_threads());
+    if(rawSampleCT != keepSampleCT){
+        for(auto &subset_buf : threadSubsetBufs){
+            subset_buf.resize(PgenReader::GetGenoBufPtrSize(keepSampleCT));
+        }
+    }
+}
+
+GenoBufItem& Geno::getThreadGenoItem(){
+    uint32_t thread = omp_get_thread_num();
+    if(thread >= threadGenoItems.size()){
+        LOGGER.e(0, "the genotype items are not ready for thread " + to_string(thread) + ".");
+    }
+    return threadGenoItems[thread];
 }
 
 //void Geno::loopDouble(const vector<uint32_t> &extractIndex, )
@@ -876,16 +899,39 @@ void Geno::getGenoDouble_pgen(uintptr_t *buf, int idx, GenoBufItem* gbuf){
             }
         }
         if(bMakeMiss){
-            gbuf->missing.resize(missPtrSize, 0);
+            gbuf->missing.assign(missPtrSize, 0);
         }
 
     }
 }
 
-void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
+// values of the 2-bit codes 0, 1, 2 and 3 (missing); the homozygotes are swapped for a reversed effect allele
+void Geno::getBedCodes(bool bDom, bool isEffRev, double mu, double center_value, double rdev, double *codes){
+    double aa0, aa1, aa2, na;
+    if(!bDom){
+        aa0 = 0.0;
+        aa1 = 1.0;
+        aa2 = 2.0;
+        na = mu;
+    }else{
+        aa0 = 0.0;
+        aa1 = mu;
+        aa2 = 2.0 * mu - 2.0;
+        na = 0.5 * mu * mu;
+    }
+    if(isEffRev){
+        std::swap(aa0, aa2);
+    }
+    codes[0] = (aa0 - center_value) * rdev;
+    codes[1] = (aa1 - center_value) * rdev;
+    codes[2] = (aa2 - center_value) * rdev;
+    codes[3] = (na - center_value) * rdev;
+}
+
+// statistics and filters of the hard-call marker, and the genotype values of codes 0, 1, 2 and missing
+//   after centering and scaling (only if bMakeGeno); false if the marker is not valid
+bool Geno::getGenoValues_bed(uintptr_t *cur_buf, uint8_t isSexXY, GenoBufItem* gbuf, double *codes, double &center_value, double &rdev){
     SNPInfo snpinfo;
-    uintptr_t *cur_buf = buf + idx * bedRawGenoBuf1PtrSize;
-    uint8_t isSexXY = isMarkersSexXYs[curBufferIndex];
     bool hasNoHET = true;
     if(isSexXY != 1){
         PgenReader::CountHardFreqMissExt(cur_buf, keepMaskInterPtr, rawSampleCT, keepSampleCT, &snpinfo, f_std);
@@ -908,8 +954,8 @@ void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
         snpinfo.std = 2 * af * (1.0 - af); 
     }
     double maf = std::min(af, 1.0 - af);
-    if(maf >= min_maf && maf <= max_maf){
-        if(snpinfo.nMissRate >= dFilterMiss){
+    if(bNoFilter || (maf >= min_maf && maf <= max_maf)){
+        if(bNoFilter || snpinfo.nMissRate >= dFilterMiss){
             gbuf->valid = true;
             gbuf->af = af;
             gbuf->nValidN = snpinfo.N;
@@ -928,15 +974,13 @@ void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
             if(bMakeGeno){
                 double mu = gbuf->mean;
                 double sd = gbuf->sd;
-                if(sd < 1.0e-50){
+                if(sd < 1.0e-50 && (!bNoFilter || bGenoStd)){
                     gbuf->valid = false;
-                    return;
+                    return false;
                 }
 
-                double center_value = 0.0;
-                double rdev = 1.0;
-                double a0, a1, a2, na;
-
+                center_value = 0.0;
+                rdev = 1.0;
                 if(!bGRMDom){
                     if(bGenoCenter){
                         center_value = mu;
@@ -944,80 +988,216 @@ void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
                     if(bGenoStd){
                         rdev = sqrt(1.0 / sd);
                     }
-                    double aa0 = 0.0, aa2 = 2.0;
-                    if(isEffRev){
-                        double temp = aa0;
-                        aa0 = aa2;
-                        aa2 = aa0;
+                }else{
+                    if(bGenoCenter)center_value = 0.5 * mu * mu; // psq
+                    if(bGenoStd){
+                        rdev = 1.0 / sd;
                     }
-
-                    a0 = (aa0 - center_value) * rdev;
-                    a1 = (1.0 - center_value) * rdev;
-                    a2 = (aa2 - center_value) * rdev;
-                    na = (mu - center_value) * rdev;
-               }else{
-                   double psq = 0.5 * mu * mu;
-                   if(bGenoCenter)center_value = psq; // psq
-                   if(bGenoStd){
-                       rdev = 1.0 / sd;
-                   }
-                   double aa0 = 0.0, aa2 = 2.0 * mu - 2.0;
-                   if(isEffRev){
-                       double temp = aa0;
-                       aa0 = aa2;
-                       aa2 = temp;
-                   }
-                   a0 = (aa0 - center_value) * rdev;
-                   a1 = (mu - center_value) * rdev;
-                   a2 = (aa2 - center_value) * rdev;
-                   na = (psq - center_value)*rdev;
                 }
+                getBedCodes(bGRMDom, isEffRev, mu, center_value, rdev, codes);
+            }
+            return true;
+        }
+    }
+    gbuf->valid = false;
+    return false;
+}
 
-                const double lookup[32] __attribute__ ((aligned (16))) = GET_TABLE16(a0, a1, a2, na);
-                gbuf->geno.resize(keepSampleCT);
-                uintptr_t * pmiss = NULL;
-                if(bMakeMiss){
-                    gbuf->missing.resize(missPtrSize); 
-                    pmiss = gbuf->missing.data();
-                }
-                PgenReader::ExtractDoubleExt(cur_buf, keepMaskPtr, rawSampleCT, keepSampleCT, lookup, gbuf->geno.data(), pmiss); 
-                // adjust for chr X;
-                if(isSexXY == 1){
-                    /* don't set to missing
-                    if(!hasNoHET){
-                        for(int i = 0 ; i < keepMaleSampleCT; i++){
-                            uint32_t curMaleIndex = keepMaleExtractIndex[i];
-                            if(gbuf->geno[curMaleIndex] == a1){
-                                gbuf->geno[curMaleIndex] = na;
-                            }
-                        }
-                    }
-                    */
-                    double weight;
-                    bool needWeight;
-                    setMaleWeight(weight, needWeight);
-                    if(needWeight){
-                        if(bGRM){
-                            for(int i = 0 ; i < keepMaleSampleCT; i++){
-                                gbuf->geno[keepMaleExtractIndex[i]] *= weight;
-                            }
-                        }else{
-                            double correctWeight = (weight - 1) * rdev * center_value;
-                            for(int i = 0 ; i < keepMaleSampleCT; i++){
-                                uint32_t curIndex = keepMaleExtractIndex[i];
-                                gbuf->geno[curIndex] *= weight;
-                                gbuf->geno[curIndex] += correctWeight;
-                            }
-                        }
-                    }
+void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
+    uintptr_t *cur_buf = buf + idx * bedRawGenoBuf1PtrSize;
+    uint8_t isSexXY = isMarkersSexXYs[curBufferIndex];
+    double codes[4];
+    double center_value, rdev;
+    if(!getGenoValues_bed(cur_buf, isSexXY, gbuf, codes, center_value, rdev) || !bMakeGeno){
+        return;
+    }
+    double a0 = codes[0], a1 = codes[1], a2 = codes[2], na = codes[3];
 
-                    
+    const double lookup[32] __attribute__ ((aligned (16))) = GET_TABLE16(a0, a1, a2, na);
+    gbuf->geno.resize(keepSampleCT);
+    uintptr_t * pmiss = NULL;
+    if(bMakeMiss){
+        gbuf->missing.resize(missPtrSize); 
+        pmiss = gbuf->missing.data();
+    }
+    PgenReader::ExtractDoubleExt(cur_buf, keepMaskPtr, rawSampleCT, keepSampleCT, lookup, gbuf->geno.data(), pmiss); 
+    // adjust for chr X;
+    if(isSexXY == 1){
+        /* don't set to missing
+        if(!hasNoHET){
+            for(int i = 0 ; i < keepMaleSampleCT; i++){
+                uint32_t curMaleIndex = keepMaleExtractIndex[i];
+                if(gbuf->geno[curMaleIndex] == a1){
+                    gbuf->geno[curMaleIndex] = na;
+                }
+            }
+        }
+        */
+        double weight;
+        bool needWeight;
+        setMaleWeight(weight, needWeight);
+        if(needWeight){
+            if(bGRM){
+                for(int i = 0 ; i < keepMaleSampleCT; i++){
+                    gbuf->geno[keepMaleExtractIndex[i]] *= weight;
+                }
+            }else{
+                double correctWeight = (weight - 1) * rdev * center_value;
+                for(int i = 0 ; i < keepMaleSampleCT; i++){
+                    uint32_t curIndex = keepMaleExtractIndex[i];
+                    gbuf->geno[curIndex] *= weight;
+                    gbuf->geno[curIndex] += correctWeight;
                 }
             }
-            return;
         }
+
+        
     }
-    gbuf->valid = false;
+}
+
+// x'y and x'x of the genotype values straight from the packed hard calls (BED or PGEN) without expanding
+//   the marker: the sums of y and the counts are accumulated over the samples of non-zero codes only, the
+//   code 0 takes the rest of sum_y, the sum of y over all the kept samples.
+//   false if the marker has to be expanded by getGenoDouble (other formats, chr X)
+bool Geno::getGenoScore(uintptr_t *buf, int bufIndex, GenoBufItem* gbuf, const double *y, double sum_y, double &xty, double &xtx){
+    if(!bMakeGeno || (genoFormat != "BED" && genoFormat != "PGEN")){
+        return false;
+    }
+    uint8_t isSexXY = isMarkersSexXYs[curBufferIndex];
+    if(isSexXY == 1){
+        return false;
+    }
+
+    uintptr_t *cur_buf = buf + bufIndex * bedRawGenoBuf1PtrSize;
+    double codes[4];
+    double center_value, rdev;
+    xty = 0;
+    xtx = 0;
+    if(!getGenoValues_bed(cur_buf, isSexXY, gbuf, codes, center_value, rdev)){
+        return true;
+    }
+
+    const uintptr_t *genoarr = getKeptGenoArray(cur_buf);
+
+    const uint32_t genoPerWord = sizeof(uintptr_t) * 4;
+    const uintptr_t mask5555 = (~(uintptr_t)0) / 3;
+    uint32_t num_word = (keepSampleCT + genoPerWord - 1) / genoPerWord;
+    uint32_t num_tail = keepSampleCT % genoPerWord;
+    double sums[4] = {0.0, 0.0, 0.0, 0.0};
+    uint32_t counts[4] = {0, 0, 0, 0};
+    for(uint32_t index_word = 0; index_word < num_word; index_word++){
+        uintptr_t word = genoarr[index_word];
+        if(num_tail && index_word == num_word - 1){
+            word &= ((uintptr_t)1 << (2 * num_tail)) - 1;
+        }
+        uintptr_t nonzero = (word | (word >> 1)) & mask5555;
+        const double *cur_y = y + (uint64_t)index_word * genoPerWord;
+        while(nonzero){
+            uint32_t shift = CTZ64U(nonzero);
+            uint32_t code = (word >> shift) & 3;
+            sums[code] += cur_y[shift >> 1];
+            counts[code]++;
+            nonzero &= nonzero - 1;
+        }
+    }
+    counts[0] = keepSampleCT - counts[1] - counts[2] - counts[3];
+    sums[0] = sum_y - sums[1] - sums[2] - sums[3];
+
+    for(int code = 0; code < 4; code++){
+        xty += codes[code] * sums[code];
+        xtx += codes[code] * codes[code] * counts[code];
+    }
+    return true;
+}
+
+// 2-bit codes of the kept samples, in the buffer of the calling thread
+const uintptr_t *Geno::getKeptGenoArray(const uintptr_t *cur_buf){
+    if(rawSampleCT == keepSampleCT){
+        return cur_buf;
+    }
+    uint32_t thread = omp_get_thread_num();
+    if(thread >= threadSubsetBufs.size()){
+        LOGGER.e(0, "the genotype buffers are not ready for thread " + to_string(thread) + ".");
+    }
+    vector<uintptr_t> &subset_buf = threadSubsetBufs[thread];
+    PgenReader::ExtractGenoExt(cur_buf, keepMaskPtr, rawSampleCT, keepSampleCT, subset_buf.data());
+    return subset_buf.data();
+}
+
+// The codes are counted by popcount first, the most common one is taken as the base, and the samples of
+//   the other codes are listed by walking the non-zero codes of the words XORed with the base.
+bool Geno::getGenoCarriers(uintptr_t *buf, int bufIndex, GenoBufItem* gbuf, double maxRate, GenoCarriers &carriers){
+    if(!bMakeGeno || (genoFormat != "BED" && genoFormat != "PGEN")){
+        return false;
+    }
+    uint8_t isSexXY = isMarkersSexXYs[curBufferIndex];
+    if(isSexXY == 1){
+        return false;
+    }
+
+    uintptr_t *cur_buf = buf + bufIndex * bedRawGenoBuf1PtrSize;
+    const uintptr_t *genoarr = getKeptGenoArray(cur_buf);
+
+    const uint32_t genoPerWord = sizeof(uintptr_t) * 4;
+    const uintptr_t mask5555 = (~(uintptr_t)0) / 3;
+    uint32_t num_word = (keepSampleCT + genoPerWord - 1) / genoPerWord;
+    uint32_t num_tail = keepSampleCT % genoPerWord;
+    uintptr_t tail_mask = num_tail ? (((uintptr_t)1 << (2 * num_tail)) - 1) : ~(uintptr_t)0;
+    double maxCarrier = maxRate * keepSampleCT;
+    // the samples seen so far outside the modal code are a lower bound of the carriers,
+    //  so common markers leave the scan after a few words, before any frequency pass
+    uint32_t counts[4] = {0, 0, 0, 0};
+    for(uint32_t index_word = 0; index_word < num_word; index_word++){
+        uintptr_t word = genoarr[index_word];
+        if(index_word == num_word - 1){
+            word &= tail_mask;
+        }
+        uintptr_t high = (word >> 1) & mask5555;
+        counts[1] += popcount(word & ~high & mask5555);
+        counts[2] += popcount(high & ~word);
+        counts[3] += popcount(word & high);
+        if((index_word & 15) == 15 && index_word + 1 < num_word){
+            uint32_t seen = (index_word + 1) * genoPerWord;
+            counts[0] = seen - counts[1] - counts[2] - counts[3];
+            if(seen - *std::max_element(counts, counts + 4) > maxCarrier){
+                return false;
+            }
+        }
+    }
+    counts[0] = keepSampleCT - counts[1] - counts[2] - counts[3];
+    uint32_t base = std::max_element(counts, counts + 4) - counts;
+    uint32_t num_carrier = keepSampleCT - counts[base];
+    if(num_carrier > maxCarrier){
+        return false;
+    }
+
+    double codes[4];
+    double center_value, rdev;
+    if(!getGenoValues_bed(cur_buf, isSexXY, gbuf, codes, center_value, rdev)){
+        return true;
+    }
+
+    carriers.base = codes[base];
+    carriers.index.clear();
+    carriers.value.clear();
+    carriers.index.reserve(num_carrier);
+    carriers.value.reserve(num_carrier);
+    uintptr_t base_word = mask5555 * base;
+    for(uint32_t index_word = 0; index_word < num_word; index_word++){
+        uintptr_t word = genoarr[index_word] ^ base_word;
+        if(index_word == num_word - 1){
+            word &= tail_mask;
+        }
+        uintptr_t nonzero = (word | (word >> 1)) & mask5555;
+        uint32_t sample_base = index_word * genoPerWord;
+        while(nonzero){
+            uint32_t shift = CTZ64U(nonzero);
+            carriers.index.push_back(sample_base + (shift >> 1));
+            carriers.value.push_back(codes[((word >> shift) & 3) ^ base]);
+            nonzero &= nonzero - 1;
+        }
+    }
+    return true;
 }
 
 void Geno::readGeno_bgen(const vector<uint32_t> &extractIndex){
@@ -1065,12 +1245,7 @@ void Geno::readGeno_bgen(const vector<uint32_t> &extractIndex){
 void Geno::setMaleWeight(double &weight, bool &needWeight){
     weight = 1.0;
     if(bGRM){ // GRM 
-        weight = sqrt(0.5);
-        if(iGRMdc == 1){
-            weight *= sqrt(2.0);
-        }else if(iGRMdc == 0){
-            weight *= sqrt(0.5);
-        }
+        weight = getGRMMaleWeight();
     }else{
         if(iDC == 0){
             weight = 0.5;
@@ -1087,7 +1262,7 @@ void Geno::setMaleWeight(double &weight, bool &needWeight){
            }
            */
     }
-    if(std::abs(weight - 1.0) > 1e-6){
+    if(std::abs(weight - 1.0) > 1e-6 && !(bGRM && bDeferGRMMaleWeight)){
         needWeight = true;
     }else{
         needWeight = false;
@@ -1353,10 +1528,10 @@ void Geno::getGenoDouble_bgen(uintptr_t *buf, int idx, GenoBufItem* gbuf){
     }
 
     double maf = std::min(af, 1.0 - af);
-    if(maf >= min_maf && maf <= max_maf){
+    if(bNoFilter || (maf >= min_maf && maf <= max_maf)){
         double nMissRate = 1.0*validN / curSampleCT;
         //LOGGER << "dFilterMiss: " << dFilterMiss << "*" << nMissRate << ", info: " << dFilterInfo << "*" << info << ", " << std << std::endl; 
-        if(nMissRate >= dFilterMiss && info >= dFilterInfo){
+        if(bNoFilter || (nMissRate >= dFilterMiss && info >= dFilterInfo)){
             gbuf->valid = true;
             gbuf->af = af;
             gbuf->nValidN = validN;
@@ -1366,7 +1541,7 @@ void Geno::getGenoDouble_bgen(uintptr_t *buf, int idx, GenoBufItem* gbuf){
             gbuf->sd = std;
             if(bMakeGeno){
                 double mu = gbuf->mean;
-                if(std < 1.0e-50){
+                if(std < 1.0e-50 && (!bNoFilter || bGenoStd)){
                     gbuf->valid = false;
                     return;
                 }
@@ -1447,7 +1622,7 @@ void Geno::getGenoDouble_bgen(uintptr_t *buf, int idx, GenoBufItem* gbuf){
                 }
             }
             if(bMakeMiss){
-                gbuf->missing.resize(missPtrSize, 0); 
+                gbuf->missing.assign(missPtrSize, 0); 
                 const int ptrsize = sizeof(uintptr_t) * CHAR_BIT;
                 for(int j = 0; j < miss_index.size(); j++){
                     int cur_index = miss_index[j];
@@ -1466,6 +1641,24 @@ void Geno::setGRMMode(bool grm, bool dominace){
     this->bGRMDom = dominace;
 }
 
+void Geno::setDeferGRMMaleWeight(bool defer){
+    bDeferGRMMaleWeight = defer;
+}
+
+void Geno::setNoFilter(bool noFilter){
+    bNoFilter = noFilter;
+}
+
+double Geno::getGRMMaleWeight(){
+    double weight = sqrt(0.5);
+    if(iGRMdc == 1){
+        weight *= sqrt(2.0);
+    }else if(iGRMdc == 0){
+        weight *= sqrt(0.5);
+    }
+    return weight;
+}
+
 void Geno::endGenoDouble_bed(){
     delete asyncBuf64;
     delete[] keepMaskPtr;
@@ -1494,6 +1687,10 @@ bool Geno::getGenoHasInfo(){
     return hasInfo;
 }
 
+bool Geno::getHasPreAF(){
+    return bHasPreAF;
+}
+
 void Geno::loopDouble(const vector<uint32_t> &extractIndex, int numMarkerBuf, bool bMakeGeno, bool bGenoCenter, bool bGenoStd, bool bMakeMiss, vector<function<void (uintptr_t *buf, const vector<uint32_t> &exIndex)>> callbacks, bool showLog){
    
     preGenoDouble(numMarkerBuf, bMakeGeno, bGenoCenter, bGenoStd, bMakeMiss);
@@ -3893,7 +4090,7 @@ void Geno::freq_func(uintptr_t* genobuf, const vector<uint32_t> &markerIndex){
     #pragma omp parallel for schedule(dynamic)
     for(int i = 0; i < num_marker; i++){
         uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
+        GenoBufItem &item = getThreadGenoItem();
         item.extractedMarkerIndex = cur_marker;
 
         getGenoDouble(genobuf, i, &item);
@@ -3930,7 +4127,7 @@ void Geno::recode_func(uintptr_t* genobuf, const vector<uint32_t> &markerIndex){
     #pragma omp parallel for ordered schedule(static,1)
     for(int i = 0; i < num_marker; i++){
         uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
+        GenoBufItem &item = getThreadGenoItem();
         item.extractedMarkerIndex = cur_marker;
 
         getGenoDouble(genobuf, i, &item);
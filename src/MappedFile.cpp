@@ -0,0 +1,93 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Read-only memory map of a whole file
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MappedFile.h"
+#include "Logger.h"
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(string filename, bool bSequential) : filename(filename){
+#ifdef _WIN32
+    FILE *h_file = fopen(filename.c_str(), "rb");
+    if(!h_file){
+        LOGGER.e(0, "can't open [" + filename + "] to read.");
+    }
+    _fseeki64(h_file, 0, SEEK_END);
+    mapped_size = _ftelli64(h_file);
+    rewind(h_file);
+    if(mapped_size){
+        mapped = (char *)malloc(mapped_size);
+        if(!mapped){
+            LOGGER.e(0, "can't allocate enough memory to read [" + filename + "].");
+        }
+        if(fread(mapped, 1, mapped_size, h_file) != mapped_size){
+            LOGGER.e(0, "can't read [" + filename + "].");
+        }
+    }
+    fclose(h_file);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd == -1){
+        LOGGER.e(0, "can't open [" + filename + "] to read.");
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+        close(fd);
+        LOGGER.e(0, "can't get the size of [" + filename + "].");
+    }
+    mapped_size = st.st_size;
+    if(mapped_size){
+        void *addr = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(addr == MAP_FAILED){
+            LOGGER.e(0, "can't map [" + filename + "] into memory.");
+        }
+        mapped = (char *)addr;
+        madvise(mapped, mapped_size, bSequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+    }else{
+        close(fd);
+    }
+#endif
+}
+
+MappedFile::~MappedFile(){
+    if(mapped){
+#ifdef _WIN32
+        free(mapped);
+#else
+        munmap(mapped, mapped_size);
+#endif
+    }
+}
+
+void MappedFile::release(uint64_t offset, uint64_t length) const{
+#ifndef _WIN32
+    if(!mapped || offset >= mapped_size) return;
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page_size * page_size;
+    uint64_t end = std::min(offset + length, mapped_size);
+    if(end > start){
+        madvise(mapped + start, end - start, MADV_DONTNEED);
+    }
+#endif
+}
@@ -1317,6 +1317,44 @@ void Marker::extract_marker(vector<string> markers, bool isExtract) {
    LOGGER.i(0, string("After ") + (isExtract? "extracting" : "excluding") +  " SNP, " +  to_string(num_extract) + " SNPs remain.");
 }
 
+void Marker::matchExtractName(const vector<string> &markers, vector<uint32_t> &extract_index, vector<uint32_t> &list_index){
+    vector<uint32_t> raw_index, marker_index;
+    vector_commonIndex(name, markers, raw_index, marker_index);
+    extract_index.clear();
+    list_index.clear();
+    for(int i = 0; i < raw_index.size(); i++){
+        auto it = std::lower_bound(index_extract.begin(), index_extract.end(), raw_index[i]);
+        if(it != index_extract.end() && *it == raw_index[i]){
+            extract_index.push_back(it - index_extract.begin());
+            list_index.push_back(marker_index[i]);
+        }
+    }
+}
+
+void Marker::matchExtractAllele(const vector<string> &markers, const vector<string> &a1_list, const vector<string> &a2_list,
+        vector<uint32_t> &extract_index, vector<uint32_t> &list_index){
+    vector<uint32_t> name_extract_index, name_list_index;
+    matchExtractName(markers, name_extract_index, name_list_index);
+    extract_index.clear();
+    list_index.clear();
+    for(int i = 0; i < name_extract_index.size(); i++){
+        uint32_t raw_index = index_extract[name_extract_index[i]];
+        string cur_a1 = a1_list[name_list_index[i]];
+        string cur_a2 = a2_list[name_list_index[i]];
+        std::transform(cur_a1.begin(), cur_a1.end(), cur_a1.begin(), toupper);
+        std::transform(cur_a2.begin(), cur_a2.end(), cur_a2.begin(), toupper);
+        if(a1[raw_index] == cur_a1 && a2[raw_index] == cur_a2){
+            A_rev[raw_index] = false;
+        }else if(a1[raw_index] == cur_a2 && a2[raw_index] == cur_a1){
+            A_rev[raw_index] = true;
+        }else{
+            continue;
+        }
+        extract_index.push_back(name_extract_index[i]);
+        list_index.push_back(name_list_index[i]);
+    }
+}
+
 void Marker::reset_exclude(){
    vector<uint32_t> whole_index(num_marker);
    std::iota(whole_index.begin(), whole_index.end(), 0);
@@ -1380,6 +1418,10 @@ bool Marker::isEffecRev(uint32_t extractedIndex){
     return A_rev[index_extract[extractedIndex]];
 }
 
+uint8_t Marker::getChrExtract(uint32_t extractedIndex){
+    return chr[index_extract[extractedIndex]];
+}
+
 bool Marker::isEffecRevRaw(uint32_t rawIndex){
     return A_rev[rawIndex];
 }
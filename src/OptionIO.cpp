@@ -6,6 +6,7 @@
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string.hpp>
 #include <string>
+#include <sys/stat.h>
 
 using std::to_string;
 
@@ -205,6 +206,14 @@ uint64_t getFileSize(FILE * file){
    return f_size;
 }
 
+int64_t getFileMTime(string filename){
+    struct stat st;
+    if(stat(filename.c_str(), &st) != 0){
+        return 0;
+    }
+    return (int64_t)st.st_mtime;
+}
+
 
 
 
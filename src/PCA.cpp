@@ -0,0 +1,520 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Approximate principal component analysis streamed from the genotypes
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PCA.h"
+#include "Logger.h"
+#include "mem.hpp"
+#include "utils.hpp"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <functional>
+#include <omp.h>
+
+using std::to_string;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::HouseholderQR;
+using Eigen::SelfAdjointEigenSolver;
+using namespace std::placeholders;
+
+static_assert(sizeof(PCLHeader) == 64, "the header of the binary loadings shall be 64 bytes");
+
+const string PCA::bin_suffix = ".pcl.bin";
+
+map<string, string> PCA::options;
+map<string, double> PCA::options_d;
+vector<string> PCA::processFunctions;
+
+PCA::PCA(Pheno *pheno, Marker *marker){
+    this->pheno = pheno;
+    this->marker = marker;
+    this->geno = new Geno(pheno, marker);
+    num_indi = pheno->count_keep();
+    num_pc = (uint32_t)options_d["pca_num"];
+    if(num_pc > num_indi){
+        LOGGER.w(0, "the number of PCs is larger than the sample size, changed to " + to_string(num_indi) + ".");
+        num_pc = num_indi;
+    }
+    num_block = std::min(num_indi, num_pc + std::max(10u, num_pc));
+
+    gbufitems = new GenoBufItem[nMarkerBlock];
+    if(posix_memalign((void **)&stdGeno, 32, sizeof(double) * num_indi * nMarkerBlock) != 0){
+        LOGGER.e(0, "can't allocate enough memory for the genotype buffer.");
+    }
+    geno->setGRMMode(true, false);
+}
+
+PCA::~PCA(){
+    geno->setGRMMode(false, false);
+    delete[] gbufitems;
+    posix_mem_free(stdGeno);
+    delete geno;
+}
+
+// decode the block in parallel, the valid markers are put into the columns of stdGeno;
+//   all markers are valid in projection as the filters are off
+int PCA::decode(uintptr_t *buf, const vector<uint32_t> &markerIndex, vector<int> &validIndex){
+    int num_marker = markerIndex.size();
+    #pragma omp parallel for
+    for(int i = 0; i < num_marker; i++){
+        GenoBufItem &item = gbufitems[i];
+        item.extractedMarkerIndex = markerIndex[i];
+        geno->getGenoDouble(buf, i, &item);
+    }
+
+    validIndex.clear();
+    for(int i = 0; i < num_marker; i++){
+        if(gbufitems[i].valid){
+            memcpy(stdGeno + (uint64_t)validIndex.size() * num_indi, gbufitems[i].geno.data(), sizeof(double) * num_indi);
+            validIndex.push_back(i);
+        }
+    }
+    return validIndex.size();
+}
+
+void PCA::multiply(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    vector<int> validIndex;
+    int num_valid = decode(buf, markerIndex, validIndex);
+    if(num_valid == 0) return;
+
+    Map<MatrixXd> X(stdGeno, num_indi, num_valid);
+    MatrixXd Z = X.transpose() * Q;
+    Y.noalias() += X * Z;
+    num_valid_markers += num_valid;
+}
+
+// loading of SNP j on PC i is x_j' v_i / (lambda_i * m), the same as --pc-loading
+void PCA::loading(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    vector<int> validIndex;
+    int num_valid = decode(buf, markerIndex, validIndex);
+    if(num_valid == 0) return;
+
+    Map<MatrixXd> X(stdGeno, num_indi, num_valid);
+    MatrixXd Z = X.transpose() * evec;
+    VectorXd scale = (eval * (double)num_valid_markers).cwiseInverse();
+
+    string chr, snp, pos, a1, a2;
+    vector<double> record(num_pc + 1);
+    for(int i = 0; i < num_valid; i++){
+        const GenoBufItem &item = gbufitems[validIndex[i]];
+        std::istringstream marker_str(marker->getMarkerStrExtract(item.extractedMarkerIndex));
+        marker_str >> chr >> snp >> pos >> a1 >> a2;
+        record[0] = item.mean;
+        o_pcl << snp << "\t" << a1 << "\t" << a2 << "\t" << item.mean;
+        for(uint32_t j = 0; j < num_pc; j++){
+            record[j + 1] = Z(i, j) * scale(j);
+            o_pcl << "\t" << record[j + 1];
+        }
+        o_pcl << "\n";
+
+        pcl_names += snp + "\t" + a1 + "\t" + a2 + "\n";
+        if(fwrite(record.data(), sizeof(double), num_pc + 1, o_pcl_bin) != num_pc + 1){
+            LOGGER.e(0, "can't write to [" + options["out"] + bin_suffix + "].");
+        }
+    }
+    num_loading_markers += num_valid;
+}
+
+void PCA::processPCAApprox(){
+    vector<uint32_t> processIndex = marker->get_extract_index_autosome();
+    int max_iter = (int)options_d["pca_iter"];
+    const double tol = 1e-4;
+    LOGGER.i(0, "Computing the top " + to_string(num_pc) + " PCs of " + to_string(num_indi) + " samples from "
+            + to_string(processIndex.size()) + " SNPs on the autosomes, block size " + to_string(num_block) + "...");
+
+    std::mt19937 rng((uint32_t)options_d["seed"]);
+    std::normal_distribution<double> rnorm;
+    Q.resize(num_indi, num_block);
+    for(uint32_t j = 0; j < num_block; j++){
+        for(uint32_t i = 0; i < num_indi; i++){
+            Q(i, j) = rnorm(rng);
+        }
+    }
+    Q = HouseholderQR<MatrixXd>(Q).householderQ() * MatrixXd::Identity(num_indi, num_block);
+
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(std::bind(&PCA::multiply, this, _1, _2));
+
+    VectorXd resid;
+    double max_resid = 0.0;
+    bool converged = false;
+    int iter = 0;
+    for(iter = 1; iter <= max_iter; iter++){
+        Y.setZero(num_indi, num_block);
+        num_valid_markers = 0;
+        geno->loopDouble(processIndex, nMarkerBlock, true, true, true, false, callBacks, false);
+        if(num_valid_markers < num_pc){
+            LOGGER.e(0, "only " + to_string(num_valid_markers) + " valid SNPs, not enough to compute " + to_string(num_pc) + " PCs.");
+        }
+        Y /= num_valid_markers;
+
+        // Rayleigh-Ritz on span(Q), residual ||A v - theta v|| with A v = Y s
+        MatrixXd T = Q.transpose() * Y;
+        SelfAdjointEigenSolver<MatrixXd> saes(T);
+        MatrixXd S = saes.eigenvectors().rowwise().reverse().leftCols(num_pc);
+        eval = saes.eigenvalues().reverse().head(num_pc);
+        evec.noalias() = Q * S;
+        resid = (Y * S - evec * eval.asDiagonal()).colwise().norm().transpose();
+        max_resid = resid.maxCoeff() / std::max(std::fabs(eval(0)), 1e-10);
+        LOGGER.i(1, "Iteration " + to_string(iter) + ", max relative residual " + to_string(max_resid));
+        if(max_resid < tol){
+            converged = true;
+            break;
+        }
+        Q = HouseholderQR<MatrixXd>(Y).householderQ() * MatrixXd::Identity(num_indi, num_block);
+    }
+    Q.resize(0, 0);
+    Y.resize(0, 0);
+
+    if(converged){
+        LOGGER.i(0, "Converged after " + to_string(iter) + " iterations.");
+    }else{
+        LOGGER.w(0, "not converged after " + to_string(max_iter) + " iterations, max relative residual "
+                + to_string(max_resid) + ". Try a larger --pca-iter.");
+    }
+    LOGGER << "PC\tEigenvalue\tResidual" << std::endl;
+    for(uint32_t i = 0; i < num_pc; i++){
+        LOGGER << i + 1 << "\t" << eval(i) << "\t" << resid(i) << std::endl;
+    }
+    LOGGER.i(0, "Used " + to_string(num_valid_markers) + " valid SNPs.");
+
+    output(options["out"]);
+
+    // one more sweep for the SNP loadings
+    string pcl_file = options["out"] + ".pcl";
+    o_pcl.open(pcl_file.c_str());
+    if(!o_pcl){
+        LOGGER.e(0, "cannot open the file [" + pcl_file + "] to write.");
+    }
+    o_pcl << "SNP\tA1\tA2\tmu";
+    for(uint32_t i = 0; i < num_pc; i++) o_pcl << "\tpc" << i + 1 << "_loading";
+    o_pcl << "\n";
+    string pcl_bin_file = options["out"] + bin_suffix;
+    o_pcl_bin = fopen(pcl_bin_file.c_str(), "wb");
+    if(!o_pcl_bin){
+        LOGGER.e(0, "cannot open the file [" + pcl_bin_file + "] to write.");
+    }
+    PCLHeader head;
+    memset(&head, 0, sizeof(PCLHeader));
+    fwrite(&head, sizeof(PCLHeader), 1, o_pcl_bin);
+    pcl_names.clear();
+
+    LOGGER.i(0, "Calculating PC loadings of SNPs...");
+    callBacks.clear();
+    callBacks.push_back(std::bind(&PCA::loading, this, _1, _2));
+    num_loading_markers = 0;
+    geno->loopDouble(processIndex, nMarkerBlock, true, true, true, false, callBacks, false);
+    if(num_loading_markers != num_valid_markers){
+        LOGGER.e(0, "inconsistent number of valid SNPs between the genotype sweeps.");
+    }
+    o_pcl.close();
+
+    memcpy(head.magic, "GPCL", 4);
+    head.version = 1;
+    head.num_marker = num_valid_markers;
+    head.num_pc = num_pc;
+    head.byte_names = pcl_names.size();
+    if(fwrite(pcl_names.data(), 1, pcl_names.size(), o_pcl_bin) != pcl_names.size() ||
+            fseek(o_pcl_bin, 0, SEEK_SET) != 0 || fwrite(&head, sizeof(PCLHeader), 1, o_pcl_bin) != 1){
+        LOGGER.e(0, "can't write to [" + pcl_bin_file + "].");
+    }
+    fclose(o_pcl_bin);
+    o_pcl_bin = NULL;
+    pcl_names.clear();
+    LOGGER.i(0, "The PC loadings of " + to_string(num_valid_markers) + " SNPs have been saved in [" + pcl_file + "] and [" + pcl_bin_file + "].");
+}
+
+// prefix.pcl.bin is preferred, otherwise the text prefix.pcl (from --pc-loading) is parsed
+void PCA::readLoading(string prefix){
+    string bin_file = prefix + bin_suffix;
+    FILE *h_bin = fopen(bin_file.c_str(), "rb");
+    if(h_bin){
+        fclose(h_bin);
+        LOGGER.i(0, "Reading PC loadings of SNPs from [" + bin_file + "]...");
+        pcl_file.reset(new MappedFile(bin_file));
+        const char *mapped = pcl_file->data();
+        PCLHeader head;
+        if(pcl_file->size() < sizeof(PCLHeader)){
+            LOGGER.e(0, "[" + bin_file + "] is not a binary PC loading file.");
+        }
+        memcpy(&head, mapped, sizeof(PCLHeader));
+        if(memcmp(head.magic, "GPCL", 4) != 0 || head.version != 1){
+            LOGGER.e(0, "[" + bin_file + "] is not a binary PC loading file.");
+        }
+        pcl_num_pc = head.num_pc;
+        uint64_t num_record = head.num_marker;
+        uint64_t byte_records = sizeof(double) * num_record * (pcl_num_pc + 1);
+        if(pcl_file->size() != sizeof(PCLHeader) + byte_records + head.byte_names){
+            LOGGER.e(0, "the size of [" + bin_file + "] is not correct, the file may be truncated.");
+        }
+        pcl_records = (const double *)(mapped + sizeof(PCLHeader));
+
+        const char *line_start = mapped + sizeof(PCLHeader) + byte_records;
+        const char *names_end = line_start + head.byte_names;
+        pcl_snps.reserve(num_record);
+        pcl_a1.reserve(num_record);
+        pcl_a2.reserve(num_record);
+        while(line_start < names_end){
+            const char *line_end = (const char *)memchr(line_start, '\n', names_end - line_start);
+            if(!line_end) line_end = names_end;
+            std::istringstream line(string(line_start, line_end - line_start));
+            string snp, a1, a2;
+            line >> snp >> a1 >> a2;
+            pcl_snps.push_back(snp);
+            pcl_a1.push_back(a1);
+            pcl_a2.push_back(a2);
+            line_start = line_end + 1;
+        }
+        if(pcl_snps.size() != num_record){
+            LOGGER.e(0, "the number of SNPs does not match the loadings in [" + bin_file + "].");
+        }
+    }else{
+        string text_file = prefix + ".pcl";
+        std::ifstream h_pcl(text_file.c_str());
+        if(!h_pcl){
+            LOGGER.e(0, "cannot open the loading file [" + text_file + "] or [" + bin_file + "] to read.");
+        }
+        LOGGER.i(0, "Reading PC loadings of SNPs from [" + text_file + "]...");
+        string line;
+        std::getline(h_pcl, line);
+        pcl_num_pc = std::count(line.begin(), line.end(), 'p');
+        uint64_t line_number = 1;
+        while(std::getline(h_pcl, line)){
+            line_number++;
+            std::istringstream line_buf(line);
+            string snp, a1, a2;
+            if(!(line_buf >> snp)) continue;
+            line_buf >> a1 >> a2;
+            double value;
+            for(uint32_t i = 0; i < pcl_num_pc + 1; i++){
+                if(!(line_buf >> value)){
+                    LOGGER.e(0, "invalid number of columns at line " + to_string(line_number) + " of [" + text_file + "].");
+                }
+                pcl_buffer.push_back(value);
+            }
+            pcl_snps.push_back(snp);
+            pcl_a1.push_back(a1);
+            pcl_a2.push_back(a2);
+        }
+        pcl_records = pcl_buffer.data();
+    }
+    LOGGER.i(0, "Number of PC loading vectors: " + to_string(pcl_num_pc) + ", number of SNPs: " + to_string(pcl_snps.size()) + ".");
+}
+
+// x = (g - mu) / sqrt(mu * (1 - mu / 2)) with mu of the reference samples, 0 if missing
+void PCA::project(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    vector<int> validIndex;
+    int num_valid = decode(buf, markerIndex, validIndex);
+    if(num_valid == 0) return;
+
+    MatrixXd L(num_valid, num_pc);
+    #pragma omp parallel for
+    for(int i = 0; i < num_valid; i++){
+        const GenoBufItem &item = gbufitems[validIndex[i]];
+        const double *record = pcl_records + (uint64_t)marker_record[item.extractedMarkerIndex] * (pcl_num_pc + 1);
+        double mu = record[0];
+        double var = mu * (1.0 - 0.5 * mu);
+        double rdev = var > 1.0e-50 ? 1.0 / sqrt(var) : 0.0;
+        double *x = stdGeno + (uint64_t)i * num_indi;
+        const uintptr_t *miss = item.missing.data();
+        for(uint32_t j = 0; j < num_indi; j++){
+            x[j] = ((miss[j / 64] >> (j % 64)) & 1UL) ? 0.0 : (x[j] - mu) * rdev;
+        }
+        for(uint32_t k = 0; k < num_pc; k++){
+            L(i, k) = record[k + 1];
+        }
+    }
+
+    Map<MatrixXd> X(stdGeno, num_indi, num_valid);
+    PCs.noalias() += X * L;
+    num_valid_markers += num_valid;
+}
+
+void PCA::processProject(){
+    readLoading(options["pcl"]);
+    if(num_pc > pcl_num_pc){
+        LOGGER.e(0, "only " + to_string(pcl_num_pc) + " vectors of PC loadings available, thus not able to project onto "
+                + to_string(num_pc) + " PCs.");
+    }
+
+    // A_rev takes A1 of the loadings as the effect allele, thus the genotypes are counted in the same allele
+    vector<uint32_t> extract_index, list_index;
+    marker->matchExtractAllele(pcl_snps, pcl_a1, pcl_a2, extract_index, list_index);
+    vector<uint8_t> found(pcl_snps.size(), 0);
+    marker_record.assign(marker->count_extract(), -1);
+    for(int i = 0; i < extract_index.size(); i++){
+        marker_record[extract_index[i]] = list_index[i];
+        found[list_index[i]] = 1;
+    }
+    std::sort(extract_index.begin(), extract_index.end());
+    LOGGER.i(0, to_string(extract_index.size()) + " SNPs are matched to the loadings by name and alleles.");
+    if(extract_index.size() == 0){
+        LOGGER.e(0, "no SNP in common between the loadings and the target genotypes.");
+    }
+    if(extract_index.size() < pcl_snps.size()){
+        string miss_file = options["out"] + ".proj.missnp";
+        std::ofstream h_miss(miss_file.c_str());
+        for(int i = 0; i < pcl_snps.size(); i++){
+            if(!found[i]) h_miss << pcl_snps[i] << "\n";
+        }
+        h_miss.close();
+        LOGGER.w(0, to_string(pcl_snps.size() - extract_index.size()) + " SNPs are not found or alleles mismatch in the target genotype");
+        LOGGER.i(0, "See [" + miss_file + "] for details. If there are many missing SNPs, the projection might be biased.");
+    }
+
+    // the output is opened before the sweep so that an unwritable path fails early
+    string out_file = options["out"] + ".proj.eigenvec";
+    std::ofstream o_proj(out_file.c_str());
+    if(!o_proj) LOGGER.e(0, "failed to open the file [" + out_file + "] to write.");
+
+    LOGGER.i(0, "Projecting " + to_string(num_indi) + " samples onto " + to_string(num_pc) + " PCs...");
+    PCs.setZero(num_indi, num_pc);
+    num_valid_markers = 0;
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(std::bind(&PCA::project, this, _1, _2));
+    // the target samples may be few or monomorphic, the SNPs are standardised by mu of the loadings only
+    geno->setNoFilter(true);
+    geno->loopDouble(extract_index, nMarkerBlock, true, false, false, true, callBacks);
+    geno->setNoFilter(false);
+    LOGGER.i(0, "Used " + to_string(num_valid_markers) + " valid SNPs.");
+
+    vector<string> ids = pheno->get_id(0, num_indi - 1, "\t");
+    for(uint32_t i = 0; i < num_indi; i++){
+        o_proj << ids[i] << "\t";
+        for(uint32_t j = 0; j < num_pc; j++){
+            o_proj << PCs(i, j) << "\t";
+        }
+        o_proj << "\n";
+    }
+    o_proj.close();
+    LOGGER.i(0, "The projected PCs have been saved in [" + out_file + "].");
+}
+
+void PCA::output(string out_name){
+    string eval_file = out_name + ".eigenval";
+    std::ofstream o_eval(eval_file.c_str());
+    if(!o_eval) LOGGER.e(0, "cannot open the file [" + eval_file + "] to write.");
+    for(uint32_t i = 0; i < num_pc; i++) o_eval << eval(i) << "\n";
+    o_eval.close();
+    LOGGER.i(0, "The first " + to_string(num_pc) + " eigenvalues have been saved in [" + eval_file + "].");
+
+    string evec_file = out_name + ".eigenvec";
+    std::ofstream o_evec(evec_file.c_str());
+    if(!o_evec) LOGGER.e(0, "cannot open the file [" + evec_file + "] to write.");
+    vector<string> ids = pheno->get_id(0, num_indi - 1, " ");
+    for(uint32_t i = 0; i < num_indi; i++){
+        o_evec << ids[i];
+        for(uint32_t j = 0; j < num_pc; j++) o_evec << " " << evec(i, j);
+        o_evec << "\n";
+    }
+    o_evec.close();
+    LOGGER.i(0, "The first " + to_string(num_pc) + " eigenvectors of " + to_string(num_indi) + " samples have been saved in [" + evec_file + "].");
+}
+
+int PCA::registerOption(map<string, vector<string>>& options_in){
+    int returnValue = 0;
+    options["out"] = options_in["out"][0];
+
+    string curFlag = "--pca-approx";
+    if(options_in.find(curFlag) != options_in.end()){
+        options_d["pca_num"] = 20;
+        if(options_in[curFlag].size() == 1){
+            try{
+                options_d["pca_num"] = std::stoi(options_in[curFlag][0]);
+            }catch(std::invalid_argument&){
+                LOGGER.e(0, curFlag + " takes the number of PCs.");
+            }
+            if(options_d["pca_num"] < 1){
+                LOGGER.e(0, "the value to be specified after " + curFlag + " should be positive.");
+            }
+        }else if(options_in[curFlag].size() > 1){
+            LOGGER.e(0, curFlag + " takes only one argument.");
+        }
+        processFunctions.push_back("pca_approx");
+        options_in.erase(curFlag);
+        returnValue++;
+    }
+
+    curFlag = "--project-loading";
+    if(options_in.find(curFlag) != options_in.end()){
+        if(options_in[curFlag].size() != 2){
+            LOGGER.e(0, curFlag + " takes the prefix of the loading file and the number of PCs.");
+        }
+        options["pcl"] = options_in[curFlag][0];
+        try{
+            options_d["pca_num"] = std::stoi(options_in[curFlag][1]);
+        }catch(std::invalid_argument&){
+            LOGGER.e(0, "invalid number of PCs to output.");
+        }
+        if(options_d["pca_num"] < 1 || options_d["pca_num"] > 1e3){
+            LOGGER.e(0, "invalid number of PCs to output.");
+        }
+        processFunctions.push_back("project_loading");
+        options_in.erase(curFlag);
+        returnValue++;
+    }
+
+    options_d["pca_iter"] = 20;
+    curFlag = "--pca-iter";
+    if(options_in.find(curFlag) != options_in.end()){
+        if(options_in[curFlag].size() == 1){
+            try{
+                options_d["pca_iter"] = std::stoi(options_in[curFlag][0]);
+            }catch(std::invalid_argument&){
+                LOGGER.e(0, curFlag + " takes an integer.");
+            }
+            if(options_d["pca_iter"] < 1){
+                LOGGER.e(0, "the value to be specified after " + curFlag + " should be positive.");
+            }
+        }else{
+            LOGGER.e(0, curFlag + " takes only one argument.");
+        }
+        options_in.erase(curFlag);
+    }
+
+    // --seed is shared with fastGWA
+    options_d["seed"] = 0;
+    curFlag = "--seed";
+    if(options_in.find(curFlag) != options_in.end() && options_in[curFlag].size() >= 1){
+        options_d["seed"] = std::stod(options_in[curFlag][0]);
+    }
+
+    return returnValue;
+}
+
+void PCA::processMain(){
+    for(auto &process_function : processFunctions){
+        if(process_function == "pca_approx"){
+            Pheno pheno;
+            Marker marker;
+            PCA pca(&pheno, &marker);
+            pca.processPCAApprox();
+            return;
+        }
+
+        if(process_function == "project_loading"){
+            Pheno pheno;
+            Marker marker;
+            PCA pca(&pheno, &marker);
+            pca.processProject();
+            return;
+        }
+    }
+}
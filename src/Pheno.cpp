@@ -93,22 +93,35 @@ Pheno::Pheno() {
             LOGGER.e(0, " duplicated IDs found in the phenotype data.");
         }
 
-        int cur_pheno = 1;
+        vector<int> cur_phenos = {1};
         if(options.find("mpheno") != options.end()){
-            try{
-                cur_pheno = std::stoi(options["mpheno"]);
-            }catch(std::invalid_argument&){
-                LOGGER.e(0, "non-numberic value specified for –mpheno.");
-            }
+            cur_phenos = parse_mpheno(options["mpheno"]);
         }
 
-        if(cur_pheno <= 0 || cur_pheno > phenos.size()){
-            LOGGER.e(0, "the value specified for --mpheno can't be less than 0 or larger than the total number of columns in .pheno file.");
+        for(int cur_pheno : cur_phenos){
+            if(cur_pheno <= 0 || cur_pheno > phenos.size()){
+                LOGGER.e(0, "the value specified for --mpheno can't be less than 0 or larger than the total number of columns in .pheno file.");
+            }
         }
 
-        cur_pheno -= 1;
-
-        update_pheno(pheno_subjects, phenos[cur_pheno]);
+        // multiple traits are kept on the samples with non-missing values in all of them
+        for(int cur_pheno : cur_phenos){
+            update_pheno(pheno_subjects, phenos[cur_pheno - 1]);
+        }
+        if(cur_phenos.size() > 1){
+            // only the values of the kept samples, the first trait is left in pheno
+            mpheno_index = index_keep;
+            mphenos.resize(cur_phenos.size());
+            for(int i = cur_phenos.size() - 1; i >= 0; i--){
+                update_pheno(pheno_subjects, phenos[cur_phenos[i] - 1]);
+                mphenos[i].resize(mpheno_index.size());
+                for(int j = 0; j < mpheno_index.size(); j++){
+                    mphenos[i][j] = pheno[mpheno_index[j]];
+                }
+            }
+            mpheno_cols = cur_phenos;
+            LOGGER.i(0, to_string(cur_phenos.size()) + " phenotypes are read.");
+        }
         LOGGER.i(0, to_string(index_keep.size()) + " overlapping individuals with non-missing data to be included from the phenotype file.");
         
     }
@@ -624,6 +637,66 @@ void Pheno::get_pheno(vector<string>& ids, vector<double>& pheno){
 }
 
 
+uint32_t Pheno::count_pheno(){
+    return mphenos.size() ? mphenos.size() : 1;
+}
+
+int Pheno::get_pheno_col(uint32_t trait){
+    return mphenos.size() ? mpheno_cols[trait] : 1;
+}
+
+void Pheno::get_pheno(vector<string>& ids, vector<double>& pheno, uint32_t trait){
+    if(trait >= count_pheno()){
+        LOGGER.e(0, "phenotype " + to_string(trait + 1) + " is out of the phenotypes read.");
+    }
+    if(mphenos.size()){
+        const vector<double> &cur_pheno = mphenos[trait];
+        ids.clear();
+        ids.reserve(index_keep.size());
+        pheno.clear();
+        pheno.reserve(index_keep.size());
+        for(auto& index : index_keep){
+            auto pos = std::lower_bound(mpheno_index.begin(), mpheno_index.end(), index);
+            if(pos != mpheno_index.end() && *pos == index){
+                ids.push_back(mark[index]);
+                pheno.push_back(cur_pheno[pos - mpheno_index.begin()]);
+            }
+        }
+    }else{
+        get_pheno(ids, pheno);
+    }
+}
+
+// --mpheno 1 or a list of columns, e.g. 1,3,5-8
+vector<int> Pheno::parse_mpheno(string mpheno){
+    vector<int> cols;
+    vector<string> items;
+    boost::split(items, mpheno, boost::is_any_of(","));
+    try{
+        for(auto &item : items){
+            size_t pos_range = item.find('-', 1);
+            if(pos_range == string::npos){
+                cols.push_back(std::stoi(item));
+            }else{
+                int col_start = std::stoi(item.substr(0, pos_range));
+                int col_end = std::stoi(item.substr(pos_range + 1));
+                if(col_end < col_start){
+                    LOGGER.e(0, "invalid range " + item + " in --mpheno.");
+                }
+                for(int col = col_start; col <= col_end; col++){
+                    cols.push_back(col);
+                }
+            }
+        }
+    }catch(std::invalid_argument&){
+        LOGGER.e(0, "non-numberic value specified for –mpheno.");
+    }
+    if(hasVectorDuplicate(cols)){
+        LOGGER.e(0, "duplicated columns specified for --mpheno.");
+    }
+    return cols;
+}
+
 uint8_t Pheno::extract_genobit(uint8_t *const buf, int index_in_keep) {
     //return 3;
     uint32_t raw_index = index_keep[index_in_keep];
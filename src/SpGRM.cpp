@@ -0,0 +1,235 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Binary sparse GRM: write, convert from .grm.sp and memory-map for reading
+
+   Developed by Zhili Zheng<zhilizheng@outlook.com>
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SpGRM.h"
+#include "Logger.h"
+#include "Pheno.h"
+#include "zlib.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+#include <utility>
+
+using std::to_string;
+
+static_assert(sizeof(SpGRMHeader) == 64, "the header of the binary sparse GRM shall be 64 bytes");
+static_assert(sizeof(long long) == 8 && sizeof(double) == 8, "64-bit index and value are required");
+
+const string SpGRM::suffix = ".grm.spb";
+
+// crc32 of zlib takes 32-bit length only
+static uint32_t update_crc(uint32_t crc, const void *buf, uint64_t size){
+    const Bytef *p = (const Bytef *)buf;
+    const uint64_t max_chunk = 1UL << 30;
+    while(size){
+        uInt cur_size = (uInt)(size > max_chunk ? max_chunk : size);
+        crc = crc32(crc, p, cur_size);
+        p += cur_size;
+        size -= cur_size;
+    }
+    return crc;
+}
+
+SpGRM::SpGRM(string filename, bool bCheckSum) : file(filename){
+    const char *mapped = file.data();
+    uint64_t mapped_size = file.size();
+    if(mapped_size < sizeof(SpGRMHeader)){
+        LOGGER.e(0, "[" + filename + "] is not a binary sparse GRM.");
+    }
+
+    memcpy(&header, mapped, sizeof(SpGRMHeader));
+    if(memcmp(header.magic, "GSPB", 4) != 0){
+        LOGGER.e(0, "[" + filename + "] is not a binary sparse GRM.");
+    }
+    if(header.version != version){
+        LOGGER.e(0, "unsupported version " + to_string(header.version) + " of the binary sparse GRM [" + filename + "].");
+    }
+    uint64_t n = header.num_indi;
+    uint64_t nnz = header.num_nonzero;
+    uint64_t expect_size = sizeof(SpGRMHeader) + sizeof(long long) * (n + 1 + nnz) + sizeof(double) * nnz + header.byte_ids;
+    if(expect_size != mapped_size){
+        LOGGER.e(0, "the size of [" + filename + "] is not correct, the file may be truncated.");
+    }
+
+    const char *body = mapped + sizeof(SpGRMHeader);
+    if(bCheckSum && update_crc(crc32(0L, Z_NULL, 0), body, mapped_size - sizeof(SpGRMHeader)) != header.checksum){
+        LOGGER.e(0, "checksum mismatch in [" + filename + "], the file is corrupted.");
+    }
+
+    outer = (const long long *)body;
+    inner = outer + n + 1;
+    values = (const double *)(inner + nnz);
+    bool isValidOuter = (outer[0] == 0 && (uint64_t)outer[n] == nnz);
+    for(uint64_t index = 0; isValidOuter && index < n; index++){
+        if(outer[index] > outer[index + 1]) isValidOuter = false;
+    }
+    if(!isValidOuter){
+        LOGGER.e(0, "invalid column index in [" + filename + "].");
+    }
+
+    const char *id_start = (const char *)(values + nnz);
+    const char *id_end = id_start + header.byte_ids;
+    ids.reserve(n);
+    while(id_start < id_end){
+        const char *line_end = (const char *)memchr(id_start, '\n', id_end - id_start);
+        if(!line_end) line_end = id_end;
+        ids.emplace_back(id_start, line_end - id_start);
+        id_start = line_end + 1;
+    }
+    if(ids.size() != n){
+        LOGGER.e(0, "the number of sample IDs does not match the sparse GRM in [" + filename + "].");
+    }
+}
+
+void SpGRM::release(const void *ptr, uint64_t size) const{
+    file.release((const char *)ptr - file.data(), size);
+}
+
+void SpGRM::write(string filename, const vector<string> &ids, const vector<uint32_t> &id1,
+        const vector<uint32_t> &id2, const vector<double> &grm){
+    uint64_t n = ids.size();
+    uint64_t num_pairs = id1.size();
+    if(id2.size() != num_pairs || grm.size() != num_pairs){
+        LOGGER.e(0, "inconsistent number of items to save the binary sparse GRM.");
+    }
+
+    // both triangles go into the columns
+    vector<long long> outer(n + 1, 0);
+    for(uint64_t index = 0; index < num_pairs; index++){
+        if(id1[index] >= n || id2[index] > id1[index]){
+            LOGGER.e(0, "invalid pair (" + to_string(id1[index]) + ", " + to_string(id2[index]) + ") in the sparse GRM.");
+        }
+        outer[id2[index] + 1]++;
+        if(id1[index] != id2[index]){
+            outer[id1[index] + 1]++;
+        }
+    }
+    std::partial_sum(outer.begin(), outer.end(), outer.begin());
+    uint64_t nnz = outer[n];
+
+    vector<long long> inner(nnz);
+    vector<double> values(nnz);
+    vector<long long> pos(outer.begin(), outer.end() - 1);
+    for(uint64_t index = 0; index < num_pairs; index++){
+        uint32_t row = id1[index], col = id2[index];
+        inner[pos[col]] = row;
+        values[pos[col]++] = grm[index];
+        if(row != col){
+            inner[pos[row]] = col;
+            values[pos[row]++] = grm[index];
+        }
+    }
+
+    // row indices shall be ascending in each column; it is already the case if the pairs are sorted by id1 then id2
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(int64_t col = 0; col < (int64_t)n; col++){
+        long long start = outer[col], end = outer[col + 1];
+        if(std::is_sorted(inner.begin() + start, inner.begin() + end)) continue;
+        vector<std::pair<long long, double>> items;
+        items.reserve(end - start);
+        for(long long k = start; k < end; k++){
+            items.emplace_back(inner[k], values[k]);
+        }
+        std::sort(items.begin(), items.end());
+        for(long long k = start; k < end; k++){
+            inner[k] = items[k - start].first;
+            values[k] = items[k - start].second;
+        }
+    }
+
+    string id_block;
+    for(auto &id : ids){
+        id_block += id + "\n";
+    }
+
+    SpGRMHeader head;
+    memset(&head, 0, sizeof(SpGRMHeader));
+    memcpy(head.magic, "GSPB", 4);
+    head.version = version;
+    head.num_indi = n;
+    head.num_nonzero = nnz;
+    head.byte_ids = id_block.size();
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    crc = update_crc(crc, outer.data(), sizeof(long long) * outer.size());
+    crc = update_crc(crc, inner.data(), sizeof(long long) * nnz);
+    crc = update_crc(crc, values.data(), sizeof(double) * nnz);
+    crc = update_crc(crc, id_block.data(), id_block.size());
+    head.checksum = crc;
+
+    FILE *h_out = fopen(filename.c_str(), "wb");
+    if(!h_out){
+        LOGGER.e(0, "can't open [" + filename + "] to write.");
+    }
+    if(fwrite(&head, sizeof(SpGRMHeader), 1, h_out) != 1 ||
+            fwrite(outer.data(), sizeof(long long), n + 1, h_out) != n + 1 ||
+            fwrite(inner.data(), sizeof(long long), nnz, h_out) != nnz ||
+            fwrite(values.data(), sizeof(double), nnz, h_out) != nnz ||
+            fwrite(id_block.data(), 1, id_block.size(), h_out) != id_block.size()){
+        LOGGER.e(0, "can't write to [" + filename + "].");
+    }
+    fclose(h_out);
+}
+
+void SpGRM::convert(string sp_prefix, string filename){
+    string id_file = sp_prefix + ".grm.id";
+    string sp_file = sp_prefix + ".grm.sp";
+    LOGGER.i(0, "Reading the sparse GRM from [" + sp_file + "]...");
+    vector<string> ids = Pheno::read_sublist(id_file);
+    uint64_t n = ids.size();
+
+    std::ifstream pair_list(sp_file.c_str());
+    if(!pair_list){
+        LOGGER.e(0, "can't read [" + sp_file + "].");
+    }
+    vector<uint32_t> id1, id2;
+    vector<double> grm;
+    string line;
+    uint64_t line_number = 0;
+    while(std::getline(pair_list, line)){
+        line_number++;
+        const char *p = line.c_str();
+        char *p_end;
+        unsigned long tmp_id1 = strtoul(p, &p_end, 10);
+        if(p_end == p) continue;
+        p = p_end;
+        unsigned long tmp_id2 = strtoul(p, &p_end, 10);
+        if(p_end == p){
+            LOGGER.e(0, "line " + to_string(line_number) + " of [" + sp_file + "] has less than 3 columns.");
+        }
+        p = p_end;
+        double tmp_grm = strtod(p, &p_end);
+        if(p_end == p){
+            LOGGER.e(0, "line " + to_string(line_number) + " of [" + sp_file + "] has less than 3 columns.");
+        }
+        if(tmp_id1 >= n || tmp_id2 >= n){
+            LOGGER.e(0, "line " + to_string(line_number) + " of [" + sp_file + "] has an index out of the samples in [" + id_file + "].");
+        }
+        if(tmp_id1 < tmp_id2){
+            std::swap(tmp_id1, tmp_id2);
+        }
+        id1.push_back(tmp_id1);
+        id2.push_back(tmp_id2);
+        grm.push_back(tmp_grm);
+    }
+    pair_list.close();
+    LOGGER.i(0, to_string(grm.size()) + " items of " + to_string(n) + " samples have been read.");
+
+    write(filename, ids, id1, id2, grm);
+    LOGGER.i(0, "The binary sparse GRM has been saved in the file [" + filename + "].");
+}
@@ -25,6 +25,8 @@
 #include "Covar.h"
 #include "FastFAM.h"
 #include "LD.h"
+#include "PCA.h"
+#include "AssocStore.h"
 #include <functional>
 #include <map>
 #include <vector>
@@ -88,12 +90,13 @@ int main(int argc, char *argv[]){
         "--cg", "--ldlt", "--llt", "--pardiso", "--tcg", "--lscg", "--save-inv", "--load-inv",
         "--update-ref-allele", "--update-freq", "--update-sex", "--mbfile", "--freqx", "--make-grm-xchr", "--make-grm-xchr-part", "--dc", "--make-grm-alg",
         "--make-bed", "--recodet", "--sum-geno-x", "--sample", "--bgen", "--mbgen", "--hard-call-thresh", "--dosage-call", "--dosage", "--mgrm", "--unify-grm", "--rel-only", 
-        "--ld-matrix", "--r", "--ld-wind", "--r2", "--subtract-grm", "--save-pheno", "--save-bin", "--no-marker", "--joint-covar", "--sparse-cutoff", "--noblas", "--fastGWA-gram",
+        "--ld-matrix", "--r", "--ld-wind", "--r2", "--subtract-grm", "--save-pheno", "--save-bin", "--no-marker", "--joint-covar", "--sparse-cutoff", "--make-grm-sparse", "--sparse-prescreen", "--make-grm-spb", "--spb-checksum", "--make-grm-compact", "--make-grm-loco", "--grm-bins", "--grm-append", "--save-grm-acc", "--grm-acc-add", "--grm-acc-subtract", "--pca-approx", "--pca-iter", "--project-loading", "--noblas", "--fastGWA-gram",
         "--inv-t1", "--est-vg", "--force-gwa", "--reml-detail", "--h2-limit", "--gwa-no-constrain", "--verbose", "--c-inf", "--c-inf-no-filter", "--geno", "--info", "--nofilter",
         "--set-list", "--burden",
         "--pfile", "--bpfile", "--mpfile", "--mbpfile", "--model-only", "--load-model", "--seed", "--fastGWA-mlm-binary", "--num-vec", "--trace-exact", "--cv-threshold", "--tao-start",
         "--acat", "--gene-list", "--snp-list", "--min-mac", "--max-maf", "--wind",
         "--envir", "--optimal-rho", "--noSandwich", "--grid-size",
+        "--save-assoc", "--query-assoc", "--query-region", "--query-p",
     };
     map<string, vector<string>> options;
     vector<string> keys;
@@ -240,7 +243,7 @@ int main(int argc, char *argv[]){
 
     //start register the options
     // Please take care of the order, C++ has few reflation feature, I did in a ugly way.
-    vector<string> module_names = {"phenotype", "marker", "genotype", "covar", "GRM", "fastFAM", "LD"};
+    vector<string> module_names = {"phenotype", "marker", "genotype", "covar", "GRM", "fastFAM", "LD", "PCA", "assoc"};
     vector<int (*)(map<string, vector<string>>&)> registers = {
             Pheno::registerOption,
             Marker::registerOption,
@@ -248,7 +251,9 @@ int main(int argc, char *argv[]){
             Covar::registerOption,
             GRM::registerOption,
             FastFAM::registerOption,
-            LD::registerOption
+            LD::registerOption,
+            PCA::registerOption,
+            AssocStore::registerOption
     };
     vector<void (*)()> processMains = {
             Pheno::processMain,
@@ -257,7 +262,9 @@ int main(int argc, char *argv[]){
             Covar::processMain,
             GRM::processMain,
             FastFAM::processMain,
-            LD::processMain
+            LD::processMain,
+            PCA::processMain,
+            AssocStore::processMain
     };
 
     vector<int> mains;
@@ -277,9 +284,10 @@ int main(int argc, char *argv[]){
         }
     }
     // other cases of not handle;
-    // can't handle --mgrm --make-grm currently.
+    // can't prune the merged GRM of --mgrm --make-grm currently.
     if(std::find(keys.begin(), keys.end(), "--make-grm") != keys.end() && 
-            std::find(keys.begin(), keys.end(), "--mgrm") != keys.end()){
+            std::find(keys.begin(), keys.end(), "--mgrm") != keys.end() &&
+            std::find(keys.begin(), keys.end(), "--grm-cutoff") != keys.end()){
         unKnownFlag = true;
     }
     bool bShowAll = false;
@@ -307,6 +315,7 @@ int main(int argc, char *argv[]){
         if(mains.size() > 1) LOGGER.e(0, "multiple main functions are not supported currently.");
         if(is_threaded) {
             LOGGER.i(0, "The program will be running with up to " + std::to_string(thread_num) + " threads.");
+            log_numa_layout();
         }
         //ThreadPool *threadPool = ThreadPool::GetPool(thread_num - 1);
         //avoid auto parallel
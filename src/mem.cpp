@@ -19,6 +19,9 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <fstream>
+#include <vector>
+#include "Logger.h"
 
 int parseLine(char* line){
     // This assumes that a digit will be found and the line ends in " Kb".
@@ -91,8 +94,81 @@ int getVMPeakKB(){
     return result;
 }
 
+void first_touch_zero(void *ptr, uint64_t size){
+    const uint64_t page = 4096;
+    int64_t num_page = (size + page - 1) / page;
+    char *p = (char *)ptr;
+    #pragma omp parallel for schedule(static)
+    for(int64_t i = 0; i < num_page; i++){
+        uint64_t offset = i * page;
+        memset(p + offset, 0, (offset + page > size) ? (size - offset) : page);
+    }
+}
 
+uint64_t getMemAvailKB(){
+    std::ifstream h_meminfo("/proc/meminfo");
+    std::string key;
+    uint64_t value;
+    while(h_meminfo >> key >> value){
+        if(key == "MemAvailable:") return value;
+        h_meminfo.ignore(256, '\n');
+    }
+    return 0;
+}
 
+// the online nodes, e.g. "0-1,4", node numbers may be sparse
+static std::vector<int> online_numa_nodes(){
+    std::vector<int> nodes;
+    std::ifstream h_online("/sys/devices/system/node/online");
+    std::string online;
+    if(!h_online || !std::getline(h_online, online)) return nodes;
+    size_t start = 0;
+    while(start < online.size()){
+        size_t end = online.find(',', start);
+        if(end == std::string::npos) end = online.size();
+        std::string range = online.substr(start, end - start);
+        size_t dash = range.find('-');
+        int from = atoi(range.c_str());
+        int to = (dash == std::string::npos) ? from : atoi(range.c_str() + dash + 1);
+        for(int node = from; node <= to; node++){
+            nodes.push_back(node);
+        }
+        start = end + 1;
+    }
+    return nodes;
+}
 
+std::string numa_layout(){
+    std::vector<std::string> nodes;
+    for(int node : online_numa_nodes()){
+        std::string cpulist_file = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        std::ifstream h_cpulist(cpulist_file.c_str());
+        if(!h_cpulist) continue;
+        std::string cpulist;
+        std::getline(h_cpulist, cpulist);
+        nodes.push_back("node" + std::to_string(node) + ": " + cpulist);
+    }
+    if(nodes.empty()) return "";
+    std::string layout = std::to_string(nodes.size()) + (nodes.size() == 1 ? " node (" : " nodes (");
+    for(size_t i = 0; i < nodes.size(); i++){
+        layout += (i ? "; " : "") + nodes[i];
+    }
+    return layout + ")";
+}
 
-
+void log_numa_layout(){
+    static bool logged = false;
+    if(logged) return;
+    logged = true;
+    if(online_numa_nodes().size() <= 1) return;
+    std::string layout = numa_layout();
+    if(layout.empty()) return;
+    const char *bind = getenv("OMP_PROC_BIND");
+    const char *places = getenv("OMP_PLACES");
+    LOGGER.i(0, "NUMA layout: " + layout + ", OMP_PROC_BIND=" + (bind ? bind : "unset") + ", OMP_PLACES=" + (places ? places : "unset") + ".");
+    bool bound = bind && strcmp(bind, "false") != 0 && strcmp(bind, "FALSE") != 0;
+    if(!bound){
+        LOGGER.i(0, "The threads are not bound, thus the first-touch placement of the buffers across the NUMA nodes is not effective: "
+                "the threads may migrate away from the memory they touched. Set OMP_PROC_BIND=close and OMP_PLACES=cores to bind them.");
+    }
+}
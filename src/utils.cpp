@@ -128,4 +128,8 @@ uint64_t getFileByteSize(FILE * file) {
     return f_size;
 }
 
-
+void appendValue(std::string &str, double value){
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%g", value);
+    str.append(buf, len);
+}
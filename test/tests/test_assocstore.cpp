@@ -0,0 +1,51 @@
+#include "gtest/gtest.h"
+#include "AssocStore.h"
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "test_config.h"
+
+static vector<string> readLines(string filename){
+    std::ifstream in(filename.c_str());
+    vector<string> lines;
+    string line;
+    while(std::getline(in, line)){
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+TEST(AssocStoreTest, WriteAndQuery){
+    vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
+    string filename = CUR_OUT_DIR + "/test.fastGWA" + AssocStore::suffix;
+    {
+        AssocStoreWriter writer(filename, header, 3);
+        double values1[] = {0.25, 0.1, 0.02, 1e-9};
+        double values2[] = {0.5, NAN, NAN, NAN};
+        double values3[] = {0.125, -0.05, 0.01, 0.03};
+        writer.add("1\trs1\t100\tA\tG", 1, 1000, true, values1);
+        writer.add("1\trs2\t200\tC\tT", 1, 990, false, values2);
+        writer.add("2\trs3\t150\tG\tA", 2, 1000, true, values3);
+        writer.close();
+    }
+
+    AssocStore store(filename);
+    string out_name = CUR_OUT_DIR + "/test_query.fastGWA";
+    string row1 = "1\trs1\t100\tA\tG\t1000\t0.25\t0.1\t0.02\t1e-09";
+    string row2 = "1\trs2\t200\tC\tT\t990\t0.5\tNA\tNA\tNA";
+    string row3 = "2\trs3\t150\tG\tA\t1000\t0.125\t-0.05\t0.01\t0.03";
+    string header_line = "CHR\tSNP\tPOS\tA1\tA2\tN\tAF1\tBETA\tSE\tP";
+
+    store.query(0, 0, UINT32_MAX, -1, {}, out_name);
+    EXPECT_EQ(readLines(out_name), vector<string>({header_line, row1, row2, row3}));
+
+    store.query(1, 150, 300, -1, {}, out_name);
+    EXPECT_EQ(readLines(out_name), vector<string>({header_line, row2}));
+
+    store.query(0, 0, UINT32_MAX, 1e-8, {}, out_name);
+    EXPECT_EQ(readLines(out_name), vector<string>({header_line, row1}));
+
+    store.query(0, 0, UINT32_MAX, -1, {"rs3", "rs4"}, out_name);
+    EXPECT_EQ(readLines(out_name), vector<string>({header_line, row3}));
+}
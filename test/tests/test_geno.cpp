@@ -15,3 +15,20 @@ TEST(test_geno, valid_geno){
     Pheno pheno(CUR_SRC_DIR + "/data/test.fam");
     Geno geno(CUR_SRC_DIR + "/data/test.bed", &pheno, &marker);
 }
+
+TEST(test_geno, reversed_effect_allele_codes){
+    double codes[4], rev_codes[4];
+    Geno::getBedCodes(false, false, 0.6, 0.6, 1.0, codes);
+    Geno::getBedCodes(false, true, 0.6, 0.6, 1.0, rev_codes);
+    EXPECT_DOUBLE_EQ(codes[0], -0.6);
+    EXPECT_DOUBLE_EQ(codes[2], 1.4);
+    // the two homozygotes swap, the heterozygote and missing stay
+    EXPECT_DOUBLE_EQ(rev_codes[0], codes[2]);
+    EXPECT_DOUBLE_EQ(rev_codes[2], codes[0]);
+    EXPECT_DOUBLE_EQ(rev_codes[1], codes[1]);
+    EXPECT_DOUBLE_EQ(rev_codes[3], codes[3]);
+
+    Geno::getBedCodes(true, true, 0.6, 0.18, 2.0, rev_codes);
+    EXPECT_DOUBLE_EQ(rev_codes[0], (2.0 * 0.6 - 2.0 - 0.18) * 2.0);
+    EXPECT_DOUBLE_EQ(rev_codes[2], -0.18 * 2.0);
+}
@@ -31,3 +31,10 @@ TEST(test_grm, test_grm){
     grm.deduce_GRM();
 
 }
+
+TEST(test_grm, cut_rel_remove){
+    // chain 0-1-2-3 and star 10-(11, 12, 13): the sample of more pairs is removed, the larger index on ties
+    vector<int> id1 = {1, 2, 3, 11, 12, 13};
+    vector<int> id2 = {0, 1, 2, 10, 10, 10};
+    EXPECT_EQ(GRM::cut_rel_remove(id1, id2), vector<int>({1, 2, 10}));
+}
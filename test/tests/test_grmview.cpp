@@ -0,0 +1,54 @@
+#include "gtest/gtest.h"
+#include "GRMView.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "test_config.h"
+
+TEST(GRMViewTest, KeepAndSave){
+    // 4 samples, GRM(i, j) = 10 * i + j for i >= j
+    string filename = CUR_OUT_DIR + "/test_view.grm.bin";
+    FILE *h_out = fopen(filename.c_str(), "wb");
+    for(int i = 0; i < 4; i++){
+        for(int j = 0; j <= i; j++){
+            float value = 10 * i + j;
+            fwrite(&value, sizeof(float), 1, h_out);
+        }
+    }
+    fclose(h_out);
+
+    GRMView view(filename, 4);
+    EXPECT_EQ(view(1, 3), 31);
+    view.setKeep({3, 1, 2});
+    EXPECT_EQ(view.size(), 3);
+    EXPECT_EQ(view(0, 2), 32);
+
+    string out_filename = CUR_OUT_DIR + "/test_view_keep.grm.bin";
+    view.save(out_filename);
+    GRMView saved(out_filename, 3);
+    vector<float> values(saved.rawData(), saved.rawData() + 6);
+    EXPECT_EQ(values, vector<float>({33, 31, 11, 32, 21, 22}));
+}
+
+TEST(GRMViewTest, CompactTiles){
+    string filename = CUR_OUT_DIR + "/test_view_tiles.grm.bin";
+    FILE *h_out = fopen(filename.c_str(), "wb");
+    for(int i = 0; i < 4; i++){
+        for(int j = 0; j <= i; j++){
+            float value = 0.5f * i + 0.25f * j;
+            fwrite(&value, sizeof(float), 1, h_out);
+        }
+    }
+    fclose(h_out);
+
+    GRMView view(filename, 4);
+    string out_filename = CUR_OUT_DIR + "/test_view_tiles_fp16.grm.bin";
+    view.save(out_filename, GRMView::ENC_FP16, true);
+    GRMView compact(out_filename, 4);
+    EXPECT_EQ(compact.rawData(), nullptr);
+    EXPECT_EQ(compact.rawAt(1, 3), 1.75f);
+    const float *row = compact.rawRow(2);
+    EXPECT_EQ(vector<float>(row, row + 3), vector<float>({1.0f, 1.25f, 1.5f}));
+    compact.release(0, 3);
+    EXPECT_EQ(compact.rawAt(3, 3), 2.25f);
+}
@@ -0,0 +1,27 @@
+#include "gtest/gtest.h"
+#include "SpGRM.h"
+#include <string>
+#include <vector>
+#include "test_config.h"
+
+TEST(SpGRMTest, WriteAndMap){
+    vector<string> ids = {"F1\tI1", "F1\tI2", "F2\tI3"};
+    // lower triangle, not sorted on purpose
+    vector<uint32_t> id1 = {2, 0, 1, 1, 2};
+    vector<uint32_t> id2 = {2, 0, 0, 1, 0};
+    vector<double> grm = {0.98, 1.01, 0.52, 1.02, -0.03};
+    string filename = CUR_OUT_DIR + "/test" + SpGRM::suffix;
+    SpGRM::write(filename, ids, id1, id2, grm);
+
+    SpGRM sp(filename, true);
+    EXPECT_EQ(sp.rows(), 3);
+    EXPECT_EQ(sp.nonZeros(), 7);
+    EXPECT_EQ(sp.getIDs(), ids);
+
+    vector<long long> outer(sp.outerIndexPtr(), sp.outerIndexPtr() + 4);
+    vector<long long> inner(sp.innerIndexPtr(), sp.innerIndexPtr() + 7);
+    vector<double> values(sp.valuePtr(), sp.valuePtr() + 7);
+    EXPECT_EQ(outer, vector<long long>({0, 3, 5, 7}));
+    EXPECT_EQ(inner, vector<long long>({0, 1, 2, 0, 1, 0, 2}));
+    EXPECT_EQ(values, vector<double>({1.01, 0.52, -0.03, 0.52, 1.02, -0.03, 0.98}));
+}